@@ -0,0 +1,66 @@
+#ifndef _MIPS_ATOMIC_H_
+#define _MIPS_ATOMIC_H_
+
+/*
+ * Atomic operations, using LL/SC like spinlock_data_testandset. An SC
+ * fails if anything else wrote the word (or we took an exception)
+ * since the LL, so each one is retried until it goes through.
+ */
+
+int atomic_add(volatile int *p, int delta);
+int atomic_cas(volatile int *p, int old, int new);
+
+////////////////////////////////////////////////////////////
+
+ATOMIC_INLINE
+int
+atomic_add(volatile int *p, int delta)
+{
+	int x;
+	int y;
+
+	do {
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   x = *p */
+			"addu %1, %0, %3;"	/*   y = x + delta */
+			"sc %1, 0(%2);"		/*   *p = y; y = success? */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "=&r" (y) : "r" (p), "r" (delta)
+			: "memory");
+	} while (y == 0);
+
+	return x + delta;
+}
+
+ATOMIC_INLINE
+int
+atomic_cas(volatile int *p, int old, int new)
+{
+	int x;
+	int y;
+
+	do {
+		/* Y stays 0 if we skip the SC */
+		y = 0;
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   x = *p */
+			"bne %0, %3, 1f;"	/*   if (x != old) give up */
+			"move %1, %4;"		/*   y = new */
+			"sc %1, 0(%2);"		/*   *p = y; y = success? */
+			"1:"
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "+r" (y) : "r" (p), "r" (old), "r" (new)
+			: "memory");
+	} while (x == old && y == 0);
+
+	return x;
+}
+
+
+#endif /* _MIPS_ATOMIC_H_ */
@@ -35,6 +35,8 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <endian.h>
+#include <copyinout.h>
 #include "opt-A2.h"
 
 
@@ -82,6 +84,12 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err;
+#if OPT_A2
+	off_t retval64;		/* for calls returning 64-bit values */
+	bool is64 = false;
+	uint64_t pos64;
+	int whence;
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -141,6 +149,94 @@ syscall(struct trapframe *tf)
 	case SYS_execv:
 	  err = sys_execv((const char *)tf->tf_a0, (char **)tf->tf_a1);
 	  break;
+
+	case SYS_open:
+	  err = sys_open((userptr_t)tf->tf_a0,
+			 (int)tf->tf_a1,
+			 (mode_t)tf->tf_a2,
+			 (int *)&retval);
+	  break;
+
+	case SYS_read:
+	  err = sys_read((int)tf->tf_a0,
+			 (userptr_t)tf->tf_a1,
+			 (unsigned int)tf->tf_a2,
+			 (int *)&retval);
+	  break;
+
+	case SYS_close:
+	  err = sys_close((int)tf->tf_a0);
+	  break;
+
+	case SYS_readv:
+	  err = sys_readv((int)tf->tf_a0,
+			  (const_userptr_t)tf->tf_a1,
+			  (int)tf->tf_a2,
+			  (int *)&retval);
+	  break;
+
+	case SYS_writev:
+	  err = sys_writev((int)tf->tf_a0,
+			   (const_userptr_t)tf->tf_a1,
+			   (int)tf->tf_a2,
+			   (int *)&retval);
+	  break;
+
+	/*
+	 * The positional calls have three 32-bit arguments before the
+	 * 64-bit offset, so the offset doesn't fit in the aligned pair
+	 * a2/a3 and is passed on the user stack at sp+16.
+	 */
+	case SYS_pread:
+	case SYS_pwrite:
+	case SYS_preadv:
+	case SYS_pwritev:
+	  err = copyin((const_userptr_t)(tf->tf_sp + 16),
+		       &pos64, sizeof(pos64));
+	  if (err) {
+	    break;
+	  }
+	  switch (callno) {
+	  case SYS_pread:
+	    err = sys_pread((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			    (unsigned int)tf->tf_a2, (off_t)pos64,
+			    (int *)&retval);
+	    break;
+	  case SYS_pwrite:
+	    err = sys_pwrite((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			     (unsigned int)tf->tf_a2, (off_t)pos64,
+			     (int *)&retval);
+	    break;
+	  case SYS_preadv:
+	    err = sys_preadv((int)tf->tf_a0, (const_userptr_t)tf->tf_a1,
+			     (int)tf->tf_a2, (off_t)pos64,
+			     (int *)&retval);
+	    break;
+	  default:
+	    err = sys_pwritev((int)tf->tf_a0, (const_userptr_t)tf->tf_a1,
+			      (int)tf->tf_a2, (off_t)pos64,
+			      (int *)&retval);
+	    break;
+	  }
+	  break;
+
+	case SYS_lseek:
+	  /* the offset is in the aligned pair a2/a3; whence is at sp+16 */
+	  join32to64(tf->tf_a2, tf->tf_a3, &pos64);
+	  err = copyin((const_userptr_t)(tf->tf_sp + 16),
+		       &whence, sizeof(whence));
+	  if (err) {
+	    break;
+	  }
+	  err = sys_lseek((int)tf->tf_a0, (off_t)pos64, whence, &retval64);
+	  is64 = true;
+	  break;
+
+	case SYS_spawn:
+	  err = sys_spawn((const_userptr_t)tf->tf_a0,
+			  (const_userptr_t)tf->tf_a1,
+			  (pid_t *)&retval);
+	  break;
 #endif
 	    
  
@@ -163,6 +259,13 @@ syscall(struct trapframe *tf)
 	else {
 		/* Success. */
 		tf->tf_v0 = retval;
+#if OPT_A2
+		if (is64) {
+			/* high word in v0, low word in v1 */
+			split64to32((uint64_t)retval64,
+				    &tf->tf_v0, &tf->tf_v1);
+		}
+#endif
 		tf->tf_a3 = 0;      /* signal no error */
 	}
 	
@@ -40,6 +40,7 @@
 #include "opt-A3.h"
 #include <mainbus.h>
 #include <syscall.h>
+#include <vnode.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -55,9 +56,25 @@
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
 #if OPT_A3
+/*
+ * One coremap entry per physical page frame. cm_index is the page's
+ * 1-based position within the allocation it belongs to (0 if the
+ * page is free), so a block of N pages reads 1, 2, ..., N.
+ *
+ * cm_refs counts the holders of a single-page allocation, on its
+ * (only) page. Normally that's 1; shared text pages are held by
+ * every address space that maps them plus the text page cache.
+ * free_kpages drops one reference and frees the page with the last.
+ */
+struct coremap_entry {
+	uint16_t cm_index;
+	uint16_t cm_refs;
+};
+
 static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
 static int number_of_pages = 0;
 static paddr_t coremap_start = 0;
+static struct coremap_entry *coremap = NULL;
 static paddr_t frame_start = 0;
 static paddr_t frame_end = 0;
 static bool coremap_created = false;
@@ -71,13 +88,17 @@ vm_bootstrap(void)
 	paddr_t curr = 0;
 	ram_getsize(&coremap_start,&curr);
 	paddr_t diff_to_start = curr - coremap_start;
-	number_of_pages = diff_to_start / (PAGE_SIZE + 4);
+	number_of_pages = diff_to_start /
+		(PAGE_SIZE + sizeof(struct coremap_entry));
 	coremap_start = PADDR_TO_KVADDR(coremap_start);
+	coremap = (struct coremap_entry *)coremap_start;
 	for (int i = 0; i < number_of_pages; i++){
-		((int *)coremap_start)[i] = 0;
+		coremap[i].cm_index = 0;
+		coremap[i].cm_refs = 0;
 	}
 	
-	frame_start = (coremap_start - MIPS_KSEG0) + number_of_pages * 4;
+	frame_start = (coremap_start - MIPS_KSEG0) +
+		number_of_pages * sizeof(struct coremap_entry);
 	paddr_t reminder = frame_start % PAGE_SIZE;
 	if (reminder != 0) {
 		frame_start = PAGE_SIZE * ((frame_start / PAGE_SIZE) + 1 );
@@ -91,6 +112,81 @@ vm_bootstrap(void)
 #endif
 }
 
+#if OPT_A3
+static
+paddr_t
+coremap_getppages(unsigned long npages)
+{
+	paddr_t addr;
+
+	spinlock_acquire(&coremap_lock);
+	addr = frame_start;
+	paddr_t ending_point = npages * PAGE_SIZE + addr;
+	while (ending_point <= frame_end){
+		bool is_found = true;
+		int entry = 0;
+		for (size_t i = 0; i < npages; i++){
+			int index = (addr + i * PAGE_SIZE - frame_start) / PAGE_SIZE;
+			entry = coremap[index].cm_index;
+			if (entry != 0){
+				is_found = false;
+				addr += PAGE_SIZE * (i + 1);
+				ending_point = PAGE_SIZE * npages + addr;
+				break;
+			}
+		}
+		
+		if (is_found){
+			for (size_t j = 0; j < npages; j++){				
+				int index = ( PAGE_SIZE * j + addr - frame_start) / PAGE_SIZE;	
+				coremap[index].cm_index = j + 1;
+				coremap[index].cm_refs = (j == 0) ? 1 : 0;
+			}
+			spinlock_release(&coremap_lock);
+			return addr;
+		}
+	}
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+static
+int
+coremap_pageindex(paddr_t paddr)
+{
+	KASSERT(paddr >= frame_start && paddr < frame_end);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	return (paddr - frame_start) / PAGE_SIZE;
+}
+
+/*
+ * Add a reference to single page PADDR (see struct coremap_entry).
+ */
+void
+coremap_incref(paddr_t paddr)
+{
+	int index = coremap_pageindex(paddr);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[index].cm_index == 1);
+	KASSERT(coremap[index].cm_refs > 0);
+	coremap[index].cm_refs++;
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+coremap_refcount(paddr_t paddr)
+{
+	int index = coremap_pageindex(paddr);
+	unsigned refs;
+
+	spinlock_acquire(&coremap_lock);
+	refs = coremap[index].cm_refs;
+	spinlock_release(&coremap_lock);
+	return refs;
+}
+#endif
+
 static
 paddr_t
 getppages(unsigned long npages)
@@ -99,34 +195,14 @@ getppages(unsigned long npages)
 
 #if OPT_A3
 	if (coremap_created) {
-		spinlock_acquire(&coremap_lock);
-		addr = frame_start;
-		paddr_t ending_point = npages * PAGE_SIZE + addr;
-		while (ending_point <= frame_end){
-			bool is_found = true;
-			int entry = 0;
-			for (size_t i = 0; i < npages; i++){
-				int index = (addr + i * PAGE_SIZE - frame_start) / PAGE_SIZE;
-				entry = ((int *)coremap_start)[index];
-				if (entry != 0){
-					is_found = false;
-					addr += PAGE_SIZE * (i + 1);
-					ending_point = PAGE_SIZE * npages + addr;
-					break;
-				}
-			}
-			
-			if (is_found){
-				for (size_t j = 0; j < npages; j++){				
-					int index = ( PAGE_SIZE * j + addr - frame_start) / PAGE_SIZE;	
-					((int *)coremap_start)[index] = j + 1;
-				}
-				spinlock_release(&coremap_lock);
-				return addr;
+		addr = coremap_getppages(npages);
+		if (addr == 0) {
+			/* Give back text pages no process is using, and retry. */
+			if (textcache_reclaim() > 0) {
+				addr = coremap_getppages(npages);
 			}
 		}
-		spinlock_release(&coremap_lock);
-		return 0;
+		return addr;
 	}
 #endif
 	spinlock_acquire(&stealmem_lock);
@@ -157,11 +233,20 @@ free_kpages(vaddr_t addr)
 	spinlock_acquire(&coremap_lock);
 	int index = 1;
 	int start = ((addr - MIPS_KSEG0) - frame_start) / PAGE_SIZE;
+	KASSERT(coremap[start].cm_index == 1);
+	KASSERT(coremap[start].cm_refs > 0);
+	if (--coremap[start].cm_refs > 0) {
+		/* still shared */
+		spinlock_release(&coremap_lock);
+		return;
+	}
+	/* The block ends where the position count stops going up. */
 	for(int i = start; i < number_of_pages; i++) {
-		if (((int *)coremap_start)[i] == index) {
-			((int *)coremap_start)[i] = 0;
-			index ++;
+		if (coremap[i].cm_index != index) {
+			break;
 		}
+		coremap[i].cm_index = 0;
+		index ++;
 	}
 	spinlock_release(&coremap_lock);
 
@@ -294,6 +379,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	if (faultaddress >= vbase1 && faultaddress < vtop1) {
 		read_only = true;
+		loadelf_finished = loadelf_finished || as->as_sharedtext1;
 		int base1_diff = faultaddress - vbase1;
 		int index = base1_diff / PAGE_SIZE;
 		int offset = base1_diff % PAGE_SIZE;
@@ -301,6 +387,9 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		// kprintf("code segemnt\n");
 	}
 	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
+		/* shared text is never writable, even while loading */
+		read_only = as->as_sharedtext2;
+		loadelf_finished = loadelf_finished || as->as_sharedtext2;
 		int base2_diff = faultaddress - vbase2;
 		int index = base2_diff / PAGE_SIZE;
 		int offset = base2_diff % PAGE_SIZE;
@@ -392,6 +481,8 @@ as_create(void)
 
 #if OPT_A3
 	as->loadelf_done = false;
+	as->as_sharedtext1 = false;
+	as->as_sharedtext2 = false;
 #endif
 
 	as->as_vbase1 = 0;
@@ -426,21 +517,30 @@ void
 as_destroy(struct addrspace *as)
 {
 #if OPT_A3
-	// Free address for code segments
-	for (size_t i = 0; i < as->as_npages1; i++){
-    	free_kpages(PADDR_TO_KVADDR(as->as_pbase1[i]));
+	// Free address for code segments. Shared text pages just
+	//  lose a reference. A load that failed part way leaves zeros.
+	for (size_t i = 0; as->as_pbase1 != NULL && i < as->as_npages1; i++){
+		if (as->as_pbase1[i] != 0) {
+			free_kpages(PADDR_TO_KVADDR(as->as_pbase1[i]));
+		}
 	}
 	kfree(as->as_pbase1);
 
 	// Free address for data segments
-	for (size_t i = 0; i < as->as_npages2; i++){
-    	free_kpages(PADDR_TO_KVADDR(as->as_pbase2[i]));
+	for (size_t i = 0; as->as_pbase2 != NULL && i < as->as_npages2; i++){
+		if (as->as_pbase2[i] != 0) {
+			free_kpages(PADDR_TO_KVADDR(as->as_pbase2[i]));
+		}
 	}
 	kfree(as->as_pbase2);
 
 	// Free address of stacks
-	for (size_t i = 0; i < DUMBVM_STACKPAGES; i++){
-    	free_kpages(PADDR_TO_KVADDR(as->as_stackpbase[i]));
+	if (as->as_stackpbase != NULL) {
+		for (size_t i = 0; i < DUMBVM_STACKPAGES; i++){
+			if (as->as_stackpbase[i] != 0) {
+				free_kpages(PADDR_TO_KVADDR(as->as_stackpbase[i]));
+			}
+		}
 	}
 	kfree(as->as_stackpbase);
 #endif
@@ -494,8 +594,13 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	/* We don't use these - all pages are read-write */
 	(void)readable;
+#if OPT_A3
+	/* ...except code, which is shared read-only (see as_load_text) */
+	bool sharedtext = executable && !writeable;
+#else
 	(void)writeable;
 	(void)executable;
+#endif
 
 	if (as->as_vbase1 == 0) {
 		as->as_vbase1 = vaddr;
@@ -505,9 +610,13 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		// Set up a region of memory for code segment
 		size_t code_seg_size = sizeof(paddr_t) * npages;
 		as->as_pbase1 = kmalloc(code_seg_size);
+		if (as->as_pbase1 == NULL) {
+			return ENOMEM;
+		}
 		for (size_t i = 0; i < as->as_npages1; i++){
 			as->as_pbase1[i] = 0;
 		}
+		as->as_sharedtext1 = sharedtext;
 	#endif
 		return 0;
 	}
@@ -520,9 +629,13 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		// Set up a region of memory for data segment
 		size_t code_seg_size = sizeof(paddr_t) * npages;
 		as->as_pbase2 = kmalloc(code_seg_size);
+		if (as->as_pbase2 == NULL) {
+			return ENOMEM;
+		}
 		for (size_t i = 0; i < as->as_npages2; i++){
 			as->as_pbase2[i] = 0;
 		}
+		as->as_sharedtext2 = sharedtext;
 	#endif	
 		return 0;
 	}
@@ -562,8 +675,9 @@ as_prepare_load(struct addrspace *as)
 
 #if OPT_A3
 	unsigned single_page = 1;
-	// Check the region of code segment
-	for (size_t i = 0; i < as->as_npages1; i++){
+	// Check the region of code segment. Shared text pages come
+	//  from the text page cache instead (as_load_text, as_copy).
+	for (size_t i = 0; i < as->as_npages1 && !as->as_sharedtext1; i++){
 		as->as_pbase1[i] = getppages(single_page);
 		if (as->as_pbase1[i] == 0) {
 			return ENOMEM;
@@ -572,7 +686,7 @@ as_prepare_load(struct addrspace *as)
 	}
 
 	// Check the region of data segment
-	for (size_t i = 0; i < as->as_npages2; i++){
+	for (size_t i = 0; i < as->as_npages2 && !as->as_sharedtext2; i++){
 		as->as_pbase2[i] = getppages(single_page);
 		if (as->as_pbase2[i] == 0) {
 			return ENOMEM;
@@ -583,6 +697,12 @@ as_prepare_load(struct addrspace *as)
 	// Check the region of stack
 	size_t stackpage_size = DUMBVM_STACKPAGES * sizeof(paddr_t);
 	as->as_stackpbase = kmalloc(stackpage_size);
+	if (as->as_stackpbase == NULL) {
+		return ENOMEM;
+	}
+	for (size_t i = 0; i < DUMBVM_STACKPAGES; i++){
+		as->as_stackpbase[i] = 0;
+	}
 	for (size_t i = 0; i < DUMBVM_STACKPAGES; i++){
 		as->as_stackpbase[i] = getppages(single_page);
 		if (as->as_stackpbase[i] == 0) {
@@ -633,6 +753,82 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+#if OPT_A3
+/*
+ * Make the NPAGES frames in TO the same as those in FROM, taking a
+ * reference on each.
+ */
+static
+void
+as_share_pages(paddr_t *to, const paddr_t *from, size_t npages)
+{
+	for (size_t i = 0; i < npages; i++) {
+		KASSERT(to[i] == 0);
+		coremap_incref(from[i]);
+		to[i] = from[i];
+	}
+}
+
+/*
+ * Fill a shared text region with pages from the text page cache
+ * rather than reading the segment into private pages. The segment is
+ * MEMSIZE bytes at VADDR, the first FILESIZE of which come from file
+ * offset OFFSET of V. Each page is looked up by the file offset it
+ * starts at, so every process running the same executable ends up
+ * with the same frames.
+ */
+int
+as_load_text(struct addrspace *as, struct vnode *v, off_t offset,
+	     vaddr_t vaddr, size_t memsize, size_t filesize)
+{
+	paddr_t *pages;
+	vaddr_t vbase, pagevaddr;
+	size_t npages;
+	int result;
+
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+	/* we don't go through uiomove, so check this ourselves */
+	if (vaddr >= USERSPACETOP || memsize > USERSPACETOP - vaddr) {
+		return ENOEXEC;
+	}
+
+	if (as->as_sharedtext1 &&
+	    vaddr >= as->as_vbase1 &&
+	    vaddr < as->as_vbase1 + as->as_npages1 * PAGE_SIZE) {
+		vbase = as->as_vbase1;
+		npages = as->as_npages1;
+		pages = as->as_pbase1;
+	}
+	else if (as->as_sharedtext2 &&
+		 vaddr >= as->as_vbase2 &&
+		 vaddr < as->as_vbase2 + as->as_npages2 * PAGE_SIZE) {
+		vbase = as->as_vbase2;
+		npages = as->as_npages2;
+		pages = as->as_pbase2;
+	}
+	else {
+		return EINVAL;
+	}
+
+	for (size_t i = 0; i < npages; i++) {
+		KASSERT(pages[i] == 0);
+		pagevaddr = vbase + i * PAGE_SIZE;
+		result = textcache_getpage(v,
+					   offset + ((off_t)pagevaddr - (off_t)vaddr),
+					   offset, offset + filesize,
+					   &pages[i]);
+		if (result) {
+			/* as_destroy releases the pages we got */
+			return result;
+		}
+	}
+	return 0;
+}
+#endif
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -649,9 +845,17 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	new->as_npages2 = old->as_npages2;
 
 #if OPT_A3
+	new->as_sharedtext1 = old->as_sharedtext1;
+	new->as_sharedtext2 = old->as_sharedtext2;
+	new->loadelf_done = old->loadelf_done;
+
 	// Initialize code segment for the new address space 
 	size_t new_code_seg_size = new->as_npages1 * sizeof(paddr_t);
 	new->as_pbase1 = kmalloc(new_code_seg_size);
+	if (new->as_pbase1 == NULL) {
+		as_destroy(new);
+		return ENOMEM;
+	}
 	for (size_t i = 0; i < new->as_npages1; i++){
 		new->as_pbase1[i] = 0;
 	}
@@ -659,6 +863,10 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	// Initialize data segment for the new address space
 	size_t new_data_seg_size = new->as_npages2 * sizeof(paddr_t);
 	new->as_pbase2 = kmalloc(new_data_seg_size);
+	if (new->as_pbase2 == NULL) {
+		as_destroy(new);
+		return ENOMEM;
+	}
 	for (size_t i = 0; i < new->as_npages2; i++){
 		new->as_pbase2[i] = 0;
 	}
@@ -672,6 +880,14 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	}
 
 #if OPT_A3
+	// Shared text: map the parent's frames, don't copy them.
+	if (new->as_sharedtext1) {
+		as_share_pages(new->as_pbase1, old->as_pbase1, new->as_npages1);
+	}
+	if (new->as_sharedtext2) {
+		as_share_pages(new->as_pbase2, old->as_pbase2, new->as_npages2);
+	}
+
 	KASSERT(new->as_pbase1 != NULL);
 	for (size_t i = 0; i < new->as_npages1; i++) {
 		KASSERT(new->as_pbase1[i] != 0);
@@ -688,14 +904,14 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	}
 
 	// Move memory from code segment
-	for (size_t i = 0; i < new->as_npages1; i++){
+	for (size_t i = 0; i < new->as_npages1 && !new->as_sharedtext1; i++){
 		memmove((void *)PADDR_TO_KVADDR(new->as_pbase1[i]), 
 				(const void *)PADDR_TO_KVADDR(old->as_pbase1[i]),
 				PAGE_SIZE);
 	}
 	
 	// Move memory from data segment
-	for (size_t i = 0; i < new->as_npages2; i++){
+	for (size_t i = 0; i < new->as_npages2 && !new->as_sharedtext2; i++){
 		memmove((void *)PADDR_TO_KVADDR(new->as_pbase2[i]),
 				(const void *)PADDR_TO_KVADDR(old->as_pbase2[i]),
 				PAGE_SIZE);
@@ -142,6 +142,28 @@ putch_complete_polled(struct con_softc *cs)
 
 //////////////////////////////////////////////////
 
+/*
+ * Queue LEN characters on a device with a transmit buffer, sleeping
+ * whenever it's full. The device calls con_start once for each time
+ * it turned us away, so the P below always gets matched; an extra
+ * count on the semaphore just costs a retry.
+ */
+static
+void
+con_sendbuf(struct con_softc *cs, const char *buf, size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		n = cs->cs_sendbuf(cs->cs_devdata, buf, len);
+		buf += n;
+		len -= n;
+		if (len > 0) {
+			P(cs->cs_wsem);
+		}
+	}
+}
+
 /*
  * Print a character, using interrupts to wait for I/O completion.
  */
@@ -149,6 +171,13 @@ static
 void
 putch_intr(struct con_softc *cs, int ch)
 {
+	char c;
+
+	if (cs->cs_sendbuf != NULL) {
+		c = ch;
+		con_sendbuf(cs, &c, 1);
+		return;
+	}
 	P(cs->cs_wsem);
 	cs->cs_send(cs->cs_devdata, ch);
 }
@@ -298,6 +327,48 @@ con_close(struct device *dev)
 	return 0;
 }
 
+/*
+ * Size of the on-stack bounce buffer user output is copied through.
+ */
+#define CON_BOUNCESIZE 128
+
+/*
+ * Write path for devices with a transmit buffer: copy the user's data
+ * in a chunk at a time and queue each chunk whole, so we pay for one
+ * uiomove and one trip to the device per chunk rather than per byte.
+ * As for putch, newlines go out as CR LF.
+ */
+static
+int
+con_write_bulk(struct con_softc *cs, struct uio *uio)
+{
+	char buf[CON_BOUNCESIZE];
+	size_t len, start, i;
+	int result;
+
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid;
+		if (len > sizeof(buf)) {
+			len = sizeof(buf);
+		}
+		result = uiomove(buf, len, uio);
+		if (result) {
+			return result;
+		}
+
+		start = 0;
+		for (i=0; i<len; i++) {
+			if (buf[i] == '\n') {
+				con_sendbuf(cs, buf + start, i - start);
+				con_sendbuf(cs, "\r\n", 2);
+				start = i + 1;
+			}
+		}
+		con_sendbuf(cs, buf + start, len - start);
+	}
+	return 0;
+}
+
 static
 int
 con_io(struct device *dev, struct uio *uio)
@@ -315,9 +386,18 @@ con_io(struct device *dev, struct uio *uio)
 		lk = con_userlock_write;
 	}
 
+	/* kernel output logged so far goes first */
+	klog_flush();
+
 	KASSERT(lk != NULL);
 	lock_acquire(lk);
 
+	if (uio->uio_rw == UIO_WRITE && the_console->cs_sendbuf != NULL) {
+		result = con_write_bulk(the_console, uio);
+		lock_release(lk);
+		return result;
+	}
+
 	while (uio->uio_resid > 0) {
 		if (uio->uio_rw==UIO_READ) {
 			ch = getch();
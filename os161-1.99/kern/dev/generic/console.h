@@ -35,6 +35,12 @@
  *
  * devdata, send, and sendpolled are provided by the underlying
  * device, and are to be initialized by the attach routine.
+ *
+ * sendbuf is optional. A device that has a transmit buffer provides
+ * it to queue many characters at once: it takes what fits, never
+ * waits, and if it couldn't take everything it calls the start
+ * function once when there's room. If sendbuf is set, send is not
+ * used for interrupt-driven output.
  */
 
 #define CONSOLE_INPUT_BUFFER_SIZE 32
@@ -46,6 +52,7 @@ struct con_softc {
 	void (*cs_sendpolled)(void *devdata, int ch);
 	void (*cs_startpolling)(void *devdata);
 	void (*cs_endpolling)(void *devdata);
+	size_t (*cs_sendbuf)(void *devdata, const char *buf, size_t len);
 
 	/* initialized by config routine */
 	struct semaphore *cs_rsem;
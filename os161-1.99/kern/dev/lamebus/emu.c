@@ -472,16 +472,14 @@ emufs_reclaim(struct vnode *v)
 	int result;
 
 	/*
-	 * Need both of these locks, e_lock to protect the device
-	 * and vfs_biglock to protect the fs-related material.
+	 * e_lock protects the device and the vnode pool; holding it
+	 * keeps emufs_loadvnode from handing out new references.
 	 */
 
-	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
-	if (ev->ev_v.vn_refcount != 1) {
+	if (!vnode_lastref(&ev->ev_v)) {
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		return EBUSY;
 	}
 
@@ -489,7 +487,6 @@ emufs_reclaim(struct vnode *v)
 	result = emu_close(ev->ev_emu, ev->ev_handle);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -513,7 +510,6 @@ emufs_reclaim(struct vnode *v)
 	VOP_CLEANUP(&ev->ev_v);
 
 	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
 
 	kfree(ev);
 	return 0;
@@ -589,6 +585,7 @@ emufs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
+	result = 0;
 	while (uio->uio_resid > 0) {
 		amt = uio->uio_resid;
 		if (amt > EMU_MAXIO) {
@@ -599,7 +596,7 @@ emufs_write(struct vnode *v, struct uio *uio)
 
 		result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
 		if (result) {
-			return result;
+			break;
 		}
 
 		if (uio->uio_resid == oldresid) {
@@ -608,7 +605,9 @@ emufs_write(struct vnode *v, struct uio *uio)
 		}
 	}
 
-	return 0;
+	vnode_modified(v);
+
+	return result;
 }
 
 /*
@@ -717,7 +716,11 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	int result;
+
+	result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	vnode_modified(v);
+	return result;
 }
 
 /*
@@ -1153,7 +1156,6 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
 	num = vnodearray_num(ef->ef_vnodes);
@@ -1166,7 +1168,6 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 			VOP_INCREF(&ev->ev_v);
 
 			lock_release(ef->ef_emu->e_lock);
-			vfs_biglock_release();
 			*ret = ev;
 			return 0;
 		}
@@ -1187,7 +1188,6 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 			   &ef->ef_fs, ev);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		kfree(ev);
 		return result;
 	}
@@ -1197,13 +1197,11 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 		/* note: VOP_CLEANUP undoes VOP_INIT - it does not kfree */
 		VOP_CLEANUP(&ev->ev_v);
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		kfree(ev);
 		return result;
 	}
 
 	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
 
 	*ret = ev;
 	return 0;
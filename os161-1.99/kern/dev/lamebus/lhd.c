@@ -35,7 +35,9 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <cpustat.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -95,41 +97,278 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Request queue.
+ *
+ * Requests wait on lh_queue in arrival order. When the disk goes
+ * idle the elevator picks the next one C-SCAN fashion: the request
+ * with the lowest sector at or past the head, or failing that the
+ * lowest sector of all (back to the start of the disk). So that a
+ * busy region of the disk can't starve everything else, a request
+ * passed over LHD_MAXPASS times goes next regardless.
+ *
+ * A new request that begins where a waiting (or running) one ends
+ * and goes the same way is chained onto it (lr_merged) and follows it
+ * without going through the elevator, up to LHD_MAXMERGE requests
+ * per chain.
+ *
+ * The hardware does one sector at a time; the interrupt handler
+ * moves the data and starts the next sector, or the next request,
+ * straight away. lh_lock protects the queue and is shared with the
+ * interrupt handler.
+ */
+
+#define LHD_MAXPASS   16
+#define LHD_MAXMERGE  8
+
+/*
+ * Choose the next request and take it off the queue. Call with
+ * lh_lock held.
+ */
+static
+struct lhd_req *
+lhd_pick(struct lhd_softc *lh)
+{
+	struct lhd_req **rp, **best, *req;
+	bool rahead, bahead;
+
+	KASSERT(lh->lh_queue != NULL);
+
+	if (lh->lh_queue->lr_passed >= LHD_MAXPASS) {
+		/* waited long enough */
+		best = &lh->lh_queue;
+	}
+	else {
+		best = &lh->lh_queue;
+		for (rp = &(*best)->lr_next; *rp != NULL;
+		     rp = &(*rp)->lr_next) {
+			rahead = (*rp)->lr_sector >= lh->lh_headpos;
+			bahead = (*best)->lr_sector >= lh->lh_headpos;
+			if (rahead != bahead) {
+				/* prefer the one still ahead of the head */
+				if (rahead) {
+					best = rp;
+				}
+			}
+			else if ((*rp)->lr_sector < (*best)->lr_sector) {
+				best = rp;
+			}
+		}
+	}
+
+	req = *best;
+	*best = req->lr_next;
+	req->lr_next = NULL;
+
+	for (rp = &lh->lh_queue; *rp != NULL; rp = &(*rp)->lr_next) {
+		(*rp)->lr_passed++;
+	}
+	return req;
+}
+
+/*
+ * Start the next sector of the current request, choosing a new
+ * current request first if there isn't one. The disk must be idle.
+ * Call with lh_lock held.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_start(struct lhd_softc *lh)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_req *req;
+	uint32_t statval;
+	int result;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_cur == NULL) {
+		if (lh->lh_queue == NULL) {
+			/* nothing to do */
+			return;
+		}
+		lh->lh_cur = lhd_pick(lh);
+		cpustat_add(CPUSTAT_FS_DEVSEEK,
+			    lh->lh_cur->lr_sector >= lh->lh_headpos ?
+			    lh->lh_cur->lr_sector - lh->lh_headpos :
+			    lh->lh_headpos - lh->lh_cur->lr_sector);
+	}
+	req = lh->lh_cur;
+
+	statval = LHD_WORKING;
+	if (req->lr_write) {
+		/* Transfer the data to the on-card buffer. */
+		result = uiomove(lh->lh_buf, LHD_SECTSIZE, req->lr_uio);
+		/* (a kernel uio can't fail) */
+		KASSERT(result == 0);
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want and start the operation. */
+	lh->lh_headpos = req->lr_sector;
+	lhd_wreg(lh, LHD_REG_SECT, req->lr_sector);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+void
+lhd_submit(struct lhd_softc *lh, struct lhd_req *req)
+{
+	struct lhd_req *q, *tail;
+	unsigned n;
+
+	KASSERT(req->lr_uio->uio_segflg == UIO_SYSSPACE);
+	KASSERT(req->lr_nsect > 0);
+
+	req->lr_result = 0;
+	req->lr_passed = 0;
+	req->lr_next = NULL;
+	req->lr_merged = NULL;
+
+	cpustat_inc(CPUSTAT_FS_DEVREQ);
+
+	spinlock_acquire(&lh->lh_lock);
+
+	/* Look for a chain this continues, starting with the running one. */
+	q = lh->lh_cur != NULL ? lh->lh_cur : lh->lh_queue;
+	while (q != NULL) {
+		n = 1;
+		for (tail = q; tail->lr_merged != NULL;
+		     tail = tail->lr_merged) {
+			n++;
+		}
+		if (n < LHD_MAXMERGE && tail->lr_write == req->lr_write &&
+		    tail->lr_sector + tail->lr_nsect == req->lr_sector) {
+			tail->lr_merged = req;
+			spinlock_release(&lh->lh_lock);
+			cpustat_inc(CPUSTAT_FS_DEVMERGE);
+			return;
+		}
+		q = (q == lh->lh_cur) ? lh->lh_queue : q->lr_next;
+	}
+
+	/* No luck; add it to the queue. */
+	if (lh->lh_queue == NULL) {
+		lh->lh_queue = req;
+	}
+	else {
+		for (q = lh->lh_queue; q->lr_next != NULL; q = q->lr_next) {
+			/* nothing */
+		}
+		q->lr_next = req;
+	}
+
+	if (lh->lh_cur == NULL) {
+		lhd_start(lh);
+	}
+	spinlock_release(&lh->lh_lock);
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, collect the data if it was a read, and start the next
+ * sector. Report completion if that was the end of the request.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct lhd_req *req;
 	uint32_t val;
-	
+	int result;
+
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
-	    case LHD_IDLE:
-	    case LHD_WORKING:
-		break;
 	    case LHD_OK:
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
+	    default:
+		return;
 	}
+
+	spinlock_acquire(&lh->lh_lock);
+
+	req = lh->lh_cur;
+	if (req == NULL) {
+		/* not ours */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	result = lhd_code_to_errno(lh, val);
+	if (result == 0 && !req->lr_write) {
+		/* Transfer the data out of the on-card buffer. */
+		result = uiomove(lh->lh_buf, LHD_SECTSIZE, req->lr_uio);
+	}
+	req->lr_sector++;
+	req->lr_nsect--;
+
+	if (result == 0 && req->lr_nsect > 0) {
+		/* on to the next sector */
+		lhd_start(lh);
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	/* This request is done; anything chained to it goes next. */
+	req->lr_result = result;
+	lh->lh_cur = req->lr_merged;
+	lhd_start(lh);
+	spinlock_release(&lh->lh_lock);
+
+	req->lr_callback(req);
+}
+
+/*
+ * Synchronous I/O: lhd_io submits a request and sleeps until this
+ * callback says it's done.
+ */
+struct lhd_sync {
+	struct lhd_softc *ls_lh;
+	volatile bool ls_done;
+};
+
+static
+void
+lhd_wakeup(struct lhd_req *req)
+{
+	struct lhd_sync *ls = req->lr_data;
+	struct lhd_softc *lh = ls->ls_lh;
+
+	/* Once ls_done is set, the waiter may return; don't touch REQ. */
+	ls->ls_done = true;
+	wchan_wakeall(lh->lh_wchan);
+}
+
+static
+int
+lhd_sync_io(struct lhd_softc *lh, struct uio *uio, uint32_t sector,
+	    uint32_t nsect)
+{
+	struct lhd_req req;
+	struct lhd_sync ls;
+
+	ls.ls_lh = lh;
+	ls.ls_done = false;
+
+	req.lr_uio = uio;
+	req.lr_sector = sector;
+	req.lr_nsect = nsect;
+	req.lr_write = (uio->uio_rw == UIO_WRITE);
+	req.lr_callback = lhd_wakeup;
+	req.lr_data = &ls;
+
+	lhd_submit(lh, &req);
+
+	wchan_lock(lh->lh_wchan);
+	while (!ls.ls_done) {
+		wchan_sleep(lh->lh_wchan);
+		wchan_lock(lh->lh_wchan);
+	}
+	wchan_unlock(lh->lh_wchan);
+
+	return req.lr_result;
 }
 
 /*
@@ -195,6 +434,11 @@ lhd_reset(struct lhd_softc *lh)
 
 /*
  * I/O function (for both reads and writes)
+ *
+ * The whole transfer goes to the request queue as one request. The
+ * interrupt handler moves the data, so it must be in kernel memory;
+ * user buffers (from raw device access) are staged through a bounce
+ * buffer a sector at a time.
  */
 static
 int
@@ -206,8 +450,10 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
+	struct iovec iov;
+	struct uio ku;
+	void *bounce;
 	uint32_t i;
-	uint32_t statval = LHD_WORKING;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -220,59 +466,35 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		return lhd_sync_io(lh, uio, sector, len);
+	}
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
+	bounce = kmalloc(LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+	result = 0;
+	for (i=0; i<len && result==0; i++) {
+		uio_kinit(&iov, &ku, bounce, LHD_SECTSIZE,
+			  (off_t)(sector+i) * LHD_SECTSIZE, uio->uio_rw);
 		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+			result = uiomove(bounce, LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+		result = lhd_sync_io(lh, &ku, sector+i, 1);
+		if (result == 0 && uio->uio_rw == UIO_READ) {
+			result = uiomove(bounce, LHD_SECTSIZE, uio);
 		}
 	}
-
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 /*
@@ -289,15 +511,13 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_queue = NULL;
+	lh->lh_cur = NULL;
+	lh->lh_headpos = 0;
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
 		return ENOMEM;
 	}
 
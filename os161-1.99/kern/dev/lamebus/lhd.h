@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -37,6 +38,31 @@
  */
 #define LHD_SECTSIZE  512
 
+struct uio;
+struct wchan;
+
+/*
+ * An I/O request: NSECT sectors starting at SECTOR, to or from UIO
+ * (which must be UIO_SYSSPACE, as the data is moved at interrupt
+ * time). Fill in everything above the line and pass it to
+ * lhd_submit; CALLBACK is called from the interrupt handler, with
+ * lr_result set, when the request is finished. The request must stay
+ * put until then.
+ */
+struct lhd_req {
+	struct uio *lr_uio;
+	uint32_t lr_sector;
+	uint32_t lr_nsect;
+	bool lr_write;
+	void (*lr_callback)(struct lhd_req *);
+	void *lr_data;			/* for the callback's use */
+	/* -------- */
+	int lr_result;
+	unsigned lr_passed;		/* times the elevator went elsewhere */
+	struct lhd_req *lr_next;	/* queue link, in arrival order */
+	struct lhd_req *lr_merged;	/* requests continuing this one */
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +77,11 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the following */
+	struct lhd_req *lh_queue;	/* Waiting requests, oldest first */
+	struct lhd_req *lh_cur;		/* Request in progress */
+	uint32_t lh_headpos;		/* Sector last started */
+	struct wchan *lh_wchan;		/* Synchronous callers wait here */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -61,4 +89,7 @@ struct lhd_softc {
 /* Functions called by lower-level drivers */
 void lhd_irq(/*struct lhd_softc*/ void *);	/* Interrupt handler */
 
+/* Asynchronous I/O */
+void lhd_submit(struct lhd_softc *lh, struct lhd_req *req);
+
 #endif /* _LAMEBUS_LHD_H_ */
@@ -43,12 +43,34 @@
 #define LSER_IRQ_ENABLE  1
 #define LSER_IRQ_ACTIVE  2
 
+/*
+ * Send the next character from the transmit ring. Call with the lock
+ * held and the transmitter idle.
+ */
+static
+void
+lser_txnext(struct lser_softc *sc)
+{
+	unsigned tail;
+
+	KASSERT(spinlock_do_i_hold(&sc->ls_lock));
+	KASSERT(!sc->ls_wbusy);
+	KASSERT(sc->ls_txcount > 0);
+
+	tail = (sc->ls_txhead + LSER_TXBUFSIZE - sc->ls_txcount)
+		% LSER_TXBUFSIZE;
+	sc->ls_txcount--;
+	sc->ls_wbusy = true;
+	bus_write_register(sc->ls_busdata, sc->ls_buspos, LSER_REG_CHAR,
+			   (unsigned char)sc->ls_txbuf[tail]);
+}
+
 void
 lser_irq(void *vsc)
 {
 	struct lser_softc *sc = vsc;
 	uint32_t x;
-	bool clear_to_write = false;
+	unsigned starts = 0;
 	bool got_a_read = false;
 	uint32_t ch = 0;
 
@@ -58,9 +80,26 @@ lser_irq(void *vsc)
 	if (x & LSER_IRQ_ACTIVE) {
 		x = LSER_IRQ_ENABLE;
 		sc->ls_wbusy = 0;
-		clear_to_write = true;
 		bus_write_register(sc->ls_busdata, sc->ls_buspos,
 				   LSER_REG_WIRQ, x);
+
+		if (sc->ls_txcount > 0) {
+			lser_txnext(sc);
+		}
+
+		if (!sc->ls_txring) {
+			/* single-character writer; clear to send again */
+			starts = 1;
+		}
+		else if (sc->ls_txwant > 0 &&
+			 sc->ls_txcount <= LSER_TXBUFSIZE / 2) {
+			/*
+			 * Wake the writers waiting for room once the
+			 * ring is half empty, not on every character.
+			 */
+			starts = sc->ls_txwant;
+			sc->ls_txwant = 0;
+		}
 	}
 
 	x = bus_read_register(sc->ls_busdata, sc->ls_buspos, LSER_REG_RIRQ);
@@ -75,8 +114,10 @@ lser_irq(void *vsc)
 
 	spinlock_release(&sc->ls_lock);
 
-	if (clear_to_write && sc->ls_start != NULL) {
-		sc->ls_start(sc->ls_devdata);
+	if (sc->ls_start != NULL) {
+		while (starts-- > 0) {
+			sc->ls_start(sc->ls_devdata);
+		}
 	}
 	if (got_a_read && sc->ls_input != NULL) {
 		sc->ls_input(sc->ls_devdata, ch);
@@ -111,6 +152,45 @@ lser_write(void *vls, int ch)
 	spinlock_release(&ls->ls_lock);
 }
 
+/*
+ * Queue up to LEN characters from BUF on the transmit ring and start
+ * the transmitter if it's idle. Never waits. Returns the number of
+ * characters taken; if that's less than LEN, the ring is full and
+ * ls_start will be called once when there's room again, so the caller
+ * can sleep until then.
+ *
+ * Don't mix this with lser_write: a driver uses one or the other.
+ */
+size_t
+lser_writebuf(void *vls, const char *buf, size_t len)
+{
+	struct lser_softc *ls = vls;
+	size_t n, i;
+
+	spinlock_acquire(&ls->ls_lock);
+
+	ls->ls_txring = true;
+	n = LSER_TXBUFSIZE - ls->ls_txcount;
+	if (n > len) {
+		n = len;
+	}
+	for (i=0; i<n; i++) {
+		ls->ls_txbuf[ls->ls_txhead] = buf[i];
+		ls->ls_txhead = (ls->ls_txhead + 1) % LSER_TXBUFSIZE;
+	}
+	ls->ls_txcount += n;
+
+	if (ls->ls_txcount > 0 && !ls->ls_wbusy) {
+		lser_txnext(ls);
+	}
+	if (n < len) {
+		ls->ls_txwant++;
+	}
+
+	spinlock_release(&ls->ls_lock);
+	return n;
+}
+
 static
 void
 lser_poll_until_write(struct lser_softc *sc)
@@ -131,6 +211,7 @@ lser_writepolled(void *vsc, int ch)
 {
 	struct lser_softc *sc = vsc;
 	bool irqpending = false;
+	unsigned tail;
 
 	spinlock_acquire(&sc->ls_lock);
 
@@ -142,6 +223,24 @@ lser_writepolled(void *vsc, int ch)
 				   LSER_REG_WIRQ, LSER_IRQ_ENABLE);
 	}
 
+	/*
+	 * Anything still on the transmit ring was written first, so
+	 * send it before this character. (If the ring is in use, the
+	 * transmitter was busy, so an interrupt is left pending below
+	 * and the interrupt handler wakes any waiting writers.)
+	 */
+	while (sc->ls_txcount > 0) {
+		tail = (sc->ls_txhead + LSER_TXBUFSIZE - sc->ls_txcount)
+			% LSER_TXBUFSIZE;
+		sc->ls_txcount--;
+		bus_write_register(sc->ls_busdata, sc->ls_buspos,
+				   LSER_REG_CHAR,
+				   (unsigned char)sc->ls_txbuf[tail]);
+		lser_poll_until_write(sc);
+		bus_write_register(sc->ls_busdata, sc->ls_buspos,
+				   LSER_REG_WIRQ, LSER_IRQ_ENABLE);
+	}
+
 	/* Send the character. */
 	bus_write_register(sc->ls_busdata, sc->ls_buspos, LSER_REG_CHAR, ch);
 
@@ -191,6 +290,10 @@ config_lser(struct lser_softc *sc, int lserno)
 
 	spinlock_init(&sc->ls_lock);
 	sc->ls_wbusy = false;
+	sc->ls_txring = false;
+	sc->ls_txhead = 0;
+	sc->ls_txcount = 0;
+	sc->ls_txwant = 0;
 
 	bus_write_register(sc->ls_busdata, sc->ls_buspos,
 			   LSER_REG_RIRQ, LSER_IRQ_ENABLE);
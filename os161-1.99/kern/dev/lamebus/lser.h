@@ -32,10 +32,22 @@
 
 #include <spinlock.h>
 
+/*
+ * Size of the transmit ring. Characters queued with lser_writebuf are
+ * sent one per write-done interrupt, so callers only wait when the
+ * ring is full.
+ */
+#define LSER_TXBUFSIZE 1024
+
 struct lser_softc {
 	/* Initialized by config function */
-	struct spinlock ls_lock;    /* protects ls_wbusy and device regs */
+	struct spinlock ls_lock;    /* protects everything below, and regs */
 	volatile bool ls_wbusy;     /* true if write in progress */
+	bool ls_txring;             /* true once lser_writebuf is used */
+	char ls_txbuf[LSER_TXBUFSIZE];
+	unsigned ls_txhead;         /* next slot to put a char in */
+	unsigned ls_txcount;        /* chars queued, not yet sent */
+	unsigned ls_txwant;         /* ls_start calls owed to writers */
 
 	/* Initialized by lower-level attachment function */
 	void *ls_busdata;
@@ -54,6 +66,8 @@ void lser_irq(/*struct lser_softc*/ void *sc);
 
 /* Functions called by higher-level drivers */
 void lser_write(/*struct lser_softc*/ void *sc, int ch);
+size_t lser_writebuf(/*struct lser_softc*/ void *sc, const char *buf,
+		     size_t len);
 void lser_startpolling(/*struct lser_softc*/ void *sc);
 void lser_writepolled(/*struct lser_softc*/ void *sc, int ch);
 void lser_endpolling(/*struct lser_softc*/ void *sc);
@@ -39,8 +39,11 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <spinlock.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* Shortcuts for the size macros in kern/sfs.h */
@@ -49,8 +52,8 @@
 
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Reads load the whole bitmap; writes only write the sectors marked
+ * in sfs_mapdirty, since most changes touch only one or two.
  *
  * The free block bitmap consists of SFS_BITBLOCKS 512-byte sectors of
  * bits, one bit for each sector on the filesystem. The number of
@@ -63,8 +66,39 @@
  *
  * The sectors used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
+ *
+ * Blocks that are only reserved (see sfs_resvmap) are written as
+ * free, so a crash can't leave them allocated on disk.
  */
 
+static
+int
+sfs_wmapblock(struct sfs_fs *sfs, uint32_t j)
+{
+	const unsigned char *used, *resv;
+	unsigned char *data;
+	struct buf *b;
+	unsigned i;
+	int result;
+
+	used = bitmap_getdata(sfs->sfs_freemap);
+	resv = bitmap_getdata(sfs->sfs_resvmap);
+	used += j*SFS_BLOCKSIZE;
+	resv += j*SFS_BLOCKSIZE;
+
+	result = buffer_get(sfs->sfs_device, SFS_MAP_LOCATION+j, &b);
+	if (result) {
+		return result;
+	}
+	data = buffer_map(b);
+	for (i=0; i<SFS_BLOCKSIZE; i++) {
+		data[i] = used[i] & ~resv[i];
+	}
+	buffer_mark_dirty(b);
+	buffer_release(b);
+	return 0;
+}
+
 static
 int
 sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
@@ -89,8 +123,14 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 		if (rw == UIO_READ) {
 			result = sfs_rblock(sfs, ptr, SFS_MAP_LOCATION+j);
 		}
+		else if (sfs->sfs_mapdirty[j]) {
+			result = sfs_wmapblock(sfs, j);
+			if (result == 0) {
+				sfs->sfs_mapdirty[j] = false;
+			}
+		}
 		else {
-			result = sfs_wblock(sfs, ptr, SFS_MAP_LOCATION+j);
+			result = 0;
 		}
 
 		/* If we failed, stop. */
@@ -101,6 +141,25 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 	return 0;
 }
 
+/*
+ * Write the freemap blocks that have changed into the buffer cache.
+ */
+int
+sfs_sync_freemap(struct sfs_fs *sfs)
+{
+	int result = 0;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs->sfs_freemapdirty) {
+		result = sfs_mapio(sfs, UIO_WRITE);
+		if (result == 0) {
+			sfs->sfs_freemapdirty = false;
+		}
+	}
+	lock_release(sfs->sfs_freemaplock);
+	return result;
+}
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
@@ -111,11 +170,10 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
-	unsigned i, num;
+	struct sfs_vnode *sv;
+	unsigned ndirty;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -148,35 +206,65 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
-	}
+	/*
+	 * Write back the inodes that have changed. Each one comes off
+	 * the dirty list once it's written. Take a reference to the
+	 * vnode at the head of the list while the table is locked, so
+	 * it can't be reclaimed, and then lock it as usual.
+	 *
+	 * Only do as many as were dirty when we started. Inodes dirtied
+	 * since go on the end of the list and wait for the next sync;
+	 * otherwise a busy writer could keep us here forever.
+	 */
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	ndirty = sfs->sfs_ndirty;
+	spinlock_release(&sfs->sfs_dirtylock);
+
+	for (; ndirty > 0; ndirty--) {
+		lock_acquire(sfs->sfs_vnlock);
+		spinlock_acquire(&sfs->sfs_dirtylock);
+		sv = sfs->sfs_dirtyvnodes;
+		if (sv != NULL) {
+			VOP_INCREF(&sv->sv_v);
+		}
+		spinlock_release(&sfs->sfs_dirtylock);
+		lock_release(sfs->sfs_vnlock);
 
-	/* If the free block map needs to be written, write it. */
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_mapio(sfs, UIO_WRITE);
+		if (sv == NULL) {
+			break;
+		}
+
+		lock_acquire(sv->sv_lock);
+		result = sfs_sync_inode(sv);
+		lock_release(sv->sv_lock);
+		VOP_DECREF(&sv->sv_v);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
-		sfs->sfs_freemapdirty = false;
 	}
 
+	/* If the free block map needs to be written, write it. */
+	result = sfs_sync_freemap(sfs);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+
 	/* If the superblock needs to be written, write it. */
 	if (sfs->sfs_superdirty) {
 		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
 
-	vfs_biglock_release();
-	return 0;
+	lock_release(sfs->sfs_freemaplock);
+
+	/* Everything above only went as far as the buffer cache. */
+	return buffer_sync(sfs->sfs_device);
 }
 
 /*
@@ -189,13 +277,21 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
 
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
+	/* The volume name never changes; no lock needed */
+	return sfs->sfs_super.sp_volname;
+}
 
-	return ret;
+/*
+ * Destroy the locks sfs_domount made.
+ */
+static
+void
+sfs_destroylocks(struct sfs_fs *sfs)
+{
+	spinlock_cleanup(&sfs->sfs_dirtylock);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
 }
 
 /*
@@ -209,30 +305,40 @@ sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
 
-	vfs_biglock_acquire();
-	
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * VFS holds the mount lock, so nobody can go looking for new
+	 * vnodes; with none loaded, nothing else can be using the fs.
+	 */
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs->sfs_dirtyvnodes == NULL);
+	/* Reclaim gave back every reservation. */
+	KASSERT(sfs->sfs_nresv == 0);
 
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	buffer_drop_all(sfs->sfs_device);
+	bitmap_destroy(sfs->sfs_resvmap);
 	bitmap_destroy(sfs->sfs_freemap);
+	kfree(sfs->sfs_mapdirty);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
 
 	/* Destroy the fs object */
+	sfs_destroylocks(sfs);
 	kfree(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -254,11 +360,10 @@ static
 int
 sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
+	unsigned i;
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -278,24 +383,37 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		return ENXIO;
 	}
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	/* Locks */
+	sfs->sfs_vnlock = lock_create("sfs_vnodes");
+	if (sfs->sfs_vnlock == NULL) {
+		kfree(sfs);
+		return ENOMEM;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs_freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		lock_destroy(sfs->sfs_vnlock);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
+	spinlock_init(&sfs->sfs_dirtylock);
+
+	/* Empty vnode table */
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_dirtyvnodes = NULL;
+	sfs->sfs_dirtytail = &sfs->sfs_dirtyvnodes;
+	sfs->sfs_ndirty = 0;
 
 	/* Set the device so we can use sfs_rblock() */
 	sfs->sfs_device = dev;
@@ -303,9 +421,8 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load superblock */
 	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_destroylocks(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -316,9 +433,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		buffer_drop_all(dev);
+		sfs_destroylocks(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 	
@@ -333,19 +450,45 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		buffer_drop_all(dev);
+		sfs_destroylocks(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
+	sfs->sfs_mapdirty = kmalloc(SFS_FS_BITBLOCKS(sfs) * sizeof(bool));
+	if (sfs->sfs_mapdirty == NULL) {
+		buffer_drop_all(dev);
+		bitmap_destroy(sfs->sfs_freemap);
+		sfs_destroylocks(sfs);
+		kfree(sfs);
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_FS_BITBLOCKS(sfs); i++) {
+		sfs->sfs_mapdirty[i] = false;
+	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
+		buffer_drop_all(dev);
+		kfree(sfs->sfs_mapdirty);
 		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_destroylocks(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
+	bitmap_recount(sfs->sfs_freemap);
+
+	/* Nothing is reserved yet */
+	sfs->sfs_resvmap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
+	if (sfs->sfs_resvmap == NULL) {
+		buffer_drop_all(dev);
+		kfree(sfs->sfs_mapdirty);
+		bitmap_destroy(sfs->sfs_freemap);
+		sfs_destroylocks(sfs);
+		kfree(sfs);
+		return ENOMEM;
+	}
+	sfs->sfs_nresv = 0;
+	sfs->sfs_resvgen = 0;
 
 	/* Set up abstract fs calls */
 	sfs->sfs_absfs.fs_sync = sfs_sync;
@@ -361,7 +504,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -33,75 +33,49 @@
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 ////////////////////////////////////////////////////////////
 //
 // Basic block-level I/O routines
 //
+// These copy whole blocks in and out of the buffer cache. Code that
+// only wants to look at or change part of a block should use the
+// buffer cache directly instead.
+//
 // Note: sfs_rblock is used to read the superblock
 // early in mount, before sfs is fully (or even mostly)
 // initialized, and so may not use anything from sfs
 // except sfs_device.
 
 int
-sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
+sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block)
 {
+	struct buf *b;
 	int result;
-	int tries=0;
-
-	KASSERT(vfs_biglock_do_i_hold());
-
-	DEBUG(DB_SFS, "sfs: %s %llu\n", 
-	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
 
- retry:
-	result = sfs->sfs_device->d_io(sfs->sfs_device, uio);
-	if (result == EINVAL) {
-		/*
-		 * This means the sector we requested was out of range,
-		 * or the seek address we gave wasn't sector-aligned,
-		 * or a couple of other things that are our fault.
-		 */
-		panic("sfs: d_io returned EINVAL\n");
+	result = buffer_read(sfs->sfs_device, block, &b);
+	if (result) {
+		return result;
 	}
-	if (result == EIO) {
-		if (tries == 0) {
-			tries++;
-			kprintf("sfs: block %llu I/O error, retrying\n",
-				uio->uio_offset / SFS_BLOCKSIZE);
-			goto retry;
-		}
-		else if (tries < 10) {
-			tries++;
-			goto retry;
-		}
-		else {
-			kprintf("sfs: block %llu I/O error, giving up after "
-				"%d retries\n",
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
-		}
-	}
-	return result;
-}
-
-int
-sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block)
-{
-	struct iovec iov;
-	struct uio ku;
-
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	memcpy(data, buffer_map(b), SFS_BLOCKSIZE);
+	buffer_release(b);
+	return 0;
 }
 
 int
 sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct buf *b;
+	int result;
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = buffer_get(sfs->sfs_device, block, &b);
+	if (result) {
+		return result;
+	}
+	memcpy(buffer_map(b), data, SFS_BLOCKSIZE);
+	buffer_mark_dirty(b);
+	buffer_release(b);
+	return 0;
 }
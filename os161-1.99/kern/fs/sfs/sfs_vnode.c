@@ -40,15 +40,21 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <spinlock.h>
 #include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
+#include <dcache.h>
 #include <sfs.h>
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* With sfs_truncate */
+static int sfs_dotruncate(struct sfs_vnode *sv, off_t len);
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -58,13 +64,46 @@ static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct buf *b;
+	int result;
+
+	result = buffer_get(sfs->sfs_device, block, &b);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(b), SFS_BLOCKSIZE);
+	buffer_mark_dirty(b);
+	buffer_release(b);
+	return 0;
 }
 
-/* Write an on-disk inode structure back out to disk. */
+/*
+ * Mark the inode dirty, putting the vnode on the filesystem's list of
+ * dirty vnodes so sfs_sync doesn't have to look at the others. It
+ * goes on the end, so the list stays in the order things were
+ * dirtied.
+ */
 static
+void
+sfs_dirty_inode(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	if (sv->sv_dirty) {
+		return;
+	}
+
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	sv->sv_dirty = true;
+	sv->sv_dirtynext = NULL;
+	sv->sv_dirtyprev = sfs->sfs_dirtytail;
+	*sfs->sfs_dirtytail = sv;
+	sfs->sfs_dirtytail = &sv->sv_dirtynext;
+	sfs->sfs_ndirty++;
+	spinlock_release(&sfs->sfs_dirtylock);
+}
+
+/* Write an on-disk inode structure back out to disk. */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
@@ -74,7 +113,22 @@ sfs_sync_inode(struct sfs_vnode *sv)
 		if (result) {
 			return result;
 		}
+
+		/* Take it off the dirty list */
+		spinlock_acquire(&sfs->sfs_dirtylock);
 		sv->sv_dirty = false;
+		*sv->sv_dirtyprev = sv->sv_dirtynext;
+		if (sv->sv_dirtynext != NULL) {
+			sv->sv_dirtynext->sv_dirtyprev = sv->sv_dirtyprev;
+		}
+		else {
+			sfs->sfs_dirtytail = sv->sv_dirtyprev;
+		}
+		KASSERT(sfs->sfs_ndirty > 0);
+		sfs->sfs_ndirty--;
+		sv->sv_dirtynext = NULL;
+		sv->sv_dirtyprev = NULL;
+		spinlock_release(&sfs->sfs_dirtylock);
 	}
 	return 0;
 }
@@ -84,19 +138,79 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Note that the freemap bit for BLOCK changed, so the freemap block
+ * holding it needs writing. Call with sfs_freemaplock held.
+ */
+static
+void
+sfs_mapchanged(struct sfs_fs *sfs, uint32_t block)
+{
+	sfs->sfs_mapdirty[block / SFS_BLOCKBITS] = true;
+	sfs->sfs_freemapdirty = true;
+}
+
+/*
+ * Take back every file's reservation, by clearing the reserved blocks
+ * out of the freemap and voiding the reservations themselves. (None
+ * of them are on disk, so no freemap blocks need writing.) Call with
+ * sfs_freemaplock held.
+ */
+static
+void
+sfs_takeback_resv(struct sfs_fs *sfs)
+{
+	unsigned char *used, *resv;
+	unsigned i, n;
+
+	used = bitmap_getdata(sfs->sfs_freemap);
+	resv = bitmap_getdata(sfs->sfs_resvmap);
+	n = SFS_BITMAPSIZE(sfs->sfs_super.sp_nblocks) / CHAR_BIT;
+	for (i=0; i<n; i++) {
+		used[i] &= ~resv[i];
+		resv[i] = 0;
+	}
+	bitmap_recount(sfs->sfs_freemap);
+	bitmap_recount(sfs->sfs_resvmap);
+	sfs->sfs_nresv = 0;
+	sfs->sfs_resvgen++;
+}
+
+/*
+ * Find and mark the first free block at or after GOAL. Reserved
+ * blocks count as free if there's nothing else. Call with
+ * sfs_freemaplock held.
+ */
+static
+int
+sfs_alloc_near(struct sfs_fs *sfs, uint32_t goal, uint32_t *block)
+{
+	int result;
+
+	result = bitmap_alloc_near(sfs->sfs_freemap, goal, block);
+	if (result == ENOSPC && sfs->sfs_nresv > 0) {
+		sfs_takeback_resv(sfs);
+		result = bitmap_alloc_near(sfs->sfs_freemap, goal, block);
+	}
+	return result;
+}
+
+/*
+ * Allocate a block, the first free one at or after GOAL.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	result = sfs_alloc_near(sfs, goal, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	sfs_mapchanged(sfs, *diskblock);
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
@@ -106,6 +220,118 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
 	return sfs_clearblock(sfs, *diskblock);
 }
 
+/*
+ * Give back whatever is left of a file's reservation.
+ */
+static
+void
+sfs_unreserve(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	if (sv->sv_nresv == 0) {
+		return;
+	}
+
+	/* The disk never saw it, so no freemap blocks need writing. */
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sv->sv_resvgen == sfs->sfs_resvgen) {
+		bitmap_unmark_range(sfs->sfs_freemap, sv->sv_resv,
+				    sv->sv_nresv);
+		bitmap_unmark_range(sfs->sfs_resvmap, sv->sv_resv,
+				    sv->sv_nresv);
+		sfs->sfs_nresv -= sv->sv_nresv;
+	}
+	lock_release(sfs->sfs_freemaplock);
+	sv->sv_nresv = 0;
+}
+
+/*
+ * Take the next block of a file's reservation. Call with
+ * sfs_freemaplock held.
+ */
+static
+uint32_t
+sfs_useresv(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	uint32_t block;
+
+	block = sv->sv_resv++;
+	sv->sv_nresv--;
+	bitmap_unmark(sfs->sfs_resvmap, block);
+	sfs->sfs_nresv--;
+	return block;
+}
+
+/*
+ * Allocate a block for a file (data or indirect), keeping the file's
+ * blocks together: take the block after the last one the file got if
+ * it's free, else the next block of the file's reservation, else
+ * start a new reservation of SFS_CLUSTER blocks near the last one,
+ * and if there's no run that long, take any free block nearby. A new
+ * file starts out next to its inode.
+ *
+ * A reservation holds blocks out of the freemap only while the vnode
+ * is loaded; sfs_reclaim and sfs_truncate hand them back, and
+ * sfs_alloc_near takes them all back when the disk is full.
+ */
+static
+int
+sfs_balloc_file(struct sfs_vnode *sv, uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t goal, block;
+	int result;
+
+	goal = (sv->sv_lastalloc != 0 ? sv->sv_lastalloc : sv->sv_ino) + 1;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sv->sv_resvgen != sfs->sfs_resvgen) {
+		/* taken back */
+		sv->sv_nresv = 0;
+	}
+	if (sv->sv_nresv > 0 && sv->sv_resv == goal) {
+		/* next block of the reservation */
+		block = sfs_useresv(sfs, sv);
+	}
+	else if (goal < sfs->sfs_super.sp_nblocks &&
+		 !bitmap_isset(sfs->sfs_freemap, goal)) {
+		/* the block right after the last one */
+		bitmap_mark(sfs->sfs_freemap, goal);
+		block = goal;
+	}
+	else if (sv->sv_nresv > 0) {
+		block = sfs_useresv(sfs, sv);
+	}
+	else if (bitmap_alloc_range(sfs->sfs_freemap, goal, SFS_CLUSTER,
+				    &block) == 0) {
+		/* keep the rest of the run for what comes next */
+		sv->sv_resv = block + 1;
+		sv->sv_nresv = SFS_CLUSTER - 1;
+		sv->sv_resvgen = sfs->sfs_resvgen;
+		bitmap_mark_range(sfs->sfs_resvmap, sv->sv_resv, sv->sv_nresv);
+		sfs->sfs_nresv += sv->sv_nresv;
+	}
+	else {
+		result = sfs_alloc_near(sfs, goal, &block);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+	}
+
+	if (block >= sfs->sfs_super.sp_nblocks) {
+		panic("sfs: balloc: invalid block %u\n", block);
+	}
+	sfs_mapchanged(sfs, block);
+	lock_release(sfs->sfs_freemaplock);
+	sv->sv_lastalloc = block;
+	*diskblock = block;
+
+	/* Clear block before returning it */
+	return sfs_clearblock(sfs, block);
+}
+
 /*
  * Free a block.
  */
@@ -113,8 +339,17 @@ static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	/*
+	 * Whatever's cached for it needn't be written back now. (Do
+	 * this first, so we can't drop the buffer of someone who has
+	 * already allocated the block again.)
+	 */
+	buffer_drop(sfs->sfs_device, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	sfs_mapchanged(sfs, diskblock);
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -124,11 +359,16 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
@@ -140,28 +380,33 @@ sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
  * allocated.
+ *
+ * After the direct blocks come the blocks mapped by the indirect
+ * block, then those mapped through the double indirect block, then
+ * those mapped through the triple indirect block. Each level of
+ * indirection multiplies the reach by SFS_DBPERIDB.
+ *
+ * Walking down from the inode costs a buffer lookup per level, so we
+ * remember the last bottom-level indirect block we used; the next
+ * block of a file being read or written in order is usually mapped
+ * by the same one.
  */
 static
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t block;
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t *rootp;
+	uint32_t block, next;
 	uint32_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t rel, span, idx;
+	int level, l;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,14 +421,14 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_balloc_file(sv, &block);
 			if (result) {
 				return result;
 			}
 
 			/* Remember what we allocated; mark inode dirty */
 			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
+			sfs_dirty_inode(sv);
 		}
 
 		/*
@@ -197,88 +442,116 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		return 0;
 	}
 
-	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
+	if (sv->sv_bmleaf != 0 && fileblock >= sv->sv_bmleafstart &&
+	    fileblock - sv->sv_bmleafstart < SFS_DBPERIDB) {
+		/* Same bottom-level indirect block as last time. */
+		idblock = sv->sv_bmleaf;
+		rel = fileblock - sv->sv_bmleafstart;
+		goto leaf;
+	}
 
 	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * Figure out which indirect tree the block is in (LEVEL), and
+	 * its offset REL within the blocks that tree maps. SPAN is how
+	 * many blocks one pointer in the tree's top block covers.
 	 */
-	if (idnum > 0) {
+	rel = fileblock - SFS_NDIRECT;
+	span = 1;
+	for (level=1; level<=3; level++) {
+		if (rel < span * SFS_DBPERIDB) {
+			break;
+		}
+		rel -= span * SFS_DBPERIDB;
+		span *= SFS_DBPERIDB;
+	}
+	if (level > 3) {
 		return EFBIG;
 	}
+	rootp = level == 1 ? &sv->sv_i.sfi_indirect :
+		level == 2 ? &sv->sv_i.sfi_dindirect :
+		&sv->sv_i.sfi_tindirect;
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
+	/* Get the top indirect block, allocating it if need be. */
+	block = *rootp;
+	if (block==0 && !doalloc) {
 		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
+		 * Nothing allocated there. We weren't asked to
+		 * allocate anything, so pretend the tree was filled
+		 * with all zeros.
 		 */
 		*diskblock = 0;
 		return 0;
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
+	else if (block==0) {
+		result = sfs_balloc_file(sv, &block);
 		if (result) {
 			return result;
 		}
+		*rootp = block;
+		sfs_dirty_inode(sv);
+	}
 
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
-
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
+	/* Walk down to the bottom-level indirect block. */
+	for (l=level; l>1; l--) {
+		idx = rel / span;
+		rel %= span;
+		span /= SFS_DBPERIDB;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
+		result = buffer_read(sfs->sfs_device, block, &idbuf);
 		if (result) {
 			return result;
 		}
+		iddata = buffer_map(idbuf);
+		next = iddata[idx];
+		if (next==0 && doalloc) {
+			result = sfs_balloc_file(sv, &next);
+			if (result) {
+				buffer_release(idbuf);
+				return result;
+			}
+			iddata[idx] = next;
+			buffer_mark_dirty(idbuf);
+		}
+		buffer_release(idbuf);
+
+		if (next == 0) {
+			*diskblock = 0;
+			return 0;
+		}
+		block = next;
+	}
+	idblock = block;
+
+	sv->sv_bmleaf = idblock;
+	sv->sv_bmleafstart = fileblock - rel;
+
+ leaf:
+	/*
+	 * Get the indirect block from the buffer cache. (If we just
+	 * allocated it, sfs_balloc left it there, zeroed.)
+	 */
+	result = buffer_read(sfs->sfs_device, idblock, &idbuf);
+	if (result) {
+		return result;
 	}
+	iddata = buffer_map(idbuf);
 
 	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	block = iddata[rel];
 
 	/* If there's no block there, allocate one */
 	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		result = sfs_balloc_file(sv, &block);
 		if (result) {
+			buffer_release(idbuf);
 			return result;
 		}
 
 		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+		iddata[rel] = block;
+		buffer_mark_dirty(idbuf);
 	}
+	buffer_release(idbuf);
 
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
@@ -308,16 +581,9 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuf;
+	char *iodata;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -339,40 +605,37 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = buffer_read(sfs->sfs_device, diskblock, &iobuf);
 	if (result) {
 		return result;
 	}
+	iodata = buffer_map(iobuf);
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 */
+	result = uiomove(iodata+skipstart, len, uio);
+
+	/*
+	 * If it was a write, the buffer now needs writing back. That
+	 * goes even if uiomove failed partway, since whatever it did
+	 * copy is in the buffer now.
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		buffer_mark_dirty(iobuf);
 	}
+	buffer_release(iobuf);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -383,14 +646,11 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
 	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -413,33 +673,73 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
+	 * Go through the buffer cache. A write replaces the whole
+	 * block, so there's no need to read it first.
 	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+	if (uio->uio_rw == UIO_READ) {
+		result = buffer_read(sfs->sfs_device, diskblock, &iobuf);
+	}
+	else {
+		result = buffer_get(sfs->sfs_device, diskblock, &iobuf);
+	}
+	if (result) {
+		return result;
+	}
 
 	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
+	 * A write that fails partway has still changed the buffer, so
+	 * it needs writing back too, unless the buffer never held the
+	 * block's old contents; then the rest of it is garbage, and
+	 * buffer_release just forgets it.
 	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	result = uiomove(buffer_map(iobuf), SFS_BLOCKSIZE, uio);
+	if (uio->uio_rw == UIO_WRITE &&
+	    (result == 0 || buffer_valid(iobuf))) {
+		buffer_mark_dirty(iobuf);
+	}
+	buffer_release(iobuf);
 
 	return result;
 }
 
+/*
+ * Before reading NBLOCKS (at most BUF_MAXRUN) whole blocks starting
+ * at file block FILEBLOCK, get the ones that lie in consecutive disk
+ * blocks into the buffer cache with one device request per run,
+ * instead of one per block. Failures are left for sfs_blockio to
+ * find.
+ */
+static
+void
+sfs_readruns(struct sfs_vnode *sv, uint32_t fileblock, uint32_t nblocks)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t diskblock, next, run;
+
+	KASSERT(nblocks <= BUF_MAXRUN);
+	while (nblocks > 1) {
+		if (sfs_bmap(sv, fileblock, 0, &diskblock)) {
+			return;
+		}
+		run = 1;
+		while (diskblock != 0 && run < nblocks) {
+			if (sfs_bmap(sv, fileblock + run, 0, &next)) {
+				return;
+			}
+			if (next != diskblock + run) {
+				break;
+			}
+			run++;
+		}
+		if (run > 1) {
+			buffer_readrun(sfs->sfs_device, diskblock, run);
+		}
+		fileblock += run;
+		nblocks -= run;
+	}
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  */
@@ -448,7 +748,7 @@ int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
 	uint32_t blkoff;
-	uint32_t nblocks, i;
+	uint32_t nblocks, i, window;
 	int result = 0;
 	uint32_t extraresid = 0;
 
@@ -507,6 +807,15 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
 	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
 	for (i=0; i<nblocks; i++) {
+		if (uio->uio_rw == UIO_READ && i % BUF_MAXRUN == 0) {
+			/* fetch the next window's worth ahead of use */
+			window = nblocks - i;
+			if (window > BUF_MAXRUN) {
+				window = BUF_MAXRUN;
+			}
+			sfs_readruns(sv, uio->uio_offset / SFS_BLOCKSIZE,
+				     window);
+		}
 		result = sfs_blockio(sv, uio);
 		if (result) {
 			goto out;
@@ -531,7 +840,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	if (uio->uio_rw == UIO_WRITE && 
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
 		sv->sv_i.sfi_size = uio->uio_offset;
-		sv->sv_dirty = true;
+		sfs_dirty_inode(sv);
 	}
 
 	/* Add in any extra amount we couldn't read because of EOF */
@@ -541,10 +850,81 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	return result;
 }
 
+/*
+ * Sequential read detection. Called after a read of file blocks
+ * FIRST through LAST. If this read started where the previous one
+ * left off, widen the read-ahead window and queue background reads
+ * of the blocks after LAST that the window now covers and that
+ * haven't been queued yet; otherwise close the window.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, uint32_t first, uint32_t last)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t fileblocks, block, end, diskblock;
+
+	if (first == sv->sv_ranext || first + 1 == sv->sv_ranext) {
+		/* (a read can start in the block the last one ended in) */
+		if (sv->sv_rawin == 0) {
+			sv->sv_rawin = SFS_RAMIN;
+		}
+		else if (sv->sv_rawin < SFS_RAMAX) {
+			sv->sv_rawin *= 2;
+		}
+	}
+	else {
+		sv->sv_rawin = 0;
+		sv->sv_raend = last + 1;
+	}
+	sv->sv_ranext = last + 1;
+
+	if (sv->sv_rawin == 0) {
+		return;
+	}
+
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	end = last + 1 + sv->sv_rawin;
+	if (end > fileblocks) {
+		end = fileblocks;
+	}
+	block = sv->sv_raend > last + 1 ? sv->sv_raend : last + 1;
+	for (; block < end; block++) {
+		if (sfs_bmap(sv, block, 0, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			buffer_readahead(sfs->sfs_device, diskblock);
+		}
+	}
+	if (end > sv->sv_raend) {
+		sv->sv_raend = end;
+	}
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Directory I/O
 
+/*
+ * Compute where in a directory slot SLOT lives. In the hashed layout
+ * slots are numbered SFS_DIRBLK_NENTRIES to a block, and each block
+ * starts with a header the size of one entry.
+ */
+static
+off_t
+sfs_dir_slotpos(struct sfs_vnode *sv, int slot)
+{
+	COMPILE_ASSERT(sizeof(struct sfs_dirblock) == SFS_BLOCKSIZE);
+
+	if (sv->sv_i.sfi_flags & SFS_IF_HASHDIR) {
+		return (off_t)(slot / SFS_DIRBLK_NENTRIES) * SFS_BLOCKSIZE +
+			(slot % SFS_DIRBLK_NENTRIES + 1) *
+			sizeof(struct sfs_dir);
+	}
+	return (off_t)slot * sizeof(struct sfs_dir);
+}
+
 /*
  * Read the directory entry out of slot SLOT of a directory vnode.
  * The "slot" is the index of the directory entry, starting at 0.
@@ -559,7 +939,7 @@ sfs_readdir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
 	int result;
 
 	/* Compute the actual position in the directory to read. */
-	actualpos = slot * sizeof(struct sfs_dir);
+	actualpos = sfs_dir_slotpos(sv, slot);
 
 	/* Set up a uio to do the read */ 
 	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_READ);
@@ -594,7 +974,7 @@ sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
 
 	/* Compute the actual position in the directory. */
 	KASSERT(slot>=0);
-	actualpos = slot * sizeof(struct sfs_dir);
+	actualpos = sfs_dir_slotpos(sv, slot);
 
 	/* Set up a uio to do the write */ 
 	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_WRITE);
@@ -605,35 +985,186 @@ sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
 		return result;
 	}
 
-	/* Should not end up with a partial entry! */
-	if (ku.uio_resid > 0) {
-		panic("sfs: writedir: Short write (ino %u)\n", sv->sv_ino);
+	/* Should not end up with a partial entry! */
+	if (ku.uio_resid > 0) {
+		panic("sfs: writedir: Short write (ino %u)\n", sv->sv_ino);
+	}
+
+	/* Done */
+	return 0;
+}
+
+/*
+ * Compute the number of entries in a directory.
+ * This actually computes the number of existing slots, and does not
+ * account for empty slots.
+ */
+static
+int
+sfs_dir_nentries(struct sfs_vnode *sv)
+{
+	off_t size;
+
+	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+
+	size = sv->sv_i.sfi_size;
+	if (size % sizeof(struct sfs_dir) != 0) {
+		panic("sfs: directory %u: Invalid size %llu\n",
+		      sv->sv_ino, size);
+	}
+
+	return size / sizeof(struct sfs_dir);
+}
+
+/*
+ * Hash a name to its bucket in a hashed directory (see kern/sfs.h).
+ */
+uint32_t
+sfs_dirhash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h % SFS_DIRHASH_NBUCKETS;
+}
+
+/*
+ * sfs_dir_findname for hashed directories: only NAME's bucket is
+ * searched. The empty slot handed back, if any, is the first one in
+ * the bucket. If LASTBLOCK isn't NULL, the file block number of the
+ * bucket's last block is handed back too.
+ */
+static
+int
+sfs_hdir_findname(struct sfs_vnode *sv, const char *name,
+		  uint32_t *ino, int *slot, int *emptyslot,
+		  uint32_t *lastblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dirblock *db;
+	struct sfs_dir tsd;
+	struct buf *b;
+	uint32_t fileblock, diskblock, next, nblocks;
+	int found = 0;
+	int i, result;
+
+	nblocks = sv->sv_i.sfi_size / SFS_BLOCKSIZE;
+	fileblock = sfs_dirhash(name);
+
+	while (1) {
+		result = sfs_bmap(sv, fileblock, 0, &diskblock);
+		if (result) {
+			return result;
+		}
+
+		if (diskblock == 0) {
+			/* Never written: an empty bucket */
+			if (emptyslot != NULL && *emptyslot < 0) {
+				*emptyslot = fileblock * SFS_DIRBLK_NENTRIES;
+			}
+			next = 0;
+		}
+		else {
+			result = buffer_read(sfs->sfs_device, diskblock, &b);
+			if (result) {
+				return result;
+			}
+			db = buffer_map(b);
+
+			for (i=0; i<SFS_DIRBLK_NENTRIES; i++) {
+				tsd = db->sdb_entries[i];
+				if (tsd.sfd_ino == SFS_NOINO) {
+					if (emptyslot != NULL &&
+					    *emptyslot < 0) {
+						*emptyslot = fileblock *
+							SFS_DIRBLK_NENTRIES + i;
+					}
+					continue;
+				}
+
+				/* Ensure null termination, just in case */
+				tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+				if (!strcmp(tsd.sfd_name, name)) {
+					/* Each name may appear only once */
+					KASSERT(found==0);
+
+					found = 1;
+					if (slot != NULL) {
+						*slot = fileblock *
+							SFS_DIRBLK_NENTRIES + i;
+					}
+					if (ino != NULL) {
+						*ino = tsd.sfd_ino;
+					}
+				}
+			}
+			next = db->sdb_next;
+			buffer_release(b);
+		}
+
+		if (next == 0) {
+			break;
+		}
+		if (next < SFS_DIRHASH_NBUCKETS || next >= nblocks) {
+			panic("sfs: directory %u: Bad chain link %u\n",
+			      sv->sv_ino, next);
+		}
+		fileblock = next;
 	}
 
-	/* Done */
-	return 0;
+	if (lastblock != NULL) {
+		*lastblock = fileblock;
+	}
+	return found ? 0 : ENOENT;
 }
 
 /*
- * Compute the number of entries in a directory.
- * This actually computes the number of existing slots, and does not
- * account for empty slots.
+ * Add an overflow block to the end of a hashed directory, chained
+ * after file block LAST, and hand back its file block number.
  */
 static
 int
-sfs_dir_nentries(struct sfs_vnode *sv)
+sfs_hdir_addblock(struct sfs_vnode *sv, uint32_t last, uint32_t *ret)
 {
-	off_t size;
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dirblock *db;
+	struct buf *b;
+	uint32_t newblock, diskblock;
+	int result;
 
-	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+	/* Allocate it (sfs_bmap hands it back zeroed: empty, no next) */
+	newblock = sv->sv_i.sfi_size / SFS_BLOCKSIZE;
+	result = sfs_bmap(sv, newblock, 1, &diskblock);
+	if (result) {
+		return result;
+	}
+	sv->sv_i.sfi_size += SFS_BLOCKSIZE;
+	sfs_dirty_inode(sv);
 
-	size = sv->sv_i.sfi_size;
-	if (size % sizeof(struct sfs_dir) != 0) {
-		panic("sfs: directory %u: Invalid size %llu\n",
-		      sv->sv_ino, size);
+	/*
+	 * Link it in. LAST can't be a hole; the bucket would have had
+	 * room.
+	 */
+	result = sfs_bmap(sv, last, 0, &diskblock);
+	if (result) {
+		return result;
+	}
+	KASSERT(diskblock != 0);
+	result = buffer_read(sfs->sfs_device, diskblock, &b);
+	if (result) {
+		return result;
 	}
+	db = buffer_map(b);
+	KASSERT(db->sdb_next == 0);
+	db->sdb_next = newblock;
+	buffer_mark_dirty(b);
+	buffer_release(b);
 
-	return size / sizeof(struct sfs_dir);
+	*ret = newblock;
+	return 0;
 }
 
 /*
@@ -649,9 +1180,16 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 {
 	struct sfs_dir tsd;
 	int found = 0;
-	int nentries = sfs_dir_nentries(sv);
+	int nentries;
 	int i, result;
 
+	if (sv->sv_i.sfi_flags & SFS_IF_HASHDIR) {
+		return sfs_hdir_findname(sv, name, ino, slot, emptyslot,
+					 NULL);
+	}
+
+	nentries = sfs_dir_nentries(sv);
+
 	/* For each slot... */
 	for (i=0; i<nentries; i++) {
 
@@ -697,11 +1235,21 @@ int
 sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 {
 	int emptyslot = -1;
+	bool hashed;
+	uint32_t last = 0, newblock;
 	int result;
 	struct sfs_dir sd;
 
+	hashed = (sv->sv_i.sfi_flags & SFS_IF_HASHDIR) != 0;
+
 	/* Look up the name. We want to make sure it *doesn't* exist. */
-	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
+	if (hashed) {
+		result = sfs_hdir_findname(sv, name, NULL, NULL, &emptyslot,
+					   &last);
+	}
+	else {
+		result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
+	}
 	if (result!=0 && result!=ENOENT) {
 		return result;
 	}
@@ -713,8 +1261,18 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return ENAMETOOLONG;
 	}
 
-	/* If we didn't get an empty slot, add the entry at the end. */
-	if (emptyslot < 0) {
+	/*
+	 * If we didn't get an empty slot, add the entry at the end:
+	 * of the directory, or of the bucket's chain.
+	 */
+	if (emptyslot < 0 && hashed) {
+		result = sfs_hdir_addblock(sv, last, &newblock);
+		if (result) {
+			return result;
+		}
+		emptyslot = newblock * SFS_DIRBLK_NENTRIES;
+	}
+	else if (emptyslot < 0) {
 		emptyslot = sfs_dir_nentries(sv);
 	}
 
@@ -750,9 +1308,159 @@ sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 	return sfs_writedir(sv, &sd, slot);
 }
 
+/*
+ * Exchange the block maps (and with them the sizes and layouts) of
+ * two inodes.
+ */
+static
+void
+sfs_swapmaps(struct sfs_inode *a, struct sfs_inode *b)
+{
+	uint32_t t;
+	unsigned i;
+
+#define SWAP(f) (t = a->f, a->f = b->f, b->f = t)
+	SWAP(sfi_size);
+	SWAP(sfi_flags);
+	for (i=0; i<SFS_NDIRECT; i++) {
+		SWAP(sfi_direct[i]);
+	}
+	SWAP(sfi_indirect);
+	SWAP(sfi_dindirect);
+	SWAP(sfi_tindirect);
+#undef SWAP
+}
+
+/*
+ * Switch a flat directory over to the hashed layout once it has
+ * SFS_DIRHASH_MIN slots. Called before adding a name.
+ *
+ * A crash partway through mustn't lose the directory, so its blocks
+ * are left alone until the end. The hashed layout is built in newly
+ * allocated blocks, mapped by a scratch vnode that is never written
+ * out itself, and flushed to disk along with the freemap blocks that
+ * mark them in use. Then the directory's inode is switched over to
+ * the new blocks with one write, and only once that is on disk are
+ * the flat blocks freed, so they can't be reused while the inode on
+ * disk still points at them. A crash before the switch leaves the
+ * flat directory, and at worst leaks the new blocks; one after it
+ * leaves the hashed directory, and at worst leaks the flat blocks.
+ */
+static
+int
+sfs_dir_maybehash(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_vnode *nsv;
+	struct sfs_dir sd;
+	int nentries, i;
+	int result;
+
+	if (sv->sv_i.sfi_flags & SFS_IF_HASHDIR) {
+		return 0;
+	}
+	nentries = sfs_dir_nentries(sv);
+	if (nentries < SFS_DIRHASH_MIN) {
+		return 0;
+	}
+
+	nsv = kmalloc(sizeof(*nsv));
+	if (nsv == NULL) {
+		/* Stay flat for now; that still works */
+		return 0;
+	}
+
+	/*
+	 * Set up the scratch vnode: an empty hashed directory. It's
+	 * only used here, under SV's lock. Starting it out dirty keeps
+	 * sfs_dirty_inode from putting it on the dirty list.
+	 */
+	nsv->sv_v.vn_fs = sv->sv_v.vn_fs;
+	nsv->sv_v.vn_data = nsv;
+	nsv->sv_i = sv->sv_i;
+	bzero(nsv->sv_i.sfi_direct, sizeof(nsv->sv_i.sfi_direct));
+	nsv->sv_i.sfi_indirect = 0;
+	nsv->sv_i.sfi_dindirect = 0;
+	nsv->sv_i.sfi_tindirect = 0;
+	nsv->sv_i.sfi_flags |= SFS_IF_HASHDIR;
+	nsv->sv_i.sfi_size = SFS_DIRHASH_NBUCKETS * SFS_BLOCKSIZE;
+	nsv->sv_ino = sv->sv_ino;
+	nsv->sv_lock = sv->sv_lock;
+	nsv->sv_dirty = true;
+	nsv->sv_dirtynext = NULL;
+	nsv->sv_dirtyprev = NULL;
+	nsv->sv_hashnext = NULL;
+	nsv->sv_hashprev = NULL;
+	nsv->sv_ranext = 0;
+	nsv->sv_rawin = 0;
+	nsv->sv_raend = 0;
+	nsv->sv_bmleaf = 0;
+	nsv->sv_bmleafstart = 0;
+	nsv->sv_lastalloc = 0;
+	nsv->sv_resv = 0;
+	nsv->sv_nresv = 0;
+	nsv->sv_resvgen = 0;
+
+	/* Copy the entries over, and get them and the freemap to disk. */
+	result = 0;
+	for (i=0; i<nentries && result==0; i++) {
+		result = sfs_readdir(sv, &sd, i);
+		if (result == 0 && sd.sfd_ino != SFS_NOINO) {
+			sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+			result = sfs_dir_link(nsv, sd.sfd_name, sd.sfd_ino,
+					      NULL);
+		}
+	}
+	if (result == 0) {
+		result = sfs_sync_freemap(sfs);
+	}
+	if (result == 0) {
+		result = buffer_sync(sfs->sfs_device);
+	}
+	if (result) {
+		/* The flat directory is untouched; drop the new blocks. */
+		sfs_dotruncate(nsv, 0);
+		kfree(nsv);
+		return result;
+	}
+
+	/* Switch over, and get the inode onto the disk. */
+	sfs_swapmaps(&sv->sv_i, &nsv->sv_i);
+	sv->sv_bmleaf = 0;
+	sv->sv_lastalloc = nsv->sv_lastalloc;
+	sv->sv_ranext = 0;
+	sv->sv_rawin = 0;
+	sv->sv_raend = 0;
+	sfs_dirty_inode(sv);
+	result = sfs_sync_inode(sv);
+	if (result == 0) {
+		result = buffer_sync(sfs->sfs_device);
+	}
+	if (result) {
+		/*
+		 * The inode on disk may still point at the flat
+		 * blocks, so they can't be freed. Leak them.
+		 */
+		kprintf("sfs: directory %u: hashing: %s\n",
+			sv->sv_ino, strerror(result));
+		sfs_unreserve(nsv);
+		kfree(nsv);
+		return 0;
+	}
+
+	/* Now the flat blocks can go. */
+	nsv->sv_bmleaf = 0;
+	result = sfs_dotruncate(nsv, 0);
+	kfree(nsv);
+	return result;
+}
+
 /*
  * Look for a name in a directory and hand back a vnode for the
  * file, if there is one.
+ *
+ * Callers that don't need the slot are answered from the name cache
+ * when possible; the result of going to the directory is cached.
  */
 static
 int
@@ -761,10 +1469,22 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		int *slot)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct vnode *cached;
 	uint32_t ino;
 	int result;
 
+	if (slot == NULL && dcache_lookup(&sv->sv_v, name, &cached)) {
+		if (cached == NULL) {
+			return ENOENT;
+		}
+		*ret = cached->vn_data;
+		return 0;
+	}
+
 	result = sfs_dir_findname(sv, name, &ino, slot, NULL);
+	if (result == ENOENT) {
+		dcache_enter(&sv->sv_v, name, NULL);
+	}
 	if (result) {
 		return result;
 	}
@@ -779,6 +1499,7 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		      (*ret)->sv_ino, sv->sv_ino);
 	}
 
+	dcache_enter(&sv->sv_v, name, &(*ret)->sv_v);
 	return 0;
 }
 
@@ -801,7 +1522,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, &ino);
 	if (result) {
 		return result;
 	}
@@ -875,8 +1596,18 @@ static
 int
 sfs_close(struct vnode *v)
 {
-	/* Sync it. */
-	return VOP_FSYNC(v);
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	/*
+	 * Put the inode back in the buffer cache. Getting it (and
+	 * the data) to disk is left for sync, as in Unix.
+	 */
+	lock_acquire(sv->sv_lock);
+	result = sfs_sync_inode(sv);
+	lock_release(sv->sv_lock);
+
+	return result;
 }
 
 /*
@@ -890,31 +1621,37 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * Holding the vnode table lock keeps sfs_loadvnode (and
+	 * sfs_sync) from finding the vnode while we're at it.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. If they have, this consumes
+	 * the reference VOP_DECREF gave us.
 	 */
-	if (v->vn_refcount != 1) {
-
-		/* consume the reference VOP_DECREF gave us */
-		KASSERT(v->vn_refcount>1);
-		v->vn_refcount--;
-
-		vfs_biglock_release();
+	if (!vnode_lastref(v)) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
 
+	/*
+	 * Nobody else has a reference, so nobody else can be holding
+	 * sv_lock either; the rest goes without it.
+	 */
+
+	/* Blocks held for the file to grow into go back to the freemap. */
+	sfs_unreserve(sv);
+
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
+		result = sfs_dotruncate(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_vnlock);
 			return result;
 		}
 	}
@@ -922,7 +1659,7 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -932,27 +1669,20 @@ sfs_reclaim(struct vnode *v)
 	}
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
+	KASSERT(*sv->sv_hashprev == sv);
+	*sv->sv_hashprev = sv->sv_hashnext;
+	if (sv->sv_hashnext != NULL) {
+		sv->sv_hashnext->sv_hashprev = sv->sv_hashprev;
 	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
 
 	VOP_CLEANUP(&sv->sv_v);
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_vnlock);
 
 	/* Release the storage for the vnode structure itself. */
+	lock_destroy(sv->sv_lock);
 	kfree(sv);
 
 	/* Done */
@@ -967,13 +1697,19 @@ int
 sfs_read(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	off_t start;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
+	start = uio->uio_offset;
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	if (result == 0 && uio->uio_offset > start) {
+		sfs_readahead(sv, start / SFS_BLOCKSIZE,
+			      (uio->uio_offset - 1) / SFS_BLOCKSIZE);
+	}
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -990,9 +1726,11 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+
+	vnode_modified(v);
 
 	return result;
 }
@@ -1033,7 +1771,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1053,16 +1793,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes once the vnode is loaded; no lock needed */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1100,13 +1837,18 @@ int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	if (result) {
+		return result;
+	}
 
-	return result;
+	/* we don't track which buffers are whose; write them all */
+	return buffer_sync(sfs->sfs_device);
 }
 
 /*
@@ -1121,35 +1863,98 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Truncate one indirect tree: free the data blocks it maps at or past
+ * file block KEEP, and any indirect blocks left with nothing in them.
+ * *BLOCKP points to the tree's root block, which maps file blocks
+ * starting at BASE, SPAN blocks per pointer (1 for an indirect block
+ * that points straight at data blocks). If the root is freed, *BLOCKP
+ * is cleared and *CHANGED set.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_trunc_indirect(struct sfs_fs *sfs, uint32_t *blockp, uint32_t span,
+		   uint32_t base, uint32_t keep, bool *changed)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t j, entrybase;
+	bool hasnonzero, iddirty;
+	int result;
 
-	struct sfs_vnode *sv = v->vn_data;
+	if (*blockp == 0 || keep >= base + span * SFS_DBPERIDB) {
+		/* nothing here past the new EOF */
+		return 0;
+	}
+
+	result = buffer_read(sfs->sfs_device, *blockp, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buffer_map(idbuf);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		entrybase = base + j * span;
+		if (iddata[j] == 0) {
+			continue;
+		}
+		if (span == 1) {
+			/* Discard any blocks that are past the new EOF */
+			if (entrybase >= keep) {
+				sfs_bfree(sfs, iddata[j]);
+				iddata[j] = 0;
+				iddirty = true;
+			}
+		}
+		else {
+			result = sfs_trunc_indirect(sfs, &iddata[j],
+						    span / SFS_DBPERIDB,
+						    entrybase, keep, &iddirty);
+			if (result) {
+				break;
+			}
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (iddata[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (iddirty) {
+		buffer_mark_dirty(idbuf);
+	}
+	buffer_release(idbuf);
+
+	if (result == 0 && !hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		sfs_bfree(sfs, *blockp);
+		*blockp = 0;
+		*changed = true;
+	}
+	return result;
+}
+
+/*
+ * Truncate a file to LEN bytes. Called from sfs_truncate with the
+ * vnode locked, and from sfs_reclaim.
+ */
+static
+int
+sfs_dotruncate(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
+	uint32_t *rootp;
+	uint32_t i, block, base, span;
+	int level;
 	int result;
-	int hasnonzero, iddirty;
+	bool changed;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	vfs_biglock_acquire();
+	sfs_unreserve(sv);
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -1160,70 +1965,62 @@ sfs_truncate(struct vnode *v, off_t len)
 		if (i >= blocklen && block != 0) {
 			sfs_bfree(sfs, block);
 			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
+			sfs_dirty_inode(sv);
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
+	/* Then the single, double, and triple indirect trees. */
+	base = SFS_NDIRECT;
+	span = 1;
+	for (level=1; level<=3; level++) {
+		rootp = level == 1 ? &sv->sv_i.sfi_indirect :
+			level == 2 ? &sv->sv_i.sfi_dindirect :
+			&sv->sv_i.sfi_tindirect;
+		changed = false;
+		result = sfs_trunc_indirect(sfs, rootp, span, base, blocklen,
+					    &changed);
+		if (changed) {
+			sfs_dirty_inode(sv);
+		}
 		if (result) {
-			vfs_biglock_release();
+			sv->sv_bmleaf = 0;
 			return result;
 		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
+		base += span * SFS_DBPERIDB;
+		span *= SFS_DBPERIDB;
 	}
 
+	/* Indirect blocks may have gone; forget bmap's shortcut. */
+	sv->sv_bmleaf = 0;
+
 	/* Set the file size */
 	sv->sv_i.sfi_size = len;
 
 	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+	sfs_dirty_inode(sv);
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Called for ftruncate().
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_dotruncate(sv, len);
+	lock_release(sv->sv_lock);
+
+	vnode_modified(v);
+
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1256,40 +2053,42 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_vnode *newguy;
-	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
-	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
+	result = sfs_lookonce(sv, name, &newguy, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
-	/* If it exists and we didn't want it to, fail */
-	if (result==0 && excl) {
-		vfs_biglock_release();
-		return EEXIST;
-	}
-
 	if (result==0) {
-		/* We got a file; load its vnode and return */
-		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
-		if (result) {
-			vfs_biglock_release();
-			return result;
+		lock_release(sv->sv_lock);
+
+		/* If it exists and we didn't want it to, fail */
+		if (excl) {
+			VOP_DECREF(&newguy->sv_v);
+			return EEXIST;
 		}
+
+		/* Otherwise, we got the file; return it */
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
 		return 0;
 	}
 
+	/* Make room for lots of names, if need be */
+	result = sfs_dir_maybehash(sv);
+	if (result) {
+		lock_release(sv->sv_lock);
+		return result;
+	}
+
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1299,20 +2098,24 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		lock_release(sv->sv_lock);
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
-	newguy->sv_dirty = true;
+	sfs_dirty_inode(newguy);
+	lock_release(newguy->sv_lock);
+
+	dcache_enter(v, name, &newguy->sv_v);
 
 	*ret = &newguy->sv_v;
 	
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1331,20 +2134,36 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	/* No links to directories. (This also means F isn't SV.) */
+	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
+		return EPERM;
+	}
+
+	lock_acquire(sv->sv_lock);
+
+	/* Make room for lots of names, if need be */
+	result = sfs_dir_maybehash(sv);
+	if (result) {
+		lock_release(sv->sv_lock);
+		return result;
+	}
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
-	f->sv_dirty = true;
+	sfs_dirty_inode(f);
+	lock_release(f->sv_lock);
+
+	dcache_enter(dir, name, file);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1360,12 +2179,12 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1373,15 +2192,26 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		if (victim != sv) {
+			/* (a bad disk could name the directory in itself) */
+			lock_acquire(victim->sv_lock);
+		}
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
-		victim->sv_dirty = true;
+		sfs_dirty_inode(victim);
+		if (victim != sv) {
+			lock_release(victim->sv_lock);
+		}
+
+		/* The cache may hold a reference too; let go of it. */
+		dcache_enter(dir, name, NULL);
 	}
 
+	lock_release(sv->sv_lock);
+
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1401,21 +2231,23 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* We don't support subdirectories */
 	KASSERT(g1->sv_i.sfi_type == SFS_TYPE_FILE);
 
+	lock_acquire(g1->sv_lock);
+
 	/*
 	 * Link it under the new name.
 	 *
@@ -1431,7 +2263,7 @@ sfs_rename(struct vnode *d1, const char *n1,
 	
 	/* Increment the link count, and mark inode dirty */
 	g1->sv_i.sfi_linkcount++;
-	g1->sv_dirty = true;
+	sfs_dirty_inode(g1);
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -1445,12 +2277,17 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 */
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
-	g1->sv_dirty = true;
+	sfs_dirty_inode(g1);
+
+	dcache_enter(d1, n1, NULL);
+	dcache_enter(d2, n2, &g1->sv_v);
+
+	lock_release(g1->sv_lock);
+	lock_release(sv->sv_lock);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
@@ -1466,9 +2303,11 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	g1->sv_i.sfi_linkcount--;
  puke:
+	lock_release(g1->sv_lock);
+	lock_release(sv->sv_lock);
+
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1486,15 +2325,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +2337,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1510,7 +2344,7 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
  * Lookup gets a vnode for a pathname.
  *
  * Since we don't support subdirectories, it's easy - just look up the
- * name.
+ * name. Names the cache knows about don't need the directory locked.
  */
 static
 int
@@ -1518,24 +2352,32 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_vnode *final;
+	struct vnode *cached;
+	int slot;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
-	
-	result = sfs_lookonce(sv, path, &final, NULL);
+
+	if (dcache_lookup(v, path, &cached)) {
+		if (cached == NULL) {
+			return ENOENT;
+		}
+		*ret = cached;
+		return 0;
+	}
+
+	/* (asking for the slot skips the cache, which we just tried) */
+	lock_acquire(sv->sv_lock);
+	result = sfs_lookonce(sv, path, &final, &slot);
+	lock_release(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1651,33 +2493,31 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: Found inode %u in unallocated block\n",
-			      sv->sv_ino);
-		}
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	for (sv = sfs->sfs_vnhash[SFS_VNHASH(ino)]; sv != NULL;
+	     sv = sv->sv_hashnext) {
 		if (sv->sv_ino==ino) {
 			/* Found */
 
+#if !OPT_NOASSERTS
+			/* Every inode in memory must be in an allocated block */
+			if (!sfs_bused(sfs, sv->sv_ino)) {
+				panic("sfs: Found inode %u in unallocated "
+				      "block\n", sv->sv_ino);
+			}
+#endif
+
 			/* May only be set when creating new objects */
 			KASSERT(forcetype==SFS_TYPE_INVAL);
 
 			VOP_INCREF(&sv->sv_v);
+			lock_release(sfs->sfs_vnlock);
 			*ret = sv;
 			return 0;
 		}
@@ -1687,6 +2527,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1700,6 +2541,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -1714,7 +2556,6 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
-		sv->sv_dirty = true;
 	}
 
 	/*
@@ -1733,23 +2574,51 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		      ino, sv->sv_i.sfi_type);
 	}
 
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_ranext = 0;
+	sv->sv_rawin = 0;
+	sv->sv_raend = 0;
+	sv->sv_bmleaf = 0;
+	sv->sv_bmleafstart = 0;
+	sv->sv_lastalloc = 0;
+	sv->sv_resv = 0;
+	sv->sv_nresv = 0;
+	sv->sv_resvgen = 0;
+	sv->sv_dirtynext = NULL;
+	sv->sv_dirtyprev = NULL;
+
+	/* A new inode has to be written out */
+	if (forcetype != SFS_TYPE_INVAL) {
+		sfs_dirty_inode(sv);
+	}
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
+	sv->sv_hashnext = sfs->sfs_vnhash[SFS_VNHASH(ino)];
+	sv->sv_hashprev = &sfs->sfs_vnhash[SFS_VNHASH(ino)];
+	if (sv->sv_hashnext != NULL) {
+		sv->sv_hashnext->sv_hashprev = &sv->sv_hashnext;
 	}
+	*sv->sv_hashprev = sv;
+	sfs->sfs_nvnodes++;
+
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -1767,14 +2636,10 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
@@ -39,6 +39,7 @@
 #include "opt-A3.h"
 
 struct vnode;
+struct fs;
 
 
 /* 
@@ -56,6 +57,8 @@ struct addrspace {
 
 #if OPT_A3
   bool loadelf_done;
+  bool as_sharedtext1;   /* region is code mapped from the text page cache */
+  bool as_sharedtext2;
   paddr_t *as_pbase1;
   paddr_t *as_pbase2;
   paddr_t *as_stackpbase;
@@ -101,6 +104,10 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_load_text - load a read-only code segment by mapping shared
+ *                pages from the text page cache (OPT_A3). Takes the
+ *                place of reading the segment in for such regions.
  */
 
 struct addrspace *as_create(void);
@@ -117,6 +124,11 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if OPT_A3
+int               as_load_text(struct addrspace *as, struct vnode *v,
+                               off_t offset, vaddr_t vaddr,
+                               size_t memsize, size_t filesize);
+#endif
 
 
 /*
@@ -124,9 +136,17 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
  *    load_elf - load an ELF user program executable into the current
  *               address space. Returns the entry point (initial PC)
  *               in the space pointed to by ENTRYPOINT.
+ *
+ *    elfcache_invalidate - forget the cached headers of V; called
+ *               (via vnode_modified) when V is written or truncated.
+ *
+ *    elfcache_purgefs - forget the cached headers of every file on FS;
+ *               called by vfs_unmount so they don't keep FS busy.
  */
 
 int load_elf(struct vnode *v, vaddr_t *entrypoint);
+void elfcache_invalidate(struct vnode *v);
+void elfcache_purgefs(struct fs *fs);
 
 
 #endif /* _ADDRSPACE_H_ */
@@ -0,0 +1,52 @@
+#ifndef _ARGBUF_H_
+#define _ARGBUF_H_
+
+/*
+ * Argument vector marshalling for execv, spawn, and runprogram.
+ *
+ * An argbuf holds the argument strings packed end to end, each with
+ * its terminating NUL, in a single kernel buffer whose size is a
+ * whole number of pages. The buffer grows (by doubling) as needed,
+ * up to what ARG_MAX allows.
+ *
+ * The size limit is exact: the strings, including their NULs, plus
+ * the argv pointer array (including the NULL at the end) must fit
+ * in ARG_MAX bytes, or E2BIG results. Nothing is truncated.
+ *
+ * argbuf_copyout places the strings and the argv array on a new user
+ * stack with a single copyout. The block looks like this, from low
+ * addresses to high:
+ *
+ *      stackptr -> (padding to 8-byte alignment)
+ *                  argument strings
+ *                  (padding to pointer alignment)
+ *      argv     -> argv[0] .. argv[nargs-1], NULL
+ *                  (old stack top)
+ */
+
+struct argbuf {
+	char *ab_buf;		/* packed strings */
+	size_t ab_len;		/* bytes of ab_buf in use */
+	size_t ab_max;		/* bytes allocated, a multiple of PAGE_SIZE */
+	int ab_nargs;		/* number of strings */
+};
+
+/*
+ * argbuf_init      - initialize AB to empty.
+ * argbuf_fromuser  - fetch the NULL-terminated user argv array UARGV
+ *                    and all its strings.
+ * argbuf_fromkernel - same, from kernel strings ARGS[0..NARGS-1].
+ * argbuf_copyout   - lay out AB below *STACKPTR in the current address
+ *                    space; updates *STACKPTR and returns the user
+ *                    address of argv in *ARGV.
+ * argbuf_cleanup   - free AB's buffer.
+ *
+ * On error the argbuf must still be cleaned up.
+ */
+void argbuf_init(struct argbuf *ab);
+int argbuf_fromuser(struct argbuf *ab, const_userptr_t uargv);
+int argbuf_fromkernel(struct argbuf *ab, char **args, int nargs);
+int argbuf_copyout(struct argbuf *ab, vaddr_t *stackptr, userptr_t *argv);
+void argbuf_cleanup(struct argbuf *ab);
+
+#endif /* _ARGBUF_H_ */
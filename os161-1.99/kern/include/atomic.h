@@ -0,0 +1,26 @@
+#ifndef _ATOMIC_H_
+#define _ATOMIC_H_
+
+/*
+ * Atomic operations on memory words, for counters that are changed
+ * too often to be worth a lock. The guts are machine-dependent.
+ *
+ * atomic_add - add DELTA to *P; returns the new value.
+ * atomic_cas - if *P is OLD, set it to NEW. Returns the value *P had,
+ *              so the store happened if and only if that's OLD.
+ *
+ * These only make the update itself atomic. Anything that depends on
+ * the value staying put afterwards still needs a lock.
+ */
+
+#include <cdefs.h>
+
+/* Inlining support - for making sure an out-of-line copy gets built */
+#ifndef ATOMIC_INLINE
+#define ATOMIC_INLINE INLINE
+#endif
+
+/* Get the machine-dependent bits. */
+#include <machine/atomic.h>
+
+#endif /* _ATOMIC_H_ */
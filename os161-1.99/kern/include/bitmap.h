@@ -37,9 +37,21 @@
  *     bitmap_create  - allocate a new bitmap object.
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
+ *     bitmap_recount - recompute the free count after changing the raw
+ *                      bit data (e.g. reading it from disk).
+ *     bitmap_nfree   - return the number of cleared bits.
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *                      Successive calls carry on from where the last one
+ *                      left off (next fit), wrapping around at the end.
+ *     bitmap_alloc_near - same, but take the first clear bit at or after
+ *                      HINT (wrapping around to 0 if necessary).
+ *     bitmap_alloc_range - locate COUNT cleared bits in a row, at or
+ *                      after HINT if possible; set them all and return
+ *                      the index of the first.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
+ *     bitmap_mark_range - set COUNT clear bits starting at INDEX.
+ *     bitmap_unmark_range - clear COUNT set bits starting at INDEX.
  *     bitmap_isset   - return whether a particular bit is set or not.
  *     bitmap_destroy - destroy bitmap.
  */
@@ -49,9 +61,19 @@ struct bitmap;  /* Opaque. */
 
 struct bitmap *bitmap_create(unsigned nbits);
 void          *bitmap_getdata(struct bitmap *);
+void           bitmap_recount(struct bitmap *);
+unsigned       bitmap_nfree(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, unsigned *index);
+int            bitmap_alloc_near(struct bitmap *, unsigned hint,
+                                 unsigned *index);
+int            bitmap_alloc_range(struct bitmap *, unsigned hint,
+                                  unsigned count, unsigned *index);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
+void           bitmap_mark_range(struct bitmap *, unsigned index,
+                                 unsigned count);
+void           bitmap_unmark_range(struct bitmap *, unsigned index,
+                                   unsigned count);
 int            bitmap_isset(struct bitmap *, unsigned index);
 void           bitmap_destroy(struct bitmap *);
 
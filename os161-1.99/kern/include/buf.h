@@ -0,0 +1,89 @@
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * Holds recently used disk blocks in memory, keyed by (device, block
+ * number), so that filesystems don't go to the device for every
+ * block they look at. Blocks written through the cache are only
+ * marked dirty; they reach the disk when the filesystem syncs
+ * (buffer_sync) or when the buffer is reused for another block.
+ * buffer_sync and buffer_readrun move runs of consecutive blocks with
+ * one device request.
+ *
+ * A buffer handed out by buffer_read or buffer_get is pinned: it
+ * belongs to the caller until buffer_release, it will not be evicted
+ * or written back behind the caller's back, and anyone else asking
+ * for the same block waits. Don't pin the same block twice.
+ *
+ * Unpinned buffers are kept in LRU order; when the cache is full the
+ * least recently released one is reused (written back first if it's
+ * dirty).
+ *
+ * All blocks are BUFFER_SIZE bytes; the cache only handles devices
+ * with that block size.
+ *
+ * buffer_bootstrap   - set up; call once at boot.
+ * buffer_read        - pin block BLOCK of DEV, reading it if needed.
+ * buffer_get         - pin block BLOCK of DEV without reading it; for
+ *                      callers about to overwrite the whole block. If
+ *                      the block isn't cached its contents are garbage.
+ * buffer_map         - get a pointer to a pinned buffer's data.
+ * buffer_valid       - whether a pinned buffer holds the block's data;
+ *                      false only for a buffer_get of an uncached
+ *                      block that hasn't been filled in yet.
+ * buffer_mark_dirty  - note that a pinned buffer's data was changed.
+ * buffer_release     - unpin.
+ * buffer_drop        - forget block BLOCK of DEV without writing it
+ *                      back (for blocks the filesystem has freed).
+ * buffer_sync        - write back all dirty buffers of DEV.
+ * buffer_drop_all    - forget every buffer of DEV (for unmount; sync
+ *                      first).
+ * buffer_readrun     - get blocks BLOCK through BLOCK+COUNT-1 of DEV
+ *                      into the cache, reading consecutive uncached
+ *                      blocks with one device request. Best effort:
+ *                      doesn't wait for buffers, and doesn't pin
+ *                      anything, so follow with buffer_read.
+ * buffer_readahead   - start reading block BLOCK of DEV into the cache
+ *                      in the background, if it isn't there already.
+ *                      Doesn't wait; may be ignored if the read-ahead
+ *                      queue is full.
+ * buffer_drop_clean  - forget all clean, unpinned buffers (so that a
+ *                      benchmark can start cold).
+ * buffer_printstats  - print hit rate and write-back counts.
+ */
+
+#define BUFFER_SIZE 512
+
+/*
+ * Most blocks read or written with one device request. Callers of
+ * buffer_readrun should ask for no more than this at a time, so a
+ * long read doesn't push its own first blocks out of the cache
+ * before it gets to them.
+ */
+#define BUF_MAXRUN 16
+
+struct device;
+struct buf;
+
+void buffer_bootstrap(void);
+
+int buffer_read(struct device *dev, uint32_t block, struct buf **ret);
+int buffer_get(struct device *dev, uint32_t block, struct buf **ret);
+void *buffer_map(struct buf *b);
+bool buffer_valid(struct buf *b);
+void buffer_mark_dirty(struct buf *b);
+void buffer_release(struct buf *b);
+
+void buffer_drop(struct device *dev, uint32_t block);
+int buffer_sync(struct device *dev);
+void buffer_drop_all(struct device *dev);
+
+int buffer_readrun(struct device *dev, uint32_t block, unsigned count);
+void buffer_readahead(struct device *dev, uint32_t block);
+void buffer_drop_clean(void);
+
+void buffer_printstats(void);
+
+#endif /* _BUF_H_ */
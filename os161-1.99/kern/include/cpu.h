@@ -34,6 +34,7 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <cpustat.h>     /* for CPUSTAT_NSLOTS */
 
 
 /*
@@ -60,6 +61,7 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	uint32_t c_stats[CPUSTAT_NSLOTS]; /* Event counters (see cpustat.h) */
 
 	/*
 	 * Accessed by other cpus.
@@ -109,6 +111,13 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Number of cpus, and lookup by software cpu number. For code that
+ * needs to visit every cpu, such as summing per-cpu counters.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned number);
+
 /*
  * Return a string describing the CPU type.
  */
@@ -0,0 +1,67 @@
+#ifndef _CPUSTAT_H_
+#define _CPUSTAT_H_
+
+/*
+ * Per-cpu event counters.
+ *
+ * Every cpu carries an array of CPUSTAT_NSLOTS counters in struct cpu
+ * (c_stats). Incrementing a counter touches only the current cpu's
+ * slot, with interrupts briefly disabled on this cpu so the thread
+ * cannot be preempted (and possibly migrated) halfway through the
+ * read-modify-write. No lock is taken and no other cpu is involved,
+ * so counters are cheap enough to leave in hot paths.
+ *
+ * Reading a counter sums the slot across all cpus. The sum is not a
+ * snapshot: counts that happen concurrently with the read may or may
+ * not be included. That's fine for statistics.
+ *
+ * The slot space is carved into fixed ranges, one per subsystem.
+ * To add a counter, give it an index within its subsystem's range
+ * (and bump the range if needed).
+ */
+
+/* VM counters: VMSTAT_* from <uw-vmstats.h>, offset by CPUSTAT_VM_BASE */
+#define CPUSTAT_VM_BASE         0
+#define CPUSTAT_VM_MAX          16
+
+/* Scheduler counters */
+#define CPUSTAT_SCHED_BASE      (CPUSTAT_VM_BASE + CPUSTAT_VM_MAX)
+#define CPUSTAT_SCHED_SWITCH    (CPUSTAT_SCHED_BASE + 0) /* context switches */
+#define CPUSTAT_SCHED_IDLE      (CPUSTAT_SCHED_BASE + 1) /* calls to cpu_idle */
+#define CPUSTAT_SCHED_MIGRATE   (CPUSTAT_SCHED_BASE + 2) /* threads migrated */
+#define CPUSTAT_SCHED_MAX       16
+
+/* Filesystem counters */
+#define CPUSTAT_FS_BASE         (CPUSTAT_SCHED_BASE + CPUSTAT_SCHED_MAX)
+#define CPUSTAT_FS_BUFHIT       (CPUSTAT_FS_BASE + 0) /* buffer cache hits */
+#define CPUSTAT_FS_BUFMISS      (CPUSTAT_FS_BASE + 1) /* blocks read on demand */
+#define CPUSTAT_FS_BUFEVICT     (CPUSTAT_FS_BASE + 2) /* buffers reused */
+#define CPUSTAT_FS_BUFWRITE     (CPUSTAT_FS_BASE + 3) /* blocks written */
+#define CPUSTAT_FS_DCHIT        (CPUSTAT_FS_BASE + 4) /* name cache hits */
+#define CPUSTAT_FS_DCMISS       (CPUSTAT_FS_BASE + 5) /* name cache misses */
+#define CPUSTAT_FS_BUFRA        (CPUSTAT_FS_BASE + 6) /* blocks read ahead */
+#define CPUSTAT_FS_DEVREQ       (CPUSTAT_FS_BASE + 7) /* disk requests */
+#define CPUSTAT_FS_DEVMERGE     (CPUSTAT_FS_BASE + 8) /* ...merged into others */
+#define CPUSTAT_FS_DEVSEEK      (CPUSTAT_FS_BASE + 9) /* sectors sought over */
+#define CPUSTAT_FS_BUFPREFETCH  (CPUSTAT_FS_BASE + 10) /* blocks read early */
+#define CPUSTAT_FS_MAX          32
+
+#define CPUSTAT_NSLOTS          (CPUSTAT_FS_BASE + CPUSTAT_FS_MAX)
+
+/*
+ * cpustat_inc    - add one to counter SLOT on the current cpu.
+ * cpustat_add    - add N to counter SLOT on the current cpu.
+ * cpustat_read   - return the sum of counter SLOT over all cpus.
+ * cpustat_reset  - zero NUM counters starting at SLOT, on every cpu.
+ *                  Counts that race with the reset may survive it.
+ * cpustat_sched_print - print the scheduler counters.
+ *
+ * The increment functions may be called from interrupt handlers.
+ */
+void cpustat_inc(unsigned slot);
+void cpustat_add(unsigned slot, uint32_t n);
+uint32_t cpustat_read(unsigned slot);
+void cpustat_reset(unsigned slot, unsigned num);
+void cpustat_sched_print(void);
+
+#endif /* _CPUSTAT_H_ */
@@ -0,0 +1,50 @@
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+/*
+ * Directory name lookup cache.
+ *
+ * Remembers the results of looking up single names in directories,
+ * keyed by (directory vnode, name), so that looking up the same name
+ * again doesn't have to search the directory. Failed lookups are
+ * remembered too (negative entries, with a NULL vnode), so that
+ * repeatedly probing for a file that doesn't exist is also cheap.
+ *
+ * Filesystems consult the cache from their lookup code and must keep
+ * it up to date when they change a directory: after creating or
+ * linking a name, enter the new vnode under it; after removing a
+ * name, enter it as negative (or remove it). Names longer than
+ * DCACHE_NAMELEN are never cached.
+ *
+ * Each entry holds a reference on its directory and, if positive, on
+ * the vnode it names. Entries are recycled in LRU order, which drops
+ * those references; vfs_unmount drops a filesystem's entries first
+ * with dcache_purgefs so they don't keep it busy.
+ *
+ * The cache has its own lock, so these can be called from anywhere
+ * except with a spinlock held. A filesystem should update the cache
+ * for a directory while still holding whatever lock it changed the
+ * directory under, so that the cache never disagrees with it.
+ *
+ * dcache_lookup     - look up NAME in DIR. Returns true on a hit, with
+ *                     *RET set to the vnode (referenced) or to NULL for
+ *                     a negative entry; false if the cache doesn't know.
+ * dcache_enter      - record that NAME in DIR is VN (NULL if it doesn't
+ *                     exist), replacing any previous entry.
+ * dcache_remove     - forget NAME in DIR.
+ * dcache_purgefs    - forget every entry for directories on FS.
+ * dcache_printstats - print hit rate.
+ */
+
+#define DCACHE_NAMELEN 31
+
+struct vnode;
+struct fs;
+
+bool dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret);
+void dcache_enter(struct vnode *dir, const char *name, struct vnode *vn);
+void dcache_remove(struct vnode *dir, const char *name);
+void dcache_purgefs(struct fs *fs);
+void dcache_printstats(void);
+
+#endif /* _DCACHE_H_ */
@@ -0,0 +1,64 @@
+#ifndef _FILETABLE_H_
+#define _FILETABLE_H_
+
+/*
+ * Per-process open file table.
+ *
+ * A file descriptor indexes the process's filetable, which points to
+ * an openfile. The openfile is what open() creates: the vnode, the
+ * access mode, and the current offset. fork() gives the child the
+ * same openfiles as the parent (each gains a reference), so parent
+ * and child share offsets, as in Unix.
+ *
+ * Only the owning process uses its filetable, and processes have one
+ * thread, so the table itself needs no lock. An openfile may be
+ * shared between processes; of_lock protects its offset and refcount
+ * and is held across each read or write, so I/O through a shared
+ * descriptor is atomic with respect to the offset.
+ *
+ * Descriptors in use are kept in a bitmap, one bit per descriptor,
+ * so the lowest free descriptor is found with a find-first-set on at
+ * most OPEN_MAX/32 words.
+ */
+
+#include <limits.h>
+
+struct vnode;
+struct lock;
+
+struct openfile {
+	struct vnode *of_vnode;
+	int of_flags;			/* flags given to open */
+	off_t of_offset;
+	unsigned of_refcount;		/* descriptors referring to this */
+	struct lock *of_lock;
+};
+
+#define FILETABLE_WORDS  ((OPEN_MAX + 31) / 32)
+
+struct filetable {
+	struct openfile *ft_files[OPEN_MAX];
+	uint32_t ft_used[FILETABLE_WORDS];	/* bit set: fd in use */
+};
+
+/*
+ * filetable_create  - make an empty table.
+ * filetable_copy    - make a table sharing all of SRC's open files
+ *                     (for fork).
+ * filetable_destroy - close everything and free the table.
+ * filetable_opencons - open the console as descriptors 0, 1 and 2.
+ * filetable_open    - open PATH (which is consumed) and return the
+ *                     lowest free descriptor in *FD.
+ * filetable_get     - look up FD; EBADF if it isn't open.
+ * filetable_close   - close FD.
+ */
+struct filetable *filetable_create(void);
+int filetable_copy(struct filetable *src, struct filetable **ret);
+void filetable_destroy(struct filetable *ft);
+int filetable_opencons(struct filetable *ft);
+int filetable_open(struct filetable *ft, char *path, int flags, mode_t mode,
+		   int *fd);
+int filetable_get(struct filetable *ft, int fd, struct openfile **ret);
+int filetable_close(struct filetable *ft, int fd);
+
+#endif /* _FILETABLE_H_ */
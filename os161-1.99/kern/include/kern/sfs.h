@@ -64,6 +64,9 @@
 #define SFS_TYPE_FILE     1
 #define SFS_TYPE_DIR      2
 
+/* Flags for sfi_flags */
+#define SFS_IF_HASHDIR    0x1     /* directory uses the hashed layout */
+
 /*
  * On-disk superblock
  */
@@ -83,7 +86,10 @@ struct sfs_inode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_flags;			/* SFS_IF_* above */
+	uint32_t sfi_waste[128-6-SFS_NDIRECT];	/* unused space, set to 0 */
 };
 
 /*
@@ -94,5 +100,29 @@ struct sfs_dir {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * Hashed directories.
+ *
+ * A directory is normally a plain array of struct sfs_dir. One with
+ * SFS_IF_HASHDIR set in its inode is instead made of sfs_dirblocks:
+ * file blocks 0 through SFS_DIRHASH_NBUCKETS-1 are the first blocks of
+ * the hash buckets, and any further blocks are overflow blocks, each
+ * chained from the previous block of its bucket by sdb_next (0 ends
+ * the chain). The directory's size always covers all the buckets;
+ * buckets that have never been written are holes and read as empty.
+ *
+ * A name goes in bucket FNV-1a(name) % SFS_DIRHASH_NBUCKETS, where
+ * FNV-1a is the 32-bit hash: start with 2166136261, and for each byte
+ * of the name XOR it in and multiply by 16777619.
+ */
+#define SFS_DIRHASH_NBUCKETS  1024
+#define SFS_DIRBLK_NENTRIES   7   /* entries per block, after the header */
+
+struct sfs_dirblock {
+	uint32_t sdb_next;			/* Next block in bucket, or 0 */
+	uint32_t sdb_reserved[15];		/* Set to 0 */
+	struct sfs_dir sdb_entries[SFS_DIRBLK_NENTRIES];
+};
+
 
 #endif /* _KERN_SFS_H_ */
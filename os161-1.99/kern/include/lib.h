@@ -177,6 +177,16 @@ void beep(void);
  * during boot once malloc is available and before any additional
  * threads are created.
  */
+/*
+ * Kernel log (see kprintf.c). Once started, kprintf queues messages
+ * on a per-cpu ring and a thread copies them to the console.
+ *
+ * klog_bootstrap starts it; call once all cpus are running.
+ * klog_flush waits until everything logged has been printed.
+ * klog_stop flushes and goes back to printing synchronously.
+ * klog_dump prints the recent history with timestamps ("dmesg").
+ * klog_tick is called by hardclock.
+ */
 int kprintf(const char *format, ...) __PF(1,2);
 void panic(const char *format, ...) __PF(1,2);
 void badassert(const char *expr, const char *file, int line, const char *func);
@@ -184,6 +194,11 @@ void badassert(const char *expr, const char *file, int line, const char *func);
 void kgets(char *buf, size_t maxbuflen);
 
 void kprintf_bootstrap(void);
+void klog_bootstrap(void);
+void klog_flush(void);
+void klog_stop(void);
+void klog_dump(void);
+void klog_tick(void);
 
 /*
  * Other miscellaneous stuff
@@ -43,10 +43,24 @@
 
 struct addrspace;
 struct vnode;
+struct wchan;
+struct filetable;
 #ifdef UW
 struct semaphore;
 #endif // UW
 
+#if OPT_A2
+/*
+ * List of processes, linked through p_listprev/p_listnext. A process
+ * can be on at most one list at a time.
+ */
+struct proclist {
+	struct proc *pl_head;
+	struct proc *pl_tail;
+	unsigned pl_count;
+};
+#endif
+
 /*
  * Process structure.
  */
@@ -62,7 +76,9 @@ struct proc {
 	struct vnode *p_cwd;		/* current working directory */
 
 
-#ifdef UW
+#if OPT_A2
+	struct filetable *p_filetable;	/* open files (see filetable.h) */
+#elif defined(UW)
   /* a vnode to refer to the console device */
   /* this is a quick-and-dirty way to get console writes working */
   /* you will probably need to change this when implementing file-related
@@ -74,13 +90,20 @@ struct proc {
 	/* add more material here as needed */
 #if OPT_A2
 	pid_t pid;
-	struct proc *parent;
-	struct array *children;
+
+	/*
+	 * Family fields, protected by the process tree lock in proc.c.
+	 * A process that has exited but not been waited for keeps only
+	 * these and its pid; everything else is released at exit.
+	 */
+	struct proc *parent;		/* NULL if none or orphaned */
+	struct proclist children;	/* Children still running */
+	struct proclist p_exited;	/* Exited children, in exit order */
+	struct proc *p_listprev;	/* Link on one of parent's lists */
+	struct proc *p_listnext;
+	struct wchan *p_wchan;		/* Where we wait for children */
 	bool terminated;
-	struct lock *children_lk;
-	struct cv *p_cv;
 	int exit_code;
-
 #endif
 };
 
@@ -95,6 +118,11 @@ extern struct semaphore *no_proc_sem;
 /* Call once during system startup to allocate data structures. */
 void proc_bootstrap(void);
 
+#ifdef UW
+/* Wait until there are no user processes (for the kernel menu). */
+void proc_wait_noprocs(void);
+#endif // UW
+
 /* Create a fresh process for use by runprogram(). */
 struct proc *proc_create_runprogram(const char *name);
 
@@ -113,10 +141,32 @@ struct addrspace *curproc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *curproc_setas(struct addrspace *);
 
+#if OPT_A2
+/* Link CHILD under PARENT, or undo that (only if CHILD never ran). */
+void proc_addchild(struct proc *parent, struct proc *child);
+void proc_remchild(struct proc *parent, struct proc *child);
 
-#endif /* _PROC_H_ */
+/*
+ * Exit: called by the last thread of PROC, after detaching itself.
+ * Orphans PROC's children, frees its exited ones, and either leaves
+ * PROC for its parent to wait for or destroys it.
+ */
+void proc_exit(struct proc *proc, int exitcode);
 
-#if OPT_A2
+/*
+ * Wait for PARENT's child PID (or any child, if PID is WAIT_ANY) to
+ * exit, reap it, and return its pid and exit code. With WNOHANG in
+ * OPTIONS, return pid 0 instead of sleeping.
+ */
+int proc_wait(struct proc *parent, pid_t pid, int options,
+	      pid_t *retpid, int *exitcode);
 
+/* Find a process by pid in O(1). Not refcounted; see proc.c. */
+struct proc *proc_lookup(pid_t pid);
 
+/* Find PARENT's child with pid PID; ESRCH if none, ECHILD if not a child. */
+int proc_findchild(struct proc *parent, pid_t pid, struct proc **ret);
 #endif
+
+
+#endif /* _PROC_H_ */
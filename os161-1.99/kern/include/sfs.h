@@ -41,6 +41,9 @@
  */
 #include <fs.h>
 #include <vnode.h>
+#include <spinlock.h>
+
+struct lock;
 
 /*
  * Get on-disk structures and constants that are made available to 
@@ -52,17 +55,94 @@ struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
+	struct lock *sv_lock;           /* protects sv_i and what follows */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct sfs_vnode *sv_dirtynext; /* dirty vnode list */
+	struct sfs_vnode **sv_dirtyprev; /* link pointing to us */
+	struct sfs_vnode *sv_hashnext;  /* vnode table chain */
+	struct sfs_vnode **sv_hashprev; /* link pointing to us */
+	uint32_t sv_ranext;             /* where a sequential read starts */
+	uint32_t sv_rawin;              /* read-ahead window, in blocks */
+	uint32_t sv_raend;              /* read ahead up to here */
+	uint32_t sv_bmleaf;             /* last indirect block of pointers
+					   to data blocks used by bmap */
+	uint32_t sv_bmleafstart;        /* first file block it maps */
+	uint32_t sv_lastalloc;          /* last block allocated to us */
+	uint32_t sv_resv;               /* next block of our reservation */
+	uint32_t sv_nresv;              /* blocks left in the reservation */
+	unsigned sv_resvgen;            /* sfs_resvgen when it was made */
 };
 
+/*
+ * Read-ahead window limits, in blocks. The window opens at
+ * SFS_RAMIN on the first sequential read and doubles on each
+ * following one up to SFS_RAMAX; a non-sequential read closes it.
+ */
+#define SFS_RAMIN 4
+#define SFS_RAMAX 32
+
+/*
+ * When a file can't keep growing into the block after its last one,
+ * it gets a fresh run of SFS_CLUSTER free blocks, reserved for it, to
+ * grow into next.
+ *
+ * Reserved blocks are marked in sfs_freemap, so nothing else gets
+ * them, and also in sfs_resvmap, so the copy of the freemap written
+ * to disk shows them free. If the disk fills up, the allocator takes
+ * every reservation back at once by bumping sfs_resvgen; a
+ * reservation made under an older sfs_resvgen is void.
+ */
+#define SFS_CLUSTER 8
+
+/*
+ * A flat directory is switched over to the hashed layout (see
+ * kern/sfs.h) when a name is added to it and it already has this many
+ * slots.
+ */
+#define SFS_DIRHASH_MIN 64
+
+/*
+ * Table of loaded vnodes, hashed on inode number. The chains are
+ * doubly linked so reclaim can unhook a vnode without searching.
+ */
+#define SFS_VNHASHSIZE 256
+
+#define SFS_VNHASH(ino) ((ino) % SFS_VNHASHSIZE)
+
+/*
+ * Locking. Each vnode's sv_lock covers its inode, its bmap and
+ * read-ahead state, and its reservation; for a directory it also
+ * covers the directory's contents. sfs_vnlock covers the vnode table
+ * and is held across sfs_loadvnode and sfs_reclaim, so a vnode can't
+ * be found while it's being thrown away. sfs_freemaplock covers the
+ * freemap, the reservation map, and the superblock. sfs_dirtylock,
+ * a spinlock, covers the dirty vnode list.
+ *
+ * Order: a directory's sv_lock, then a file's sv_lock, then
+ * sfs_vnlock, then sfs_freemaplock. Nobody may hold a vnode's
+ * sv_lock without holding a reference to it, so reclaim, which only
+ * runs on vnodes nobody else references, doesn't need it.
+ */
+
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* protects the vnode table */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASHSIZE]; /* loaded vnodes */
+	unsigned sfs_nvnodes;           /* number of loaded vnodes */
+	struct spinlock sfs_dirtylock;  /* protects the dirty list */
+	struct sfs_vnode *sfs_dirtyvnodes; /* vnodes with sv_dirty set */
+	struct sfs_vnode **sfs_dirtytail; /* end of the dirty list */
+	unsigned sfs_ndirty;            /* length of the dirty list */
+	struct lock *sfs_freemaplock;   /* protects freemap and superblock */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	bool *sfs_mapdirty;             /* freemap blocks to write back */
+	struct bitmap *sfs_resvmap;     /* reserved blocks are marked 1 */
+	unsigned sfs_nresv;             /* number of reserved blocks */
+	unsigned sfs_resvgen;           /* reservation generation */
 };
 
 /*
@@ -75,17 +155,30 @@ int sfs_mount(const char *device);
  * Internal functions
  */
 
-/* Initialize uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
-
-/* Convenience functions for block I/O */
-int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
+/*
+ * Convenience functions for block I/O, through the buffer cache.
+ * Writes are only written back by sfs_sync/sfs_fsync (or eviction).
+ */
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
+/*
+ * Write a vnode's inode back (to the buffer cache) if it's dirty.
+ * Call with the vnode's sv_lock held.
+ */
+int sfs_sync_inode(struct sfs_vnode *sv);
+
+/*
+ * Write the freemap back (to the buffer cache) if it's dirty. Takes
+ * sfs_freemaplock.
+ */
+int sfs_sync_freemap(struct sfs_fs *sfs);
+
+/* Bucket NAME goes in, in a hashed directory (also used by fs6) */
+uint32_t sfs_dirhash(const char *name);
+
 
 #endif /* _SFS_H_ */
@@ -34,6 +34,8 @@
 
 
 struct trapframe; /* from <machine/trapframe.h> */
+struct proc;      /* from <proc.h> */
+struct argbuf;    /* from <argbuf.h> */
 
 /*
  * The system call dispatcher.
@@ -71,6 +73,23 @@ int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 #if OPT_A2
 int sys_fork(pid_t *retval, struct trapframe *tf);
 int sys_execv(const char *program, char **args);
+int sys_open(userptr_t path, int flags, mode_t mode, int *retval);
+int sys_read(int fdesc, userptr_t ubuf, unsigned int nbytes, int *retval);
+int sys_close(int fdesc);
+int sys_lseek(int fdesc, off_t pos, int whence, off_t *retval);
+int sys_pread(int fdesc, userptr_t ubuf, unsigned int nbytes, off_t pos,
+              int *retval);
+int sys_pwrite(int fdesc, userptr_t ubuf, unsigned int nbytes, off_t pos,
+               int *retval);
+int sys_readv(int fdesc, const_userptr_t iov, int iovcnt, int *retval);
+int sys_writev(int fdesc, const_userptr_t iov, int iovcnt, int *retval);
+int sys_preadv(int fdesc, const_userptr_t iov, int iovcnt, off_t pos,
+               int *retval);
+int sys_pwritev(int fdesc, const_userptr_t iov, int iovcnt, off_t pos,
+                int *retval);
+int sys_spawn(const_userptr_t progname, const_userptr_t args, pid_t *retval);
+int proc_spawn(struct proc *parent, char *progname, struct argbuf *ab,
+               pid_t *retpid);
 #endif
 
 #endif /* _SYSCALL_H_ */
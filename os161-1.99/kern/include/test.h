@@ -75,16 +75,23 @@ int readstress(int, char **);
 int writestress(int, char **);
 int writestress2(int, char **);
 int createstress(int, char **);
+int dirhashtest(int, char **);
 int printfile(int, char **);
 
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
 int nettest(int, char **);
+#if OPT_A2
+int launchbench(int, char **);
+#endif
 
 /* Routine for running a user-level program. */
 #if OPT_A2
 int runprogram(char *progname, char **args, int nargs);
+struct argbuf;
+int runprogram_load(char *progname, struct argbuf *ab,
+		    vaddr_t *entrypoint, vaddr_t *stackptr, userptr_t *argv);
 #else 
 int runprogram(char *progname);
 #endif
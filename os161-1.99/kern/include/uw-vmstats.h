@@ -9,15 +9,10 @@
 /* Virtual memory stats */
 /* Tracks stats on user programs */
 
-/* NOTE !!!!!! WARNING !!!!!
- * All of the functions (except vmstats_print) whose names begin with '_'
- * assume that atomicity is ensured elsewhere
- * (i.e., outside of these routines) by acquiring stats_lock.
- * All of the functions whose names do not begin
- * with '_' ensure atomicity locally (except vmstats_print).
- *
- * Generally you will use the functions whose names
- * do not begin with '_'.
+/* The counters live in the per-cpu counter slots (see cpustat.h), so
+ * incrementing never takes a lock and never touches another cpu's data.
+ * The functions whose names begin with '_' are kept for compatibility
+ * and are now identical to the ones without.
  */
 
 
@@ -37,22 +32,24 @@
 #define VMSTAT_SWAP_FILE_READ         (8)
 #define VMSTAT_SWAP_FILE_WRITE        (9)
 #define VMSTAT_COUNT                 (10)
+/* VMSTAT_COUNT must not exceed CPUSTAT_VM_MAX */
 
 /* ----------------------------------------------------------------------- */
 
 /* Initialize the statistics: must be called before using */
-void vmstats_init(void);                     /* uses locking */
-void _vmstats_init(void);                    /* atomicity must be ensured elsewhere */
+void vmstats_init(void);
+void _vmstats_init(void);
 
 /* Increment the specified count 
  * Example use: 
  *   vmstats_inc(VMSTAT_TLB_FAULT);
  *   vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
  */
-void vmstats_inc(unsigned int index);    /* uses locking */
-void _vmstats_inc(unsigned int index);   /* atomicity must be ensured elsewhere */
+void vmstats_inc(unsigned int index);    /* lock-free, per-cpu */
+void _vmstats_inc(unsigned int index);
 
-/* Print the statistics: assumes that at least vmstats_init has been called */
-void vmstats_print(void);                    /* Does NOT use locking */
+/* Print the statistics (summed over all cpus): assumes that at least
+ * vmstats_init has been called */
+void vmstats_print(void);
 
 #endif /* VM_STATS_H */
@@ -54,7 +54,8 @@ struct vnode;  /* abstract structure for an on-disk file (vnode.h) */
  *    vfs_setcurdir - change current directory of current thread by vnode
  *    vfs_clearcurdir - change current directory of current thread to "none"
  *    vfs_getcurdir - retrieve vnode of current directory of current thread
- *    vfs_sync      - force all dirty buffers to disk
+ *    vfs_sync      - force all dirty buffers to disk (also done every
+ *                    VFS_SYNCINTERVAL seconds by a background thread)
  *    vfs_getroot   - get root vnode for the filesystem named DEVNAME
  *    vfs_getdevname - get mounted device name for the filesystem passed in
  */
@@ -63,9 +64,12 @@ int vfs_setcurdir(struct vnode *dir);
 int vfs_clearcurdir(void);
 int vfs_getcurdir(struct vnode **retdir);
 int vfs_sync(void);
-int vfs_getroot(const char *devname, struct vnode **result);
+int vfs_getroot(const char *devname, struct vnode **ret);
 const char *vfs_getdevname(struct fs *fs);
 
+/* Seconds between background syncs (see vfs_sync). */
+#define VFS_SYNCINTERVAL 5
+
 /*
  * VFS layer mid-level operations.
  *
@@ -184,13 +188,5 @@ int vfs_unmountall(void);
 DECLARRAY(vnode);
 DEFARRAY(vnode, VFSINLINE);
 
-/*
- * Global one-big-lock for all filesystem operations.
- * You must remove this for the filesystem assignment.
- */
-void vfs_biglock_acquire(void);
-void vfs_biglock_release(void);
-bool vfs_biglock_do_i_hold(void);
-
 
 #endif /* _VFS_H_ */
@@ -55,6 +55,39 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * Physical page reference counts. A single-page allocation starts
+ * with one reference; coremap_incref adds one and free_kpages drops
+ * one, freeing the page when none are left.
+ */
+void coremap_incref(paddr_t paddr);
+unsigned coremap_refcount(paddr_t paddr);
+
+/*
+ * Text page cache (vm/textcache.c): read-only code pages shared by
+ * every process running the same executable.
+ *
+ * textcache_getpage  - get the page of vnode V starting at file offset
+ *                      OFFSET, filled from the file range [LO, HI) and
+ *                      zero elsewhere; the caller gets a reference.
+ * textcache_invalidate - forget V's pages; called (via vnode_modified)
+ *                      when V is written or truncated. Processes
+ *                      already running keep the old contents.
+ * textcache_purgefs  - forget the pages of every file on FS, dropping
+ *                      the cache's references to them; called by
+ *                      vfs_unmount so they don't keep FS busy.
+ * textcache_reclaim  - release pages that no process maps, returning
+ *                      how many were freed. Called by the VM system
+ *                      when it runs out of memory; does not sleep.
+ */
+struct vnode;
+struct fs;
+int textcache_getpage(struct vnode *v, off_t offset, off_t lo, off_t hi,
+		      paddr_t *ret);
+void textcache_invalidate(struct vnode *v);
+void textcache_purgefs(struct fs *fs);
+unsigned textcache_reclaim(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
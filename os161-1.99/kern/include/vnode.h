@@ -50,10 +50,17 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * Both counts are updated with atomic operations, so taking and
+ * dropping references doesn't take any lock. Only dropping the last
+ * reference involves the filesystem (see vnode_lastref).
+ *
+ * vn_modgen counts calls to vnode_modified; see there.
  */
 struct vnode {
-	int vn_refcount;                /* Reference count */
-	int vn_opencount;
+	volatile int vn_refcount;       /* Reference count */
+	volatile int vn_opencount;
+	volatile int vn_modgen;         /* Modification generation */
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
@@ -283,6 +290,17 @@ void vnode_decref(struct vnode *);
 #define VOP_INCREF(vn) 			vnode_incref(vn)
 #define VOP_DECREF(vn) 			vnode_decref(vn)
 
+/*
+ * For VOP_RECLAIM. VOP_DECREF calls VOP_RECLAIM without dropping the
+ * last reference, and someone may have picked the vnode up again
+ * before the filesystem got to it. With the lock held that keeps the
+ * filesystem from handing out new references to the vnode, call
+ * this: it returns true if the caller's reference is the only one,
+ * and otherwise drops it and returns false, in which case reclaim
+ * should return EBUSY.
+ */
+bool vnode_lastref(struct vnode *);
+
 /*
  * Open count manipulation (handled above filesystem level)
  *
@@ -312,5 +330,20 @@ void vnode_cleanup(struct vnode *);
 
 #define VOP_CLEANUP(vn)			vnode_cleanup(vn)
 
+/*
+ * Tell the caches of file contents kept above the filesystem (text
+ * pages, exec headers) that the file has been written or truncated.
+ * Called by filesystems at the end of VOP_WRITE and VOP_TRUNCATE,
+ * whether or not they succeeded, so that nothing cached while the
+ * file was changing survives. (Not at the start: a program started
+ * during the write could cache the old contents again.)
+ *
+ * It also bumps vn_modgen. A cache that reads the file without its
+ * lock held samples vn_modgen first, and doesn't keep what it read if
+ * vn_modgen has moved by the time it goes to insert it, since the
+ * invalidation may already have come and gone.
+ */
+void vnode_modified(struct vnode *);
+
 
 #endif /* _VNODE_H_ */
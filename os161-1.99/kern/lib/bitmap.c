@@ -49,9 +49,44 @@
 
 struct bitmap {
         unsigned nbits;
+        unsigned nfree;         /* number of clear bits */
+        unsigned hint;          /* where bitmap_alloc starts looking */
         WORD_TYPE *v;
 };
 
+/*
+ * Larger unit for skipping runs of all-set or all-clear bits with one
+ * comparison, and for counting bits. Neither depends on byte order,
+ * so this is safe even though the bits are stored a byte at a time.
+ * (The data comes from kmalloc, so it's suitably aligned.)
+ */
+#define CHUNK_TYPE      uint32_t
+#define CHUNK_BITS      (sizeof(CHUNK_TYPE) * CHAR_BIT)
+#define CHUNK_ALLBITS   (0xffffffff)
+
+/*
+ * Count the set bits in a chunk, without a loop.
+ */
+static
+unsigned
+bitmap_popcount(CHUNK_TYPE c)
+{
+        c = c - ((c >> 1) & 0x55555555);
+        c = (c & 0x33333333) + ((c >> 2) & 0x33333333);
+        c = (c + (c >> 4)) & 0x0f0f0f0f;
+        return (c * 0x01010101) >> 24;
+}
+
+static
+inline
+void
+bitmap_translate(unsigned bitno, unsigned *ix, WORD_TYPE *mask)
+{
+        unsigned offset;
+        *ix = bitno / BITS_PER_WORD;
+        offset = bitno % BITS_PER_WORD;
+        *mask = ((WORD_TYPE)1) << offset;
+}
 
 struct bitmap *
 bitmap_create(unsigned nbits)
@@ -72,6 +107,8 @@ bitmap_create(unsigned nbits)
 
         bzero(b->v, words*sizeof(WORD_TYPE));
         b->nbits = nbits;
+        b->nfree = nbits;
+        b->hint = 0;
 
         /* Mark any leftover bits at the end in use */
         if (words > nbits / BITS_PER_WORD) {
@@ -95,40 +132,231 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+void
+bitmap_recount(struct bitmap *b)
+{
+        unsigned words = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        unsigned nchunks = words / sizeof(CHUNK_TYPE);
+        unsigned i, set = 0;
+        WORD_TYPE w;
+
+        for (i=0; i<nchunks; i++) {
+                set += bitmap_popcount(((CHUNK_TYPE *)b->v)[i]);
+        }
+        for (i=nchunks*sizeof(CHUNK_TYPE); i<words; i++) {
+                w = b->v[i];
+                set += bitmap_popcount(w);
+        }
+
+        /* the leftover bits at the end are always set */
+        set -= words*BITS_PER_WORD - b->nbits;
+        KASSERT(set <= b->nbits);
+        b->nfree = b->nbits - set;
+}
+
+unsigned
+bitmap_nfree(struct bitmap *b)
+{
+        return b->nfree;
+}
+
+/*
+ * Find the first clear (or, if ONES, set) bit in [START, END). Whole
+ * chunks that can't contain one are skipped with one comparison, so
+ * only the byte holding the bit has to be searched a bit at a time.
+ */
+static
 int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+bitmap_findbit(struct bitmap *b, unsigned start, unsigned end, bool ones,
+               unsigned *index)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        CHUNK_TYPE skip = ones ? 0 : CHUNK_ALLBITS;
+        unsigned pos = start;
+        unsigned ix, bit;
+        unsigned w;
+
+        KASSERT(end <= b->nbits);
+
+        while (pos < end) {
+                if (pos % CHUNK_BITS == 0 && pos + CHUNK_BITS <= end &&
+                    ((CHUNK_TYPE *)b->v)[pos / CHUNK_BITS] == skip) {
+                        pos += CHUNK_BITS;
+                        continue;
+                }
+                ix = pos / BITS_PER_WORD;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
+                /* look for set bits, ignoring the ones before POS */
+                w = b->v[ix];
+                if (!ones) {
+                        w = ~w & WORD_ALLBITS;
+                }
+                w &= WORD_ALLBITS << (pos % BITS_PER_WORD);
+
+                if (w != 0) {
+                        bit = ix*BITS_PER_WORD;
+                        while ((w & 1) == 0) {
+                                w >>= 1;
+                                bit++;
+                        }
+                        if (bit >= end) {
+                                break;
                         }
-                        KASSERT(0);
+                        *index = bit;
+                        return 0;
+                }
+                pos = (ix+1)*BITS_PER_WORD;
+        }
+        return ENOSPC;
+}
+
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        int result;
+
+        result = bitmap_alloc_near(b, b->hint, index);
+        if (result) {
+                return result;
+        }
+        KASSERT(*index < b->nbits);
+
+        /* next fit: carry on from here next time */
+        b->hint = *index + 1;
+        return 0;
+}
+
+int
+bitmap_alloc_near(struct bitmap *b, unsigned hint, unsigned *index)
+{
+        int result;
+
+        if (b->nfree == 0) {
+                return ENOSPC;
+        }
+        if (hint >= b->nbits) {
+                hint = 0;
+        }
+        result = bitmap_findbit(b, hint, b->nbits, false, index);
+        if (result) {
+                result = bitmap_findbit(b, 0, hint, false, index);
+        }
+        /* nfree says there's a clear bit somewhere */
+        KASSERT(result == 0);
+        bitmap_mark(b, *index);
+        return 0;
+}
+
+/*
+ * Look for COUNT clear bits in a row in [START, END). Each candidate
+ * run is measured by looking for the next set bit, so runs of set and
+ * clear bits alike are crossed a chunk at a time.
+ */
+static
+int
+bitmap_findrun(struct bitmap *b, unsigned start, unsigned end,
+               unsigned count, unsigned *index)
+{
+        unsigned pos, next;
+
+        pos = start;
+        while (bitmap_findbit(b, pos, end, false, &pos) == 0) {
+                if (pos + count > end) {
+                        break;
                 }
+                if (bitmap_findbit(b, pos, pos + count, true, &next)) {
+                        *index = pos;
+                        return 0;
+                }
+                pos = next + 1;
         }
         return ENOSPC;
 }
 
+/*
+ * Set or clear COUNT bits starting at INDEX, which must all be the
+ * other way; whole bytes are done at once.
+ */
 static
-inline
 void
-bitmap_translate(unsigned bitno, unsigned *ix, WORD_TYPE *mask)
+bitmap_setrange(struct bitmap *b, unsigned index, unsigned count, bool set)
 {
-        unsigned offset;
-        *ix = bitno / BITS_PER_WORD;
-        offset = bitno % BITS_PER_WORD;
-        *mask = ((WORD_TYPE)1) << offset;
+        unsigned end = index + count;
+        unsigned ix;
+        WORD_TYPE mask;
+
+        KASSERT(end <= b->nbits && end >= index);
+
+        while (index < end) {
+                if (index % BITS_PER_WORD == 0 &&
+                    index + BITS_PER_WORD <= end) {
+                        ix = index / BITS_PER_WORD;
+                        mask = WORD_ALLBITS;
+                        index += BITS_PER_WORD;
+                }
+                else {
+                        bitmap_translate(index, &ix, &mask);
+                        index++;
+                }
+
+                if (set) {
+                        KASSERT((b->v[ix] & mask)==0);
+                        b->v[ix] |= mask;
+                }
+                else {
+                        KASSERT((b->v[ix] & mask)==mask);
+                        b->v[ix] &= ~mask;
+                }
+        }
+
+        if (set) {
+                b->nfree -= count;
+        }
+        else {
+                b->nfree += count;
+        }
+}
+
+int
+bitmap_alloc_range(struct bitmap *b, unsigned hint, unsigned count,
+                   unsigned *index)
+{
+        unsigned wrapend;
+        int result;
+
+        KASSERT(count > 0);
+
+        if (b->nfree < count) {
+                return ENOSPC;
+        }
+        if (hint >= b->nbits) {
+                hint = 0;
+        }
+        result = bitmap_findrun(b, hint, b->nbits, count, index);
+        if (result) {
+                /* let the second pass run up to COUNT-1 bits past HINT */
+                wrapend = hint + count - 1;
+                if (wrapend > b->nbits) {
+                        wrapend = b->nbits;
+                }
+                result = bitmap_findrun(b, 0, wrapend, count, index);
+        }
+        if (result) {
+                return result;
+        }
+        bitmap_setrange(b, *index, count, true);
+        return 0;
+}
+
+void
+bitmap_mark_range(struct bitmap *b, unsigned index, unsigned count)
+{
+        bitmap_setrange(b, index, count, true);
+}
+
+void
+bitmap_unmark_range(struct bitmap *b, unsigned index, unsigned count)
+{
+        bitmap_setrange(b, index, count, false);
 }
 
 void
@@ -142,6 +370,7 @@ bitmap_mark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)==0);
         b->v[ix] |= mask;
+        b->nfree--;
 }
 
 void
@@ -155,6 +384,7 @@ bitmap_unmark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)!=0);
         b->v[ix] &= ~mask;
+        b->nfree++;
 }
 
 
@@ -36,6 +36,8 @@
 #include <current.h>
 #include <synch.h>
 #include <mainbus.h>
+#include <cpu.h>
+#include <clock.h>
 #include <vfs.h>          // for vfs_sync()
 
 
@@ -87,6 +89,486 @@ console_send(void *junk, const char *data, size_t len)
 	}
 }
 
+/*
+ * Kernel log.
+ *
+ * Once klog_bootstrap has run, kprintf doesn't drive the console
+ * itself. Each cpu has a ring that only it writes; kprintf formats
+ * the message straight into the current cpu's ring, stamps it with
+ * the time, and returns. Interrupts are off on this cpu while it
+ * does so, so nothing else can write the ring, and no lock shared
+ * with other cpus is taken, so logging cpus don't serialize on each
+ * other or on the serial line.
+ *
+ * A flusher thread copies the messages out, oldest first across all
+ * cpus, to the console and to a history buffer that the "dmesg" menu
+ * command prints. If a message doesn't fit in its ring it's thrown
+ * away and counted rather than waiting for the flusher.
+ *
+ * Ring positions are free-running byte counts: the owning cpu is the
+ * only writer of kr_head and the flusher the only writer of kr_tail.
+ * A message is visible to the flusher once kr_head moves past it.
+ * System/161 cpus see each other's memory writes in program order
+ * (the spinlock code relies on this too), so keeping the compiler
+ * from reordering around the head and tail updates is enough.
+ *
+ * Waking the flusher means V on a semaphore, which can't be done
+ * while holding a spinlock. Messages logged with interrupts off get
+ * the flusher woken at the next hardclock on their cpu instead.
+ *
+ * The console is driven directly again, as before, while panicking
+ * and after klog_stop (at shutdown).
+ */
+
+#define KLOG_RINGSIZE   4096	/* bytes per cpu; a power of 2 */
+#define KLOG_HISTSIZE   16384	/* bytes of history; a power of 2 */
+
+#define klog_barrier()  __asm volatile("" ::: "memory")
+
+struct klog_hdr {
+	uint32_t kh_len;		/* bytes of text following */
+	uint32_t kh_secs;		/* timestamp */
+	uint32_t kh_nsecs;
+	uint32_t kh_cpu;
+};
+
+/* Size of the record with LEN bytes of text, keeping records aligned. */
+#define KLOG_RECSIZE(len) \
+	(sizeof(struct klog_hdr) + (((len) + 3) & ~(uint32_t)3))
+
+struct klog_ring {
+	char kr_buf[KLOG_RINGSIZE];
+	volatile uint32_t kr_head;	/* end of published messages */
+	volatile uint32_t kr_tail;	/* start of unflushed messages */
+	volatile uint32_t kr_dropped;	/* messages that didn't fit */
+	uint32_t kr_dropped_seen;	/* drops already reported */
+	bool kr_needkick;		/* flusher not yet woken */
+	/* message being written */
+	uint32_t kr_wpos;
+	uint32_t kr_wlen;
+	bool kr_wfull;
+};
+
+static struct klog_ring **klog_rings;	/* indexed by cpu number */
+static unsigned klog_nrings;
+static volatile bool klog_running;
+static struct semaphore *klog_sem;	/* wakes the flusher */
+static struct lock *klog_waitlock;	/* for klog_flush */
+static struct cv *klog_waitcv;
+
+/* Messages already flushed, for dmesg. Protected by kprintf_lock. */
+static char klog_hist[KLOG_HISTSIZE];
+static uint32_t klog_hist_head, klog_hist_tail;
+
+static
+void
+klog_copyin(char *ring, uint32_t size, uint32_t pos,
+	    const void *data, size_t len)
+{
+	const char *d = data;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		ring[(pos + i) & (size - 1)] = d[i];
+	}
+}
+
+static
+void
+klog_copyout(const char *ring, uint32_t size, uint32_t pos,
+	     void *data, size_t len)
+{
+	char *d = data;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		d[i] = ring[(pos + i) & (size - 1)];
+	}
+}
+
+/*
+ * Backend for __printf when logging: append to the message being
+ * written, or mark it lost if the ring is full.
+ */
+static
+void
+klog_send(void *vkr, const char *data, size_t len)
+{
+	struct klog_ring *kr = vkr;
+
+	if (kr->kr_wfull) {
+		return;
+	}
+	if (kr->kr_wpos + len - kr->kr_tail > KLOG_RINGSIZE) {
+		kr->kr_wfull = true;
+		return;
+	}
+	klog_copyin(kr->kr_buf, KLOG_RINGSIZE, kr->kr_wpos, data, len);
+	kr->kr_wpos += len;
+	kr->kr_wlen += len;
+}
+
+/*
+ * Log a message on the current cpu's ring.
+ */
+static
+int
+klog_vprintf(const char *fmt, va_list ap)
+{
+	struct klog_ring *kr;
+	struct klog_hdr kh;
+	uint32_t start, end;
+	time_t secs;
+	bool cankick, kick;
+	int chars, spl;
+
+	cankick = curthread->t_iplhigh_count == 0;
+	kick = false;
+
+	spl = splhigh();
+	KASSERT(curcpu->c_number < klog_nrings);
+	kr = klog_rings[curcpu->c_number];
+
+	start = kr->kr_head;
+	kr->kr_wpos = start + sizeof(kh);
+	kr->kr_wlen = 0;
+	kr->kr_wfull = kr->kr_wpos - kr->kr_tail > KLOG_RINGSIZE;
+	chars = __vprintf(klog_send, kr, fmt, ap);
+
+	end = start + KLOG_RECSIZE(kr->kr_wlen);
+	if (kr->kr_wfull || end - kr->kr_tail > KLOG_RINGSIZE) {
+		kr->kr_dropped++;
+	}
+	else {
+		gettime(&secs, &kh.kh_nsecs);
+		kh.kh_secs = secs;
+		kh.kh_len = kr->kr_wlen;
+		kh.kh_cpu = curcpu->c_number;
+		klog_copyin(kr->kr_buf, KLOG_RINGSIZE, start, &kh, sizeof(kh));
+
+		klog_barrier();
+		kr->kr_head = end;
+		klog_barrier();
+
+		/*
+		 * If the ring was empty, the flusher may be asleep.
+		 * (If it wasn't, the flusher will see this message
+		 * when it rechecks the head after moving the tail.)
+		 */
+		if (kr->kr_tail == start) {
+			kr->kr_needkick = true;
+		}
+	}
+	if (cankick && kr->kr_needkick) {
+		kr->kr_needkick = false;
+		kick = true;
+	}
+	splx(spl);
+
+	if (kick) {
+		V(klog_sem);
+	}
+	return chars;
+}
+
+/*
+ * Called from hardclock: wake the flusher for messages logged on this
+ * cpu while it couldn't be woken.
+ */
+void
+klog_tick(void)
+{
+	struct klog_ring *kr;
+
+	if (!klog_running) {
+		return;
+	}
+	kr = klog_rings[curcpu->c_number];
+	if (kr->kr_needkick) {
+		kr->kr_needkick = false;
+		V(klog_sem);
+	}
+}
+
+static
+bool
+klog_empty(void)
+{
+	unsigned i;
+
+	for (i=0; i<klog_nrings; i++) {
+		if (klog_rings[i]->kr_head != klog_rings[i]->kr_tail) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Add the message with header KH, whose text is at POS in ring KR, to
+ * the history, discarding the oldest messages to make room. Call with
+ * kprintf_lock held.
+ */
+static
+void
+klog_hist_add(const struct klog_hdr *kh, const struct klog_ring *kr,
+	      uint32_t pos)
+{
+	struct klog_hdr old;
+	uint32_t size, i;
+
+	size = KLOG_RECSIZE(kh->kh_len);
+	if (size > KLOG_HISTSIZE) {
+		return;
+	}
+	while (klog_hist_head + size - klog_hist_tail > KLOG_HISTSIZE) {
+		klog_copyout(klog_hist, KLOG_HISTSIZE, klog_hist_tail,
+			     &old, sizeof(old));
+		klog_hist_tail += KLOG_RECSIZE(old.kh_len);
+	}
+	klog_copyin(klog_hist, KLOG_HISTSIZE, klog_hist_head, kh, sizeof(*kh));
+	for (i=0; i<kh->kh_len; i++) {
+		klog_hist[(klog_hist_head + sizeof(*kh) + i)
+			  & (KLOG_HISTSIZE - 1)] =
+			kr->kr_buf[(pos + i) & (KLOG_RINGSIZE - 1)];
+	}
+	klog_hist_head += size;
+}
+
+/*
+ * Print text stored in RING at POS, one character at a time.
+ */
+static
+void
+klog_puttext(const char *ring, uint32_t size, uint32_t pos, uint32_t len)
+{
+	uint32_t i;
+
+	for (i=0; i<len; i++) {
+		putch(ring[(pos + i) & (size - 1)]);
+	}
+}
+
+/*
+ * Printf straight to the console; caller does the locking.
+ */
+static
+void
+klog_consprintf(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	__vprintf(console_send, NULL, fmt, ap);
+	va_end(ap);
+}
+
+static
+void
+klog_report_drops(struct klog_ring *kr, unsigned cpunum)
+{
+	uint32_t dropped;
+
+	dropped = kr->kr_dropped;
+	if (dropped != kr->kr_dropped_seen) {
+		klog_consprintf(
+			 "klog: cpu%u: %u messages lost\n",
+			 cpunum, dropped - kr->kr_dropped_seen);
+		kr->kr_dropped_seen = dropped;
+	}
+}
+
+/*
+ * Move every message out of the rings, oldest first, to the console
+ * (and, if HISTORY, to the history). Returns when the rings are all
+ * empty. Call with kprintf_lock held, or when nothing else can run.
+ */
+static
+void
+klog_drain(bool history)
+{
+	struct klog_ring *kr, *best;
+	struct klog_hdr kh, bestkh;
+	uint32_t pos;
+	unsigned i;
+
+	while (1) {
+		best = NULL;
+		for (i=0; i<klog_nrings; i++) {
+			kr = klog_rings[i];
+			klog_report_drops(kr, i);
+			if (kr->kr_head == kr->kr_tail) {
+				continue;
+			}
+			klog_barrier();
+			klog_copyout(kr->kr_buf, KLOG_RINGSIZE, kr->kr_tail,
+				     &kh, sizeof(kh));
+			if (best == NULL || kh.kh_secs < bestkh.kh_secs ||
+			    (kh.kh_secs == bestkh.kh_secs &&
+			     kh.kh_nsecs < bestkh.kh_nsecs)) {
+				best = kr;
+				bestkh = kh;
+			}
+		}
+		if (best == NULL) {
+			break;
+		}
+
+		pos = best->kr_tail + sizeof(bestkh);
+		klog_puttext(best->kr_buf, KLOG_RINGSIZE, pos, bestkh.kh_len);
+
+		if (history) {
+			klog_hist_add(&bestkh, best, pos);
+		}
+
+		klog_barrier();
+		best->kr_tail += KLOG_RECSIZE(bestkh.kh_len);
+		klog_barrier();
+	}
+}
+
+static
+void
+klog_flusher(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		P(klog_sem);
+
+		lock_acquire(kprintf_lock);
+		putch_prepare();
+		klog_drain(true);
+		putch_complete();
+		lock_release(kprintf_lock);
+
+		lock_acquire(klog_waitlock);
+		cv_broadcast(klog_waitcv, klog_waitlock);
+		lock_release(klog_waitlock);
+	}
+}
+
+/*
+ * Set up the rings and start the flusher. Call once all cpus exist.
+ */
+void
+klog_bootstrap(void)
+{
+	unsigned i;
+	int result;
+
+	KASSERT(klog_rings == NULL);
+
+	klog_nrings = cpu_count();
+	klog_rings = kmalloc(klog_nrings * sizeof(*klog_rings));
+	if (klog_rings == NULL) {
+		panic("klog_bootstrap: Out of memory\n");
+	}
+	for (i=0; i<klog_nrings; i++) {
+		klog_rings[i] = kmalloc(sizeof(struct klog_ring));
+		if (klog_rings[i] == NULL) {
+			panic("klog_bootstrap: Out of memory\n");
+		}
+		bzero(klog_rings[i], sizeof(struct klog_ring));
+	}
+
+	klog_sem = sem_create("klog", 0);
+	klog_waitlock = lock_create("klog");
+	klog_waitcv = cv_create("klog");
+	if (klog_sem == NULL || klog_waitlock == NULL || klog_waitcv == NULL) {
+		panic("klog_bootstrap: Out of memory\n");
+	}
+
+	result = thread_fork("klog", NULL, klog_flusher, NULL, 0);
+	if (result) {
+		panic("klog_bootstrap: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+
+	klog_barrier();
+	klog_running = true;
+}
+
+/*
+ * Wait until everything logged so far has reached the console. Used
+ * before reading from the console, so prompts appear, and before
+ * user output, so it comes out after the kernel's.
+ */
+void
+klog_flush(void)
+{
+	if (!klog_running || klog_empty()) {
+		return;
+	}
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(curthread->t_iplhigh_count == 0);
+
+	V(klog_sem);
+	lock_acquire(klog_waitlock);
+	while (klog_running && !klog_empty()) {
+		cv_wait(klog_waitcv, klog_waitlock);
+	}
+	lock_release(klog_waitlock);
+}
+
+/*
+ * Go back to printing synchronously (for shutdown).
+ */
+void
+klog_stop(void)
+{
+	klog_flush();
+	klog_running = false;
+}
+
+/*
+ * Print the history, with timestamps and cpu numbers, and the number
+ * of messages lost on each cpu.
+ */
+void
+klog_dump(void)
+{
+	struct klog_hdr kh;
+	uint32_t pos;
+	char last;
+	unsigned i;
+
+	if (klog_rings == NULL) {
+		kprintf("klog: not started\n");
+		return;
+	}
+	klog_flush();
+
+	lock_acquire(kprintf_lock);
+	putch_prepare();
+	for (pos = klog_hist_tail; pos != klog_hist_head;
+	     pos += KLOG_RECSIZE(kh.kh_len)) {
+		klog_copyout(klog_hist, KLOG_HISTSIZE, pos, &kh, sizeof(kh));
+		klog_consprintf("[%5u.%06u] cpu%u: ",
+			 kh.kh_secs, kh.kh_nsecs / 1000, kh.kh_cpu);
+		klog_puttext(klog_hist, KLOG_HISTSIZE, pos + sizeof(kh),
+			     kh.kh_len);
+		if (kh.kh_len > 0) {
+			klog_copyout(klog_hist, KLOG_HISTSIZE,
+				     pos + sizeof(kh) + kh.kh_len - 1,
+				     &last, 1);
+			if (last != '\n') {
+				putch('\n');
+			}
+		}
+		else {
+			putch('\n');
+		}
+	}
+	for (i=0; i<klog_nrings; i++) {
+		klog_consprintf("cpu%u: %u messages lost\n",
+			 i, klog_rings[i]->kr_dropped);
+	}
+	putch_complete();
+	lock_release(kprintf_lock);
+}
+
 /*
  * Printf to the console.
  */
@@ -97,6 +579,13 @@ kprintf(const char *fmt, ...)
 	va_list ap;
 	bool dolock;
 
+	if (klog_running) {
+		va_start(ap, fmt);
+		chars = klog_vprintf(fmt, ap);
+		va_end(ap);
+		return chars;
+	}
+
 	dolock = kprintf_lock != NULL
 		&& curthread->t_in_interrupt == false
 		&& curthread->t_iplhigh_count == 0;
@@ -169,7 +658,17 @@ panic(const char *fmt, ...)
 	if (evil == 2) {
 		evil = 3;
 
-		/* Print the message. */
+		/*
+		 * Print anything still in the log, then the message,
+		 * directly. The other cpus are stopped, so the rings
+		 * are ours.
+		 */
+		if (klog_running) {
+			klog_running = false;
+			putch_prepare();
+			klog_drain(false);
+			putch_complete();
+		}
 		kprintf("panic: ");
 		putch_prepare();
 		va_start(ap, fmt);
@@ -0,0 +1,226 @@
+/*
+ * Per-process open file table. See <filetable.h>.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <filetable.h>
+
+static
+struct openfile *
+openfile_create(struct vnode *v, int flags)
+{
+	struct openfile *of;
+
+	of = kmalloc(sizeof(*of));
+	if (of == NULL) {
+		return NULL;
+	}
+	of->of_lock = lock_create("openfile");
+	if (of->of_lock == NULL) {
+		kfree(of);
+		return NULL;
+	}
+	of->of_vnode = v;
+	of->of_flags = flags;
+	of->of_offset = 0;
+	of->of_refcount = 1;
+	return of;
+}
+
+static
+void
+openfile_incref(struct openfile *of)
+{
+	lock_acquire(of->of_lock);
+	of->of_refcount++;
+	lock_release(of->of_lock);
+}
+
+static
+void
+openfile_decref(struct openfile *of)
+{
+	unsigned refs;
+
+	lock_acquire(of->of_lock);
+	KASSERT(of->of_refcount > 0);
+	refs = --of->of_refcount;
+	lock_release(of->of_lock);
+
+	if (refs == 0) {
+		vfs_close(of->of_vnode);
+		lock_destroy(of->of_lock);
+		kfree(of);
+	}
+}
+
+/*
+ * Find the lowest free descriptor and mark it in use.
+ */
+static
+int
+filetable_allocfd(struct filetable *ft, int *fd)
+{
+	unsigned i, bit;
+	uint32_t w;
+
+	for (i=0; i<FILETABLE_WORDS; i++) {
+		if (ft->ft_used[i] != 0xffffffff) {
+			w = ~ft->ft_used[i];
+			for (bit=0; (w & 1) == 0; bit++) {
+				w >>= 1;
+			}
+			if (i * 32 + bit >= OPEN_MAX) {
+				break;
+			}
+			ft->ft_used[i] |= (uint32_t)1 << bit;
+			*fd = i * 32 + bit;
+			return 0;
+		}
+	}
+	return EMFILE;
+}
+
+static
+void
+filetable_freefd(struct filetable *ft, int fd)
+{
+	ft->ft_used[fd / 32] &= ~((uint32_t)1 << (fd % 32));
+	ft->ft_files[fd] = NULL;
+}
+
+struct filetable *
+filetable_create(void)
+{
+	struct filetable *ft;
+	unsigned i;
+
+	ft = kmalloc(sizeof(*ft));
+	if (ft == NULL) {
+		return NULL;
+	}
+	for (i=0; i<OPEN_MAX; i++) {
+		ft->ft_files[i] = NULL;
+	}
+	for (i=0; i<FILETABLE_WORDS; i++) {
+		ft->ft_used[i] = 0;
+	}
+	return ft;
+}
+
+int
+filetable_copy(struct filetable *src, struct filetable **ret)
+{
+	struct filetable *ft;
+	unsigned i;
+
+	ft = filetable_create();
+	if (ft == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<OPEN_MAX; i++) {
+		if (src->ft_files[i] != NULL) {
+			openfile_incref(src->ft_files[i]);
+			ft->ft_files[i] = src->ft_files[i];
+		}
+	}
+	for (i=0; i<FILETABLE_WORDS; i++) {
+		ft->ft_used[i] = src->ft_used[i];
+	}
+	*ret = ft;
+	return 0;
+}
+
+void
+filetable_destroy(struct filetable *ft)
+{
+	unsigned i;
+
+	for (i=0; i<OPEN_MAX; i++) {
+		if (ft->ft_files[i] != NULL) {
+			openfile_decref(ft->ft_files[i]);
+		}
+	}
+	kfree(ft);
+}
+
+int
+filetable_open(struct filetable *ft, char *path, int flags, mode_t mode,
+	       int *fd)
+{
+	struct openfile *of;
+	struct vnode *v;
+	int result;
+
+	result = filetable_allocfd(ft, fd);
+	if (result) {
+		return result;
+	}
+
+	result = vfs_open(path, flags, mode, &v);
+	if (result) {
+		filetable_freefd(ft, *fd);
+		return result;
+	}
+
+	of = openfile_create(v, flags);
+	if (of == NULL) {
+		vfs_close(v);
+		filetable_freefd(ft, *fd);
+		return ENOMEM;
+	}
+
+	ft->ft_files[*fd] = of;
+	return 0;
+}
+
+/*
+ * Standard input, output and error all go to the console.
+ */
+int
+filetable_opencons(struct filetable *ft)
+{
+	static const int modes[3] = { O_RDONLY, O_WRONLY, O_WRONLY };
+	char path[5];
+	int fd, i, result;
+
+	for (i=0; i<3; i++) {
+		/* vfs_open destroys the path */
+		strcpy(path, "con:");
+		result = filetable_open(ft, path, modes[i], 0, &fd);
+		if (result) {
+			return result;
+		}
+		KASSERT(fd == i);
+	}
+	return 0;
+}
+
+int
+filetable_get(struct filetable *ft, int fd, struct openfile **ret)
+{
+	if (fd < 0 || fd >= OPEN_MAX || ft->ft_files[fd] == NULL) {
+		return EBADF;
+	}
+	*ret = ft->ft_files[fd];
+	return 0;
+}
+
+int
+filetable_close(struct filetable *ft, int fd)
+{
+	struct openfile *of;
+	int result;
+
+	result = filetable_get(ft, fd, &of);
+	if (result) {
+		return result;
+	}
+	filetable_freefd(ft, fd);
+	openfile_decref(of);
+	return 0;
+}
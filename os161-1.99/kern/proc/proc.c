@@ -49,16 +49,50 @@
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
+#include <wchan.h>
+#include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/wait.h>
+#include <limits.h>
+#include <filetable.h>
 #include "opt-A2.h"
 #include <spinlock.h>
 
 #if OPT_A2
-volatile int counter = 1;
-struct lock *counter_lock = NULL;
-// bool kernel_set = false;
-// struct spinlock *spin_counter = NULL;
-#endif
+/*
+ * PID table.
+ *
+ * A fixed array of PROCTABLE_SIZE slots. A pid names both a slot and a
+ * generation of that slot: pid % PROCTABLE_SIZE is the slot number.
+ * Lookup is one array index plus a check that the slot still holds
+ * the pid asked for. Whenever a slot is freed its pid advances by
+ * PROCTABLE_SIZE (wrapping before PID_MAX), so a recycled slot hands
+ * out a new pid and stale pids stop matching. Free slots are kept on
+ * a FIFO list so that a freed pid is reused as late as possible.
+ *
+ * pidtable_lock is a spinlock held only to allocate, free or look up
+ * a slot, so creating processes does not serialize on it.
+ */
+#define PROCTABLE_SIZE  256
+
+struct pidslot {
+	struct proc *ps_proc;	/* process in this slot, or NULL if free */
+	pid_t ps_pid;		/* its pid, or the next pid to hand out */
+	int ps_nextfree;	/* next slot on the free list, or -1 */
+};
+
+static struct pidslot pidtable[PROCTABLE_SIZE];
+static int pidtable_freehead;
+static int pidtable_freetail;
+static struct spinlock pidtable_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Process tree lock. Protects every process's family fields (parent,
+ * children, p_exited, list links, terminated and exit_code). It's a spinlock
+ * held only for list surgery, never across anything that can sleep.
+ */
+static struct spinlock proctree_lock = SPINLOCK_INITIALIZER;
+#endif // OPT_A2
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -80,6 +114,228 @@ struct semaphore *no_proc_sem;
 
 
 
+#if OPT_A2
+/*
+ * Set up the pid table with every slot free.
+ */
+static
+void
+pidtable_init(void)
+{
+	int i;
+
+	for (i=0; i<PROCTABLE_SIZE; i++) {
+		pidtable[i].ps_proc = NULL;
+		pidtable[i].ps_pid = i;
+		if (pidtable[i].ps_pid < PID_MIN) {
+			pidtable[i].ps_pid += PROCTABLE_SIZE;
+		}
+		pidtable[i].ps_nextfree = i + 1;
+	}
+	pidtable[PROCTABLE_SIZE - 1].ps_nextfree = -1;
+	pidtable_freehead = 0;
+	pidtable_freetail = PROCTABLE_SIZE - 1;
+}
+
+/*
+ * Take a slot off the head of the free list and give its pid to PROC.
+ */
+static
+int
+pid_alloc(struct proc *proc)
+{
+	struct pidslot *ps;
+	int slot;
+
+	spinlock_acquire(&pidtable_lock);
+	slot = pidtable_freehead;
+	if (slot < 0) {
+		spinlock_release(&pidtable_lock);
+		return ENPROC;
+	}
+	ps = &pidtable[slot];
+	pidtable_freehead = ps->ps_nextfree;
+	if (pidtable_freehead < 0) {
+		pidtable_freetail = -1;
+	}
+	KASSERT(ps->ps_proc == NULL);
+	ps->ps_proc = proc;
+	ps->ps_nextfree = -1;
+	proc->pid = ps->ps_pid;
+	spinlock_release(&pidtable_lock);
+	return 0;
+}
+
+/*
+ * Release PID's slot: advance its generation and put it at the tail
+ * of the free list.
+ */
+static
+void
+pid_free(pid_t pid)
+{
+	struct pidslot *ps;
+	int slot;
+
+	slot = pid % PROCTABLE_SIZE;
+	ps = &pidtable[slot];
+
+	spinlock_acquire(&pidtable_lock);
+	KASSERT(ps->ps_proc != NULL && ps->ps_pid == pid);
+	ps->ps_proc = NULL;
+	ps->ps_pid += PROCTABLE_SIZE;
+	if (ps->ps_pid > PID_MAX) {
+		ps->ps_pid = slot;
+	}
+	if (ps->ps_pid < PID_MIN) {
+		ps->ps_pid += PROCTABLE_SIZE;
+	}
+	ps->ps_nextfree = -1;
+	if (pidtable_freetail < 0) {
+		pidtable_freehead = slot;
+	}
+	else {
+		pidtable[pidtable_freetail].ps_nextfree = slot;
+	}
+	pidtable_freetail = slot;
+	spinlock_release(&pidtable_lock);
+}
+
+/*
+ * Find the process with pid PID, or NULL if there isn't one.
+ *
+ * The result is neither locked nor referenced; the caller must know
+ * by other means that it can't be destroyed out from under it.
+ */
+struct proc *
+proc_lookup(pid_t pid)
+{
+	struct proc *proc;
+	struct pidslot *ps;
+
+	if (pid < PID_MIN || pid > PID_MAX) {
+		return NULL;
+	}
+	ps = &pidtable[pid % PROCTABLE_SIZE];
+
+	spinlock_acquire(&pidtable_lock);
+	proc = (ps->ps_pid == pid) ? ps->ps_proc : NULL;
+	spinlock_release(&pidtable_lock);
+	return proc;
+}
+
+/*
+ * Find the child of PARENT with pid PID. Returns ESRCH if there is no
+ * such process and ECHILD if it isn't PARENT's child.
+ *
+ * The parent check is done while holding the table lock, because a
+ * process that isn't our child may be destroyed at any moment; a
+ * child can't be destroyed until its parent (PARENT) reaps it.
+ */
+int
+proc_findchild(struct proc *parent, pid_t pid, struct proc **ret)
+{
+	struct proc *proc;
+	struct pidslot *ps;
+
+	if (pid < PID_MIN || pid > PID_MAX) {
+		return ESRCH;
+	}
+	ps = &pidtable[pid % PROCTABLE_SIZE];
+
+	spinlock_acquire(&pidtable_lock);
+	proc = (ps->ps_pid == pid) ? ps->ps_proc : NULL;
+	if (proc == NULL) {
+		spinlock_release(&pidtable_lock);
+		return ESRCH;
+	}
+	if (proc->parent != parent) {
+		spinlock_release(&pidtable_lock);
+		return ECHILD;
+	}
+	spinlock_release(&pidtable_lock);
+	*ret = proc;
+	return 0;
+}
+#endif // OPT_A2
+
+#if OPT_A2
+/*
+ * Process list operations. Callers hold proctree_lock.
+ */
+static
+void
+proclist_init(struct proclist *pl)
+{
+	pl->pl_head = NULL;
+	pl->pl_tail = NULL;
+	pl->pl_count = 0;
+}
+
+static
+void
+proclist_addtail(struct proclist *pl, struct proc *p)
+{
+	KASSERT(p->p_listprev == NULL && p->p_listnext == NULL);
+
+	p->p_listprev = pl->pl_tail;
+	if (pl->pl_tail != NULL) {
+		pl->pl_tail->p_listnext = p;
+	}
+	else {
+		pl->pl_head = p;
+	}
+	pl->pl_tail = p;
+	pl->pl_count++;
+}
+
+static
+void
+proclist_remove(struct proclist *pl, struct proc *p)
+{
+	KASSERT(pl->pl_count > 0);
+
+	if (p->p_listprev != NULL) {
+		p->p_listprev->p_listnext = p->p_listnext;
+	}
+	else {
+		KASSERT(pl->pl_head == p);
+		pl->pl_head = p->p_listnext;
+	}
+	if (p->p_listnext != NULL) {
+		p->p_listnext->p_listprev = p->p_listprev;
+	}
+	else {
+		KASSERT(pl->pl_tail == p);
+		pl->pl_tail = p->p_listprev;
+	}
+	p->p_listprev = NULL;
+	p->p_listnext = NULL;
+	pl->pl_count--;
+}
+
+static
+void
+proclist_cleanup(struct proclist *pl)
+{
+	KASSERT(pl->pl_count == 0);
+	KASSERT(pl->pl_head == NULL && pl->pl_tail == NULL);
+}
+
+static
+struct proc *
+proclist_remhead(struct proclist *pl)
+{
+	struct proc *p;
+
+	p = pl->pl_head;
+	if (p != NULL) {
+		proclist_remove(pl, p);
+	}
+	return p;
+}
+#endif // OPT_A2
+
 /*
  * Create a proc structure.
  */
@@ -108,47 +364,34 @@ proc_create(const char *name)
 	/* VFS fields */
 	proc->p_cwd = NULL;
 
-#ifdef UW
+#if OPT_A2
+	proc->p_filetable = NULL;
+#elif defined(UW)
 	proc->console = NULL;
 #endif // UW
 
 #if OPT_A2
-	
-	KASSERT(counter > 0);
-	if (counter_lock == NULL){
-		proc->pid = counter;
-		counter++;
-	} else {
-		lock_acquire(counter_lock);
-		proc->pid = counter;
-		counter++;
-		lock_release(counter_lock);
-	}
-	
 	proc->parent = NULL;
-	proc->children = array_create();
-	array_init(proc->children);
+	proclist_init(&proc->children);
+	proclist_init(&proc->p_exited);
+	proc->p_listprev = NULL;
+	proc->p_listnext = NULL;
+	proc->terminated = false;
+	proc->exit_code = -1;
 
-	proc->children_lk = lock_create("children_lk");
-	if (proc->children_lk == NULL) {
-		panic("failed to create children_lk.\n"); 
+	proc->p_wchan = wchan_create("proc_wait");
+	if (proc->p_wchan == NULL) {
 		kfree(proc->p_name);
 		kfree(proc);
 		return NULL;
 	}
 
-	proc->p_cv = cv_create("proc_cv");
-	if (proc->p_cv == NULL) {
-		panic("failed to create proc_cv.\n");
+	if (pid_alloc(proc)) {
+		wchan_destroy(proc->p_wchan);
 		kfree(proc->p_name);
-		lock_destroy(proc->children_lk);
 		kfree(proc);
 		return NULL;
 	}
-	
-	proc->terminated = false;
-	proc->exit_code = -1;
-
 #endif // OPT_A2
 
 	return proc;
@@ -186,22 +429,16 @@ proc_destroy(struct proc *proc)
 
 
 #if OPT_A2
-	int children_len = array_num(proc->children);
-	lock_acquire(proc->children_lk);
-	for (int i = children_len - 1; i >=0; i-- ) {	// free children and check if there exists Zombies
-		struct proc *curr_child = array_get(proc->children,i);
-		curr_child->parent = NULL;
-		if(curr_child->terminated == true) {  // remove Zombie Process
-			proc_destroy(curr_child);
-		}
-		array_remove(proc->children, i);
-	}
-	array_setsize(proc->children, 0);
-	lock_release(proc->children_lk);
-	
-	array_destroy(proc->children);
-	lock_destroy(proc->children_lk);
-	cv_destroy(proc->p_cv);
+	/* Children were handed off when we exited (or we never had any). */
+	KASSERT(proc->children.pl_count == 0);
+	KASSERT(proc->p_exited.pl_count == 0);
+	KASSERT(proc->parent == NULL);
+	if (proc->p_wchan != NULL) {
+		wchan_destroy(proc->p_wchan);
+	}
+
+	/* From here on the pid may be handed out again. */
+	pid_free(proc->pid);
 #endif // OPT_A2
 
 
@@ -225,9 +462,15 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
-#ifdef UW
+#if OPT_A2
+	if (proc->p_filetable) {
+		filetable_destroy(proc->p_filetable);
+		proc->p_filetable = NULL;
+	}
+#elif defined(UW)
 	if (proc->console) {
 	  vfs_close(proc->console);
+	  proc->console = NULL;
 	}
 #endif // UW
 
@@ -261,7 +504,7 @@ void
 proc_bootstrap(void)
 { 
 #if OPT_A2
-  KASSERT(counter > 0);
+  pidtable_init();
 #endif
   kproc = proc_create("[kernel]");
   if (kproc == NULL) {
@@ -279,15 +522,31 @@ proc_bootstrap(void)
     panic("could not create no_proc_sem semaphore\n");
   }
 #endif // UW
+}
 
-#if OPT_A2
-  // Make sure the counter_lock is created before proc_create()
-  counter_lock = lock_create("counter_lock");
-  if(counter_lock == NULL){
-  	panic("could not create lock for counter.\n");
-  }
-#endif	// OPT_A2
+#ifdef UW
+/*
+ * Wait until there are no user processes left. A V of no_proc_sem
+ * only means the count reached zero at some point: a process that
+ * goes away with nobody waiting (one that failed to start, say)
+ * leaves its V behind. So check the count itself each time round.
+ */
+void
+proc_wait_noprocs(void)
+{
+	unsigned count;
+
+	while (1) {
+		P(proc_count_mutex);
+		count = proc_count;
+		V(proc_count_mutex);
+		if (count == 0) {
+			break;
+		}
+		P(no_proc_sem);
+	}
 }
+#endif // UW
 
 /*
  * Create a fresh proc for use by runprogram.
@@ -299,14 +558,16 @@ struct proc *
 proc_create_runprogram(const char *name)
 {
 	struct proc *proc;
+#if !OPT_A2
 	char *console_path;
+#endif
 
 	proc = proc_create(name);
 	if (proc == NULL) {
 		return NULL;
 	}
 
-#ifdef UW
+#if !OPT_A2 && defined(UW)
 	/* open the console - this should always succeed */
 	console_path = kstrdup("con:");
 	if (console_path == NULL) {
@@ -350,6 +611,20 @@ proc_create_runprogram(const char *name)
 	V(proc_count_mutex);
 #endif // UW
 
+#if OPT_A2
+	/*
+	 * Standard input, output and error on the console. fork and
+	 * spawn replace this with a copy of the parent's table.
+	 * (Done after counting the process, as proc_destroy uncounts it.)
+	 */
+	proc->p_filetable = filetable_create();
+	if (proc->p_filetable == NULL ||
+	    filetable_opencons(proc->p_filetable) != 0) {
+		proc_destroy(proc);
+		return NULL;
+	}
+#endif
+
 	return proc;
 }
 
@@ -443,3 +718,178 @@ curproc_setas(struct addrspace *newas)
 	spinlock_release(&proc->p_lock);
 	return oldas;
 }
+
+#if OPT_A2
+/*
+ * Make CHILD a child of PARENT. Done before CHILD's thread starts, so
+ * CHILD can't exit without a parent to report to.
+ */
+void
+proc_addchild(struct proc *parent, struct proc *child)
+{
+	spinlock_acquire(&proctree_lock);
+	KASSERT(child->parent == NULL);
+	child->parent = parent;
+	proclist_addtail(&parent->children, child);
+	spinlock_release(&proctree_lock);
+}
+
+/*
+ * Undo proc_addchild, for when CHILD fails to start.
+ */
+void
+proc_remchild(struct proc *parent, struct proc *child)
+{
+	spinlock_acquire(&proctree_lock);
+	KASSERT(child->parent == parent);
+	KASSERT(!child->terminated);
+	proclist_remove(&parent->children, child);
+	child->parent = NULL;
+	spinlock_release(&proctree_lock);
+}
+
+/*
+ * Process exit. Called by the process's last thread after it has
+ * destroyed the address space and detached itself (so PROC is no
+ * longer curproc).
+ *
+ * What a zombie doesn't need (cwd, open files, the wait channel) is
+ * released here; what's left is the proc structure with its pid and
+ * exit code. The children are orphaned: live ones will free
+ * themselves when they exit, and ones that already exited are freed
+ * here. If nobody is going to wait for PROC, it is freed too;
+ * otherwise it moves to the tail of its parent's p_exited queue.
+ *
+ * The zombies are collected on a private list under the tree lock and
+ * destroyed after dropping it, one at a time. A zombie has no children
+ * of its own (they were orphaned when it exited), so this never
+ * recurses.
+ */
+void
+proc_exit(struct proc *proc, int exitcode)
+{
+	struct proclist reap;
+	struct proc *child;
+	struct wchan *wc;
+
+	KASSERT(proc != kproc);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
+
+	/* These may sleep, so do them before taking the tree lock. */
+	if (proc->p_cwd) {
+		VOP_DECREF(proc->p_cwd);
+		proc->p_cwd = NULL;
+	}
+	if (proc->p_filetable) {
+		filetable_destroy(proc->p_filetable);
+		proc->p_filetable = NULL;
+	}
+
+	proclist_init(&reap);
+
+	spinlock_acquire(&proctree_lock);
+
+	while ((child = proclist_remhead(&proc->children)) != NULL) {
+		child->parent = NULL;
+	}
+	while ((child = proclist_remhead(&proc->p_exited)) != NULL) {
+		child->parent = NULL;
+		proclist_addtail(&reap, child);
+	}
+
+	proc->terminated = true;
+	proc->exit_code = exitcode;
+
+	/* Only our own (now exiting) thread ever sleeps on this. */
+	wc = proc->p_wchan;
+	proc->p_wchan = NULL;
+
+	if (proc->parent == NULL) {
+		proclist_addtail(&reap, proc);
+	}
+	else {
+		proclist_remove(&proc->parent->children, proc);
+		proclist_addtail(&proc->parent->p_exited, proc);
+		wchan_wakeall(proc->parent->p_wchan);
+	}
+
+	spinlock_release(&proctree_lock);
+
+	wchan_destroy(wc);
+
+	while ((child = proclist_remhead(&reap)) != NULL) {
+		proc_destroy(child);
+	}
+	proclist_cleanup(&reap);
+}
+
+/*
+ * Wait for a child of PARENT to exit, then free it and hand back its
+ * pid and exit code. PID is either a specific child or WAIT_ANY.
+ *
+ * Exited children sit on PARENT's p_exited queue in the order they
+ * exited, so WAIT_ANY just takes the head, and waiting for a specific
+ * child (found through the pid table) unlinks it from the middle.
+ * Both are O(1).
+ *
+ * All of a process's children wake it through its one wait channel;
+ * we recheck our condition after every wakeup.
+ *
+ * With WNOHANG, if nothing suitable has exited yet, *RETPID is set to
+ * 0 and nothing is reaped.
+ */
+int
+proc_wait(struct proc *parent, pid_t pid, int options,
+	  pid_t *retpid, int *exitcode)
+{
+	struct proc *child;
+	int result;
+
+	if (pid == WAIT_ANY) {
+		child = NULL;
+	}
+	else {
+		result = proc_findchild(parent, pid, &child);
+		if (result) {
+			return result;
+		}
+	}
+
+	spinlock_acquire(&proctree_lock);
+	while (1) {
+		if (child == NULL) {
+			if (parent->p_exited.pl_count > 0) {
+				child = parent->p_exited.pl_head;
+				break;
+			}
+			if (parent->children.pl_count == 0) {
+				spinlock_release(&proctree_lock);
+				return ECHILD;
+			}
+		}
+		else if (child->terminated) {
+			break;
+		}
+
+		if (options & WNOHANG) {
+			spinlock_release(&proctree_lock);
+			*retpid = 0;
+			return 0;
+		}
+
+		/* Bridge to the wchan lock so a wakeup can't slip by. */
+		wchan_lock(parent->p_wchan);
+		spinlock_release(&proctree_lock);
+		wchan_sleep(parent->p_wchan);
+		spinlock_acquire(&proctree_lock);
+	}
+	proclist_remove(&parent->p_exited, child);
+	child->parent = NULL;
+	*retpid = child->pid;
+	*exitcode = child->exit_code;
+	spinlock_release(&proctree_lock);
+
+	proc_destroy(child);
+	return 0;
+}
+#endif // OPT_A2
@@ -125,6 +125,7 @@ boot(void)
 	vm_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
+	klog_bootstrap();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
@@ -145,6 +146,7 @@ void
 shutdown(void)
 {
 
+	klog_stop();
 	kprintf("Shutting down.\n");
 	
 	vfs_clearbootfs();
@@ -35,6 +35,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <clock.h>
+#include <cpustat.h>
 #include <thread.h>
 #include <proc.h>
 #include <synch.h>
@@ -160,7 +161,7 @@ common_prog(int nargs, char **args)
 #ifdef UW
 	/* wait until the process we have just launched - and any others that it 
 	   may fork - is finished before proceeding */
-	P(no_proc_sem);
+	proc_wait_noprocs();
 #endif // UW
 
 	return 0;
@@ -414,6 +415,30 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	cpustat_sched_print();
+
+	return 0;
+}
+
+static
+int
+cmd_dmesg(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	klog_dump();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -456,6 +481,7 @@ static const char *opsmenu[] = {
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
 	"[dth]	   Enable DB_THREADS debugging messages",
+	"[dmesg]   Print the kernel log      ",
 	NULL
 };
 
@@ -493,6 +519,10 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+	"[fs6] FS hashed directories (4)     ",
+#if OPT_A2
+	"[lb]  Process launch benchmark      ",
+#endif
 	NULL
 };
 
@@ -524,6 +554,7 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[cs] Scheduler stats (per cpu)      ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -582,6 +613,8 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "cs",         cmd_schedstats },
+	{ "dmesg",      cmd_dmesg },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -610,6 +643,12 @@ static struct {
 	{ "fs3",	writestress },
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
+	{ "fs6",	dirhashtest },
+
+#if OPT_A2
+	/* process launch benchmark */
+	{ "lb",		launchbench },
+#endif
 
 	{ NULL, NULL }
 };
@@ -0,0 +1,206 @@
+/*
+ * Argument vector marshalling. See <argbuf.h>.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <limits.h>
+#include <vm.h>
+#include <copyinout.h>
+#include <argbuf.h>
+
+/*
+ * Largest buffer we ever need: ARG_MAX bytes of strings and pointers,
+ * plus the padding between them added by argbuf_copyout.
+ */
+#define ARGBUF_MAXBYTES  ROUNDUP(ARG_MAX + sizeof(userptr_t), PAGE_SIZE)
+
+/* Size of the argv array for NARGS arguments, with its NULL. */
+static
+size_t
+argbuf_ptrbytes(int nargs)
+{
+	return (nargs + 1) * sizeof(userptr_t);
+}
+
+void
+argbuf_init(struct argbuf *ab)
+{
+	ab->ab_buf = NULL;
+	ab->ab_len = 0;
+	ab->ab_max = 0;
+	ab->ab_nargs = 0;
+}
+
+void
+argbuf_cleanup(struct argbuf *ab)
+{
+	if (ab->ab_buf != NULL) {
+		kfree(ab->ab_buf);
+	}
+	argbuf_init(ab);
+}
+
+/*
+ * Double the buffer (one page to start with).
+ */
+static
+int
+argbuf_grow(struct argbuf *ab)
+{
+	size_t newmax;
+	char *newbuf;
+
+	if (ab->ab_max >= ARGBUF_MAXBYTES) {
+		return E2BIG;
+	}
+	newmax = ab->ab_max == 0 ? PAGE_SIZE : ab->ab_max * 2;
+	if (newmax > ARGBUF_MAXBYTES) {
+		newmax = ARGBUF_MAXBYTES;
+	}
+
+	newbuf = kmalloc(newmax);
+	if (newbuf == NULL) {
+		return ENOMEM;
+	}
+	if (ab->ab_buf != NULL) {
+		memcpy(newbuf, ab->ab_buf, ab->ab_len);
+		kfree(ab->ab_buf);
+	}
+	ab->ab_buf = newbuf;
+	ab->ab_max = newmax;
+	return 0;
+}
+
+/*
+ * Account for a string of LEN bytes (with its NUL) just appended.
+ */
+static
+int
+argbuf_added(struct argbuf *ab, size_t len)
+{
+	ab->ab_len += len;
+	ab->ab_nargs++;
+	if (ab->ab_len + argbuf_ptrbytes(ab->ab_nargs) > ARG_MAX) {
+		return E2BIG;
+	}
+	return 0;
+}
+
+/*
+ * Append user string USTR. If it doesn't fit in what's left of the
+ * buffer, grow the buffer and fetch it again.
+ */
+static
+int
+argbuf_adduser(struct argbuf *ab, const_userptr_t ustr)
+{
+	size_t got;
+	int result;
+
+	while (1) {
+		if (ab->ab_len < ab->ab_max) {
+			result = copyinstr(ustr, ab->ab_buf + ab->ab_len,
+					   ab->ab_max - ab->ab_len, &got);
+			if (result == 0) {
+				return argbuf_added(ab, got);
+			}
+			if (result != ENAMETOOLONG) {
+				return result;
+			}
+		}
+		result = argbuf_grow(ab);
+		if (result) {
+			return result;
+		}
+	}
+}
+
+int
+argbuf_fromuser(struct argbuf *ab, const_userptr_t uargv)
+{
+	userptr_t uarg;
+	int result;
+
+	while (1) {
+		result = copyin(uargv + ab->ab_nargs * sizeof(userptr_t),
+				&uarg, sizeof(uarg));
+		if (result) {
+			return result;
+		}
+		if (uarg == NULL) {
+			return 0;
+		}
+		result = argbuf_adduser(ab, uarg);
+		if (result) {
+			return result;
+		}
+	}
+}
+
+int
+argbuf_fromkernel(struct argbuf *ab, char **args, int nargs)
+{
+	size_t len;
+	int i, result;
+
+	for (i=0; i<nargs; i++) {
+		len = strlen(args[i]) + 1;
+		while (ab->ab_max - ab->ab_len < len) {
+			result = argbuf_grow(ab);
+			if (result) {
+				return result;
+			}
+		}
+		memcpy(ab->ab_buf + ab->ab_len, args[i], len);
+		result = argbuf_added(ab, len);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Build the argv array in the buffer right after the (padded)
+ * strings, pointing at where the strings will be in user space, and
+ * copy the whole block out at once.
+ */
+int
+argbuf_copyout(struct argbuf *ab, vaddr_t *stackptr, userptr_t *argv)
+{
+	size_t strbytes, total, off;
+	userptr_t *uargv;
+	vaddr_t base;
+	int i, result;
+
+	strbytes = ROUNDUP(ab->ab_len, sizeof(userptr_t));
+	total = strbytes + argbuf_ptrbytes(ab->ab_nargs);
+	while (ab->ab_max < total) {
+		result = argbuf_grow(ab);
+		if (result) {
+			return result;
+		}
+	}
+	bzero(ab->ab_buf + ab->ab_len, strbytes - ab->ab_len);
+
+	/* the stack pointer must stay 8-byte aligned */
+	base = (*stackptr - total) & ~(vaddr_t)7;
+
+	uargv = (userptr_t *)(ab->ab_buf + strbytes);
+	off = 0;
+	for (i=0; i<ab->ab_nargs; i++) {
+		uargv[i] = (userptr_t)(base + off);
+		off += strlen(ab->ab_buf + off) + 1;
+	}
+	uargv[ab->ab_nargs] = NULL;
+
+	result = copyout(ab->ab_buf, (userptr_t)base, total);
+	if (result) {
+		return result;
+	}
+
+	*stackptr = base;
+	*argv = (userptr_t)(base + strbytes);
+	return 0;
+}
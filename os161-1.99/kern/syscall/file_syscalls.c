@@ -8,6 +8,330 @@
 #include <vfs.h>
 #include <current.h>
 #include <proc.h>
+#include <synch.h>
+#include <copyinout.h>
+#include <limits.h>
+#include <stat.h>
+#include <kern/fcntl.h>
+#include <kern/seek.h>
+#include <filetable.h>
+#include "opt-A2.h"
+
+#if OPT_A2
+/*
+ * File system calls, through the per-process file table (see
+ * filetable.h). Descriptors 0, 1 and 2 are opened on the console
+ * when a process is created; fork shares the parent's open files
+ * with the child.
+ */
+
+/*
+ * Number of iovecs handled without allocating: covers plain
+ * read/write and the usual header+body writev.
+ */
+#define FILE_SMALLIOV 8
+
+/*
+ * Move data between FD and the user buffers described by the IOVCNT
+ * (kernel copies of) iovecs in IOV, all in one uio so the filesystem
+ * sees a single request. The amount transferred goes in *RETVAL.
+ *
+ * Normally the I/O happens at the file's offset, which is advanced;
+ * the openfile's lock is held throughout so the update is atomic
+ * with the transfer. If POSITIONAL, the I/O happens at POS instead,
+ * the offset is neither used nor changed, and the lock isn't taken,
+ * so positional I/O doesn't serialize on a shared descriptor.
+ */
+static
+int
+file_io(int fd, struct iovec *iov, unsigned iovcnt, bool positional,
+        off_t pos, enum uio_rw rw, int *retval)
+{
+  struct openfile *of;
+  struct uio u;
+  struct stat st;
+  size_t total;
+  unsigned i;
+  int accmode, result;
+
+  KASSERT(curproc != NULL);
+  KASSERT(curproc->p_filetable != NULL);
+
+  result = filetable_get(curproc->p_filetable, fd, &of);
+  if (result) {
+    return result;
+  }
+  accmode = of->of_flags & O_ACCMODE;
+  if ((rw == UIO_READ && accmode == O_WRONLY) ||
+      (rw == UIO_WRITE && accmode == O_RDONLY)) {
+    return EBADF;
+  }
+
+  /* the total must fit in the (signed) return value */
+  total = 0;
+  for (i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len > (size_t)0x7fffffff - total) {
+      return EINVAL;
+    }
+    total += iov[i].iov_len;
+  }
+
+  if (positional) {
+    if (pos < 0) {
+      return EINVAL;
+    }
+    /* devices like the console have no positions */
+    result = VOP_TRYSEEK(of->of_vnode, pos);
+    if (result) {
+      return result;
+    }
+  }
+  else {
+    lock_acquire(of->of_lock);
+    if (rw == UIO_WRITE && (of->of_flags & O_APPEND)) {
+      result = VOP_STAT(of->of_vnode, &st);
+      if (result) {
+        lock_release(of->of_lock);
+        return result;
+      }
+      of->of_offset = st.st_size;
+    }
+    pos = of->of_offset;
+  }
+
+  /* set up a uio structure to refer to the user program's buffers */
+  u.uio_iov = iov;
+  u.uio_iovcnt = iovcnt;
+  u.uio_offset = pos;
+  u.uio_resid = total;
+  u.uio_segflg = UIO_USERSPACE;
+  u.uio_rw = rw;
+  u.uio_space = curproc->p_addrspace;
+
+  if (rw == UIO_READ) {
+    result = VOP_READ(of->of_vnode, &u);
+  }
+  else {
+    result = VOP_WRITE(of->of_vnode, &u);
+  }
+
+  if (!positional) {
+    if (result == 0) {
+      of->of_offset = u.uio_offset;
+    }
+    lock_release(of->of_lock);
+  }
+  if (result) {
+    return result;
+  }
+
+  /* pass back the number of bytes actually transferred */
+  *retval = total - u.uio_resid;
+  KASSERT(*retval >= 0);
+  return 0;
+}
+
+/*
+ * Single-buffer read/write, at the file offset or at POS.
+ */
+static
+int
+file_rw(int fd, userptr_t ubuf, size_t nbytes, bool positional, off_t pos,
+        enum uio_rw rw, int *retval)
+{
+  struct iovec iov;
+
+  iov.iov_ubase = ubuf;
+  iov.iov_len = nbytes;
+  return file_io(fd, &iov, 1, positional, pos, rw, retval);
+}
+
+/*
+ * Vectored read/write: fetch the user's iovec array UIOV of IOVCNT
+ * entries and hand it down whole.
+ */
+static
+int
+file_rwv(int fd, const_userptr_t uiov, int iovcnt, bool positional,
+         off_t pos, enum uio_rw rw, int *retval)
+{
+  struct iovec smalliov[FILE_SMALLIOV];
+  struct iovec *iov;
+  int result;
+
+  if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+    return EINVAL;
+  }
+
+  if (iovcnt <= FILE_SMALLIOV) {
+    iov = smalliov;
+  }
+  else {
+    iov = kmalloc(iovcnt * sizeof(struct iovec));
+    if (iov == NULL) {
+      return ENOMEM;
+    }
+  }
+
+  /* the user's struct iovec has the same layout as ours */
+  result = copyin(uiov, iov, iovcnt * sizeof(struct iovec));
+  if (result == 0) {
+    result = file_io(fd, iov, iovcnt, positional, pos, rw, retval);
+  }
+
+  if (iov != smalliov) {
+    kfree(iov);
+  }
+  return result;
+}
+
+int
+sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+  return file_rw(fdesc, ubuf, nbytes, false, 0, UIO_WRITE, retval);
+}
+
+int
+sys_read(int fdesc, userptr_t ubuf, unsigned int nbytes, int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: read(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+  return file_rw(fdesc, ubuf, nbytes, false, 0, UIO_READ, retval);
+}
+
+int
+sys_pread(int fdesc, userptr_t ubuf, unsigned int nbytes, off_t pos,
+          int *retval)
+{
+  return file_rw(fdesc, ubuf, nbytes, true, pos, UIO_READ, retval);
+}
+
+int
+sys_pwrite(int fdesc, userptr_t ubuf, unsigned int nbytes, off_t pos,
+           int *retval)
+{
+  return file_rw(fdesc, ubuf, nbytes, true, pos, UIO_WRITE, retval);
+}
+
+int
+sys_readv(int fdesc, const_userptr_t iov, int iovcnt, int *retval)
+{
+  return file_rwv(fdesc, iov, iovcnt, false, 0, UIO_READ, retval);
+}
+
+int
+sys_writev(int fdesc, const_userptr_t iov, int iovcnt, int *retval)
+{
+  return file_rwv(fdesc, iov, iovcnt, false, 0, UIO_WRITE, retval);
+}
+
+int
+sys_preadv(int fdesc, const_userptr_t iov, int iovcnt, off_t pos,
+           int *retval)
+{
+  return file_rwv(fdesc, iov, iovcnt, true, pos, UIO_READ, retval);
+}
+
+int
+sys_pwritev(int fdesc, const_userptr_t iov, int iovcnt, off_t pos,
+            int *retval)
+{
+  return file_rwv(fdesc, iov, iovcnt, true, pos, UIO_WRITE, retval);
+}
+
+int
+sys_open(userptr_t upath, int flags, mode_t mode, int *retval)
+{
+  char *path;
+  size_t actual;
+  int result;
+
+  switch (flags & O_ACCMODE) {
+  case O_RDONLY:
+  case O_WRONLY:
+  case O_RDWR:
+    break;
+  default:
+    return EINVAL;
+  }
+
+  path = kmalloc(PATH_MAX);
+  if (path == NULL) {
+    return ENOMEM;
+  }
+  result = copyinstr(upath, path, PATH_MAX, &actual);
+  if (result) {
+    kfree(path);
+    return result;
+  }
+
+  DEBUG(DB_SYSCALL,"Syscall: open(%s,%d)\n",path,flags);
+
+  /* vfs_open (inside filetable_open) destroys the path */
+  result = filetable_open(curproc->p_filetable, path, flags, mode, retval);
+  kfree(path);
+  return result;
+}
+
+int
+sys_close(int fdesc)
+{
+  DEBUG(DB_SYSCALL,"Syscall: close(%d)\n",fdesc);
+  return filetable_close(curproc->p_filetable, fdesc);
+}
+
+int
+sys_lseek(int fdesc, off_t pos, int whence, off_t *retval)
+{
+  struct openfile *of;
+  struct stat st;
+  off_t newpos;
+  int result;
+
+  result = filetable_get(curproc->p_filetable, fdesc, &of);
+  if (result) {
+    return result;
+  }
+
+  lock_acquire(of->of_lock);
+  switch (whence) {
+  case SEEK_SET:
+    newpos = pos;
+    break;
+  case SEEK_CUR:
+    newpos = of->of_offset + pos;
+    break;
+  case SEEK_END:
+    result = VOP_STAT(of->of_vnode, &st);
+    if (result) {
+      lock_release(of->of_lock);
+      return result;
+    }
+    newpos = st.st_size + pos;
+    break;
+  default:
+    lock_release(of->of_lock);
+    return EINVAL;
+  }
+
+  if (newpos < 0) {
+    lock_release(of->of_lock);
+    return EINVAL;
+  }
+  /* devices like the console can't seek */
+  result = VOP_TRYSEEK(of->of_vnode, newpos);
+  if (result) {
+    lock_release(of->of_lock);
+    return result;
+  }
+  of->of_offset = newpos;
+  lock_release(of->of_lock);
+
+  *retval = newpos;
+  return 0;
+}
+
+#else /* !OPT_A2 */
 
 /* handler for write() system call                  */
 /*
@@ -58,3 +382,5 @@ sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
   KASSERT(*retval >= 0);
   return 0;
 }
+
+#endif /* OPT_A2 */
@@ -53,6 +53,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <spinlock.h>
 #include <uio.h>
 #include <proc.h>
 #include <current.h>
@@ -147,21 +148,172 @@ load_segment(struct addrspace *as, struct vnode *v,
 }
 
 /*
- * Load an ELF executable user program into the current address space.
+ * The parts of an executable's headers we need to load it: the entry
+ * point and the PT_LOAD segments. Other segment types are checked and
+ * dropped when the headers are parsed.
+ */
+#define ELF_MAXSEGS 4
+
+struct elfseg {
+	off_t es_offset;
+	vaddr_t es_vaddr;
+	size_t es_memsz;
+	size_t es_filesz;
+	uint32_t es_flags;
+};
+
+struct elfimage {
+	vaddr_t ei_entry;
+	unsigned ei_nsegs;
+	struct elfseg ei_segs[ELF_MAXSEGS];
+};
+
+/*
+ * Exec image cache.
  *
- * Returns the entry point (initial PC) for the program in ENTRYPOINT.
+ * Launching the same program over and over would read and check the
+ * same executable and program headers every time. Instead, keep the
+ * parsed result for the last few executables, keyed by vnode. Each
+ * entry holds a reference to its vnode, so the vnode can't be
+ * recycled for a different file while cached. An entry is dropped
+ * when its file is written or truncated (elfcache_invalidate, via
+ * vnode_modified), which covers the modification state of the file;
+ * headers read while the file was being changed aren't cached at all
+ * (the vn_modgen check in elfcache_insert).
+ *
+ * VOP_INCREF is just an atomic add, so it's done under the spinlock
+ * when an entry is filled in. VOP_DECREF can sleep (it may reclaim
+ * the vnode), so entries are unhooked under the spinlock and their
+ * references dropped after it's released.
  */
+#define ELFCACHE_SIZE 8
+
+struct elfcache_entry {
+	struct vnode *ec_vn;		/* NULL if the slot is empty */
+	unsigned ec_lastuse;		/* for LRU replacement */
+	struct elfimage ec_image;
+};
+
+static struct spinlock elfcache_lock = SPINLOCK_INITIALIZER;
+static struct elfcache_entry elfcache[ELFCACHE_SIZE];
+static unsigned elfcache_clock;
+
+static
+bool
+elfcache_lookup(struct vnode *v, struct elfimage *img)
+{
+	unsigned i;
+
+	spinlock_acquire(&elfcache_lock);
+	for (i=0; i<ELFCACHE_SIZE; i++) {
+		if (elfcache[i].ec_vn == v) {
+			elfcache[i].ec_lastuse = ++elfcache_clock;
+			*img = elfcache[i].ec_image;
+			spinlock_release(&elfcache_lock);
+			return true;
+		}
+	}
+	spinlock_release(&elfcache_lock);
+	return false;
+}
+
+static
+void
+elfcache_insert(struct vnode *v, int modgen, const struct elfimage *img)
+{
+	struct vnode *victim;
+	unsigned i, slot;
+
+	spinlock_acquire(&elfcache_lock);
+	if (v->vn_modgen != modgen) {
+		/* IMG may be stale already (see vnode_modified) */
+		spinlock_release(&elfcache_lock);
+		return;
+	}
+	slot = 0;
+	for (i=0; i<ELFCACHE_SIZE; i++) {
+		if (elfcache[i].ec_vn == v) {
+			/* someone else got here first */
+			spinlock_release(&elfcache_lock);
+			return;
+		}
+		if (elfcache[slot].ec_vn != NULL &&
+		    (elfcache[i].ec_vn == NULL ||
+		     elfcache[i].ec_lastuse < elfcache[slot].ec_lastuse)) {
+			slot = i;
+		}
+	}
+	victim = elfcache[slot].ec_vn;
+	VOP_INCREF(v);
+	elfcache[slot].ec_vn = v;
+	elfcache[slot].ec_lastuse = ++elfcache_clock;
+	elfcache[slot].ec_image = *img;
+	spinlock_release(&elfcache_lock);
+
+	if (victim != NULL) {
+		VOP_DECREF(victim);
+	}
+}
+
+void
+elfcache_invalidate(struct vnode *v)
+{
+	unsigned i;
+	bool found = false;
+
+	spinlock_acquire(&elfcache_lock);
+	for (i=0; i<ELFCACHE_SIZE; i++) {
+		if (elfcache[i].ec_vn == v) {
+			elfcache[i].ec_vn = NULL;
+			found = true;
+			break;
+		}
+	}
+	spinlock_release(&elfcache_lock);
+
+	if (found) {
+		/* Our caller holds a reference; this isn't the last. */
+		VOP_DECREF(v);
+	}
+}
+
+void
+elfcache_purgefs(struct fs *fs)
+{
+	struct vnode *victim;
+	unsigned i;
+
+	for (i=0; i<ELFCACHE_SIZE; i++) {
+		victim = NULL;
+
+		spinlock_acquire(&elfcache_lock);
+		if (elfcache[i].ec_vn != NULL &&
+		    elfcache[i].ec_vn->vn_fs == fs) {
+			victim = elfcache[i].ec_vn;
+			elfcache[i].ec_vn = NULL;
+		}
+		spinlock_release(&elfcache_lock);
+
+		if (victim != NULL) {
+			VOP_DECREF(victim);
+		}
+	}
+}
+
+/*
+ * Read the executable header and program headers of V, check that
+ * it's something we can run, and record what's needed to load it.
+ */
+static
 int
-load_elf(struct vnode *v, vaddr_t *entrypoint)
+elf_readimage(struct vnode *v, struct elfimage *img)
 {
 	Elf_Ehdr eh;   /* Executable header */
 	Elf_Phdr ph;   /* "Program header" = segment header */
 	int result, i;
 	struct iovec iov;
 	struct uio ku;
-	struct addrspace *as;
-
-	as = curproc_getas();
+	struct elfseg *es;
 
 	/*
 	 * Read the executable header from offset 0 in the file.
@@ -203,8 +355,11 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return ENOEXEC;
 	}
 
+	img->ei_entry = eh.e_entry;
+	img->ei_nsegs = 0;
+
 	/*
-	 * Go through the list of segments and set up the address space.
+	 * Go through the list of segments and record the ones to load.
 	 *
 	 * Ordinarily there will be one code segment, one read-only
 	 * data segment, and one data/bss segment, but there might
@@ -244,11 +399,55 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+		if (img->ei_nsegs == ELF_MAXSEGS) {
+			kprintf("loadelf: too many segments\n");
+			return ENOEXEC;
+		}
+		es = &img->ei_segs[img->ei_nsegs++];
+		es->es_offset = ph.p_offset;
+		es->es_vaddr = ph.p_vaddr;
+		es->es_memsz = ph.p_memsz;
+		es->es_filesz = ph.p_filesz;
+		es->es_flags = ph.p_flags;
+	}
+
+	return 0;
+}
+
+/*
+ * Load an ELF executable user program into the current address space.
+ *
+ * Returns the entry point (initial PC) for the program in ENTRYPOINT.
+ */
+int
+load_elf(struct vnode *v, vaddr_t *entrypoint)
+{
+	struct elfimage img;
+	struct elfseg *es;
+	struct addrspace *as;
+	unsigned i;
+	int modgen;
+	int result;
+
+	as = curproc_getas();
+
+	/* Repeat execs of a program skip straight to setting it up. */
+	if (!elfcache_lookup(v, &img)) {
+		modgen = v->vn_modgen;
+		result = elf_readimage(v, &img);
+		if (result) {
+			return result;
+		}
+		elfcache_insert(v, modgen, &img);
+	}
+
+	for (i=0; i<img.ei_nsegs; i++) {
+		es = &img.ei_segs[i];
 		result = as_define_region(as,
-					  ph.p_vaddr, ph.p_memsz,
-					  ph.p_flags & PF_R,
-					  ph.p_flags & PF_W,
-					  ph.p_flags & PF_X);
+					  es->es_vaddr, es->es_memsz,
+					  es->es_flags & PF_R,
+					  es->es_flags & PF_W,
+					  es->es_flags & PF_X);
 		if (result) {
 			return result;
 		}
@@ -263,35 +462,25 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	 * Now actually load each segment.
 	 */
 
-	for (i=0; i<eh.e_phnum; i++) {
-		off_t offset = eh.e_phoff + i*eh.e_phentsize;
-		uio_kinit(&iov, &ku, &ph, sizeof(ph), offset, UIO_READ);
-
-		result = VOP_READ(v, &ku);
-		if (result) {
-			return result;
-		}
-
-		if (ku.uio_resid != 0) {
-			/* short read; problem with executable? */
-			kprintf("ELF: short read on phdr - file truncated?\n");
-			return ENOEXEC;
-		}
+	for (i=0; i<img.ei_nsegs; i++) {
+		es = &img.ei_segs[i];
 
-		switch (ph.p_type) {
-		    case PT_NULL: /* skip */ continue;
-		    case PT_PHDR: /* skip */ continue;
-		    case PT_MIPS_REGINFO: /* skip */ continue;
-		    case PT_LOAD: break;
-		    default:
-			kprintf("loadelf: unknown segment type %d\n", 
-				ph.p_type);
-			return ENOEXEC;
+#if OPT_A3
+		if ((es->es_flags & PF_X) && !(es->es_flags & PF_W)) {
+			/* Code: map the shared copy instead of reading it. */
+			result = as_load_text(as, v, es->es_offset,
+					      es->es_vaddr,
+					      es->es_memsz, es->es_filesz);
+			if (result) {
+				return result;
+			}
+			continue;
 		}
+#endif
 
-		result = load_segment(as, v, ph.p_offset, ph.p_vaddr, 
-				      ph.p_memsz, ph.p_filesz,
-				      ph.p_flags & PF_X);
+		result = load_segment(as, v, es->es_offset, es->es_vaddr, 
+				      es->es_memsz, es->es_filesz,
+				      es->es_flags & PF_X);
 		if (result) {
 			return result;
 		}
@@ -306,7 +495,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	as->loadelf_done = true;
 #endif
 
-	*entrypoint = eh.e_entry;
+	*entrypoint = img.ei_entry;
 
 	return 0;
 }
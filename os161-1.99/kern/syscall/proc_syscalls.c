@@ -14,6 +14,11 @@
 #include <vm.h>
 #include <vfs.h>
 #include <kern/fcntl.h>
+#include <synch.h>
+#include <test.h>
+#include <limits.h>
+#include <argbuf.h>
+#include <filetable.h>
 
   /* this implementation of sys__exit does not do anything with the exit code */
   /* this needs to be fixed to get exit() and waitpid() working properly */
@@ -22,23 +27,6 @@ void sys__exit(int exitcode) {
 
   struct addrspace *as;
   struct proc *p = curproc;
-  /* for now, just include this to keep the compiler from complaining about
-     an unused variable */
-#if OPT_A2
-  bool has_parent = true;
-  
-  if(p->parent == NULL) {
-    has_parent = false;
-  }
-
-  p->terminated = true;
-  p->exit_code = exitcode;
-  if (has_parent) {
-    lock_acquire(p->children_lk);
-    cv_signal(p->p_cv,p->children_lk);
-    lock_release(p->children_lk);
-  }
-#endif  // OPT_A2
 
   DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
 
@@ -61,9 +49,8 @@ void sys__exit(int exitcode) {
   /* if this is the last user process in the system, proc_destroy()
      will wake up the kernel menu thread */
 #if OPT_A2
-  if (has_parent == false) {
-    proc_destroy(p);
-  }
+  /* leaves p as a zombie for its parent, or destroys it if orphaned */
+  proc_exit(p, exitcode);
 #else
   proc_destroy(p);
 #endif  // OPT_A2
@@ -108,39 +95,40 @@ sys_waitpid(pid_t pid,
      Fix this!
   */
 
+#if OPT_A2
+  /* WNOHANG is the only option we support */
+  if ((options & ~WNOHANG) != 0) {
+    return(EINVAL);
+  }
+#else
   if (options != 0) {
     return(EINVAL);
   }
+#endif
   /* for now, just pretend the exitstatus is 0 */
   exitstatus = 0;
 
 #if OPT_A2
-  if(pid < 0){
+  /* a specific child, or WAIT_ANY; process groups are not supported */
+  if(pid < 0 && pid != WAIT_ANY){
     *retval = -1;
     return(ESRCH);
   }
 
-  bool is_found = false;
-  int num_of_children = array_num(curproc->children);
-  for (int i = 0; i < num_of_children; i++) {
-    struct proc* curr_child = array_get(curproc->children,i);
-    if (curr_child->pid == pid) {
-      is_found = true;
-      lock_acquire(curr_child->children_lk);
-      while (curr_child->terminated == false) {   // waiting for the child until it terminates
-        cv_wait(curr_child->p_cv, curr_child->children_lk);
-      }
-      exitstatus = _MKWAIT_EXIT(curr_child->exit_code);
-      lock_release(curr_child->children_lk);
-      break;
-    }
-  }
-  
-  if (is_found == false) {  // child is not found
+  int exitcode;
+  pid_t child_pid;
+  result = proc_wait(curproc, pid, options, &child_pid, &exitcode);
+  if (result) {
     *retval = -1;
-    return (ECHILD);
+    return result;
   }
-  
+  if (child_pid == 0) {
+    /* WNOHANG and nothing has exited yet; no status to report */
+    *retval = 0;
+    return(0);
+  }
+  exitstatus = _MKWAIT_EXIT(exitcode);
+  pid = child_pid;
 #endif
 
   result = copyout((void *)&exitstatus,status,sizeof(int));
@@ -166,19 +154,22 @@ int sys_fork(pid_t *retval, struct trapframe *tf) {
     return ENOMEM;
   }
   
-  struct addrspace *curr_addr_space = curproc_getas();
-  
-  struct addrspace *new_addr_space = as_create();
-  if (new_addr_space == NULL) {
-    // kprintf("<one>.\n");
+  // The child shares all of the parent's open files (and offsets).
+  struct filetable *ft;
+  int result = filetable_copy(curproc->p_filetable, &ft);
+  if (result) {
     proc_destroy(c_proc);
-    return ENOMEM;
+    return result;
   }
+  filetable_destroy(c_proc->p_filetable);
+  c_proc->p_filetable = ft;
+
+  struct addrspace *curr_addr_space = curproc_getas();
+  struct addrspace *new_addr_space;
   
   int err_msg = as_copy(curr_addr_space, &new_addr_space);
   if (err_msg != 0) { // // Check whether there run out of memeory
     // kprintf("<two>.\n");
-    as_destroy(new_addr_space);
     proc_destroy(c_proc);
     return ENOMEM;
   }
@@ -190,14 +181,6 @@ int sys_fork(pid_t *retval, struct trapframe *tf) {
   c_proc->p_addrspace = new_addr_space;
   spinlock_release(&c_proc->p_lock);
   
-  // Assign a PID to the child process (Done in step 1) and 
-  //  create the parent/child relationship.
-
-  spinlock_acquire(&curproc->p_lock);
-  array_add(curproc->children, c_proc, NULL);
-  c_proc->parent = curproc;
-  spinlock_release(&curproc->p_lock);
-  
   // Create a thread for child process. The OS needs a safe way to pass the 
   //  trapframe to the child thread.
   // Make a copy on the OS heap without synchronization, which is mentioned 
@@ -211,6 +194,11 @@ int sys_fork(pid_t *retval, struct trapframe *tf) {
   }
   memcpy(tf_copy, tf, sizeof(struct trapframe));
 
+  // Create the parent/child relationship (the PID was assigned in
+  //  proc_create). This must happen before the child can run, so the
+  //  child always has someone to report its exit to.
+  proc_addchild(curproc, c_proc);
+
   // The child thread needs to put the trapframe onto the
   //  stack and modify it so that it returns the current value
   //  (and executes the next instruction).
@@ -218,6 +206,7 @@ int sys_fork(pid_t *retval, struct trapframe *tf) {
   err_msg = thread_fork(c_proc->p_name, c_proc, enter_forked_process, (void*)tf_copy, data2);
   if (err_msg != 0) {
     // kprintf("<four>.\n");
+    proc_remchild(curproc, c_proc);
     kfree(tf_copy);
     as_destroy(c_proc->p_addrspace);
     proc_destroy(c_proc);
@@ -235,210 +224,201 @@ int sys_fork(pid_t *retval, struct trapframe *tf) {
 int
 sys_execv(const char *progname, char **args)
 {
-	struct addrspace *as;
-	struct vnode *v;
+	struct argbuf ab;
 	vaddr_t entrypoint, stackptr;
-	int result;
-  
-  // make sure the arguments are valid
-  KASSERT(progname != NULL);
-  KASSERT(args != NULL);
+	userptr_t argv;
+	char *name_copy;
+	size_t actual;
+	int nargs, result;
 
   // copy program name
-  size_t actual = 0;
-  size_t name_len = sizeof(char) * (strlen(progname) + 1);
-  char* name_copy = kmalloc(name_len);
+  name_copy = kmalloc(PATH_MAX);
   if (name_copy == NULL) {
     return ENOMEM;
   }
-  
-  // pass program name into kernel
-  int err_msg = copyinstr((const_userptr_t)progname, name_copy, name_len, &actual);
-  if (err_msg) {
+  result = copyinstr((const_userptr_t)progname, name_copy, PATH_MAX, &actual);
+  if (result) {
     kfree(name_copy);
-    return err_msg;
+    return result;
   }
 
-  // Count the number of arguments and copy them into the kernel.
-  // Copy program args
-  int args_count = 0;
-  for(int i = 0; args[i] != NULL; i++) {
-    args_count += 1;
-  }
-  
-  size_t args_array_size = sizeof(char *) * (args_count + 1);
-  char **args_copy = kmalloc(args_array_size);
-  if (args_copy == NULL) {
+  // Copy the arguments into the kernel, packed into one buffer.
+  argbuf_init(&ab);
+  result = argbuf_fromuser(&ab, (const_userptr_t)args);
+  if (result) {
+    argbuf_cleanup(&ab);
     kfree(name_copy);
-    return ENOMEM;
+    return result;
   }
+  nargs = ab.ab_nargs;
 
-  // Copy the program path from user space into the kernel.
-  int MAX_LEN = 128;
-  for (int i = 0; i < args_count; i++) {
-    args_copy[i] = (char *) kmalloc(sizeof(char) * MAX_LEN);
-    if(args_copy[i] == NULL) {
-      for (int j = 0; j < i; j++) {
-        kfree(args_copy[j]);
-      }
-      kfree(name_copy);
-      kfree(args_copy);
-      return ENOMEM;
-    }
+  // Load the program and put the arguments on its stack. This
+  //  replaces (and frees) the old address space only on success.
+  result = runprogram_load(name_copy, &ab, &entrypoint, &stackptr, &argv);
+  argbuf_cleanup(&ab);
+  kfree(name_copy);
+  if (result) {
+    return result;
   }
 
-  for(int i = 0; i < args_count; i++) {
-    err_msg = copyinstr((const_userptr_t)args[i], args_copy[i], MAX_LEN, &actual);
-    if(err_msg) {
-      for (int j = 0; j < args_count; j++) {
-        kfree(args_copy[j]);
-      }
-      kfree(name_copy);
-      kfree(args_copy);
-      return err_msg;
-    }
+	/* Warp to user mode. */
+  // Call enter_new_process with
+  // – the address to the arguments on the stack,
+  // – the stack pointer (from as_define_stack),
+  // – and the program entry point (from vfs_open).
+	enter_new_process(nargs, argv, stackptr, entrypoint);
+
+	/* enter_new_process does not return. */
+	panic("enter_new_process returned\n");
+	return EINVAL;
+}
+
+
+/*********************   SYS_spawn   **********************/
+/*
+ * spawn() starts a new child process running a program, without
+ * going through fork. fork+execv copies every page of the parent's
+ * address space only for execv to throw the copy away a moment
+ * later; spawn instead builds the child's address space directly
+ * from the executable.
+ *
+ * The parent waits until the child has finished loading, like
+ * vfork, so that load errors (no such file, bad executable, out of
+ * memory) come back as spawn's return value rather than as a child
+ * that dies at once. This also means the kernel copies of the
+ * program name and arguments belong to the parent the whole time.
+ */
+
+struct spawninfo {
+  char *si_progname;            /* kernel copy; vfs_open destroys it */
+  struct argbuf *si_args;
+  struct semaphore *si_loaded;  /* V'd by the child once loaded */
+  int si_result;                /* load result, valid after si_loaded */
+};
+
+static
+void
+spawn_child(void *data1, unsigned long data2)
+{
+  struct spawninfo *si = data1;
+  struct proc *p = curproc;
+  vaddr_t entrypoint, stackptr;
+  userptr_t argv;
+  int nargs, result;
+
+  (void)data2;
+
+  nargs = si->si_args->ab_nargs;
+  result = runprogram_load(si->si_progname, si->si_args,
+                           &entrypoint, &stackptr, &argv);
+  si->si_result = result;
+  /* the parent frees si once we signal; don't touch it after this */
+  V(si->si_loaded);
+
+  if (result) {
+    /* runprogram_load left us with no address space */
+    KASSERT(curproc_getas() == NULL);
+    proc_remthread(curthread);
+    proc_exit(p, 0);
+    thread_exit();
   }
 
-  args_copy[args_count] = NULL;
+  enter_new_process(nargs, argv, stackptr, entrypoint);
+  panic("enter_new_process returned\n");
+}
 
-	/* Open the file. */
-	result = vfs_open(name_copy, O_RDONLY, 0, &v);
-	if (result) {
-    for (int j = 0; j < args_count; j++) {
-      kfree(args_copy[j]);
-    }
-    kfree(name_copy);
-    kfree(args_copy);
-		return result;
-	}
-
-	/* We should be a new process. */
-	// KASSERT(curproc_getas() == NULL);
-
-	/* Create a new address space. */
-	as = as_create();
-	if (as ==NULL) {
-		vfs_close(v);
-    for (int j = 0; j < args_count; j++) {
-      kfree(args_copy[j]);
-    }
-    kfree(name_copy);
-    kfree(args_copy);
-		return ENOMEM;
-	}
-
-	/* Switch to it and activate it. */
-	struct addrspace *old_as = curproc_setas(as);
-	as_activate();
-
-	/* Load the executable. */
-	result = load_elf(v, &entrypoint);
-	if (result) {
-		/* p_addrspace will go away when curproc is destroyed */
-		vfs_close(v);
-    for (int j = 0; j < args_count; j++) {
-      kfree(args_copy[j]);
-    }
-    kfree(name_copy);
-    kfree(args_copy);
-    vfs_close(v);
-		return result;
-	}
-
-	/* Done with the file now. */
-	vfs_close(v);
-
-	/* Define the user stack in the address space */
-	result = as_define_stack(as, &stackptr);
-	if (result) {
-		/* p_addrspace will go away when curproc is destroyed */
-    for (int j = 0; j < args_count; j++) {
-      kfree(args_copy[j]);
-    }
-    kfree(name_copy);
-    kfree(args_copy);
-    as_destroy(old_as);
-		return result;
-	}
-
-  // Copy the arguments from the user space into the new address space.
-  size_t single_arg_len = 0;
-  vaddr_t ptr_size = 4;
-  vaddr_t *stack_args = kmalloc(sizeof(vaddr_t) * (args_count + 1));
-  if (stack_args == NULL) {
-    for (int j = 0; j < args_count; j++) {
-        kfree(args_copy[j]);
-      }
-      kfree(name_copy);
-      kfree(args_copy);
-      as_destroy(old_as);
-      return ENOMEM;
+/*
+ * Start a child of PARENT running PROGNAME with the arguments in AB.
+ * PROGNAME is consumed.
+ * On success the child's pid is stored in *RETPID. Also used by the
+ * kernel menu, with kproc as the parent.
+ */
+int
+proc_spawn(struct proc *parent, char *progname, struct argbuf *ab,
+           pid_t *retpid)
+{
+  struct spawninfo si;
+  struct proc *child;
+  pid_t pid;
+  int exitcode, result;
+
+  si.si_progname = progname;
+  si.si_args = ab;
+  si.si_result = 0;
+  si.si_loaded = sem_create("spawn", 0);
+  if (si.si_loaded == NULL) {
+    return ENOMEM;
   }
-  
-  stack_args[args_count] = (vaddr_t) NULL;
-  for(int i = args_count - 1; i >= 0; i--) {
-    single_arg_len = strlen(args_copy[i]) + 1;
-    stackptr -= single_arg_len;
-    stack_args[i] = stackptr;
-    err_msg = (copyout((char *)args_copy[i], (userptr_t) stackptr, single_arg_len));
-    if (err_msg) {
-      for (int j = 0; j < args_count; j++) {
-        kfree(args_copy[j]);
-      }
-      kfree(name_copy);
-      kfree(args_copy);
-      as_destroy(old_as);
-      kfree(stack_args);
-      return err_msg;
+
+  child = proc_create_runprogram(progname);
+  if (child == NULL) {
+    sem_destroy(si.si_loaded);
+    return ENOMEM;
+  }
+  pid = child->pid;
+
+  // A user process's child inherits its open files, as with fork.
+  if (parent->p_filetable != NULL) {
+    struct filetable *ft;
+
+    result = filetable_copy(parent->p_filetable, &ft);
+    if (result) {
+      proc_destroy(child);
+      sem_destroy(si.si_loaded);
+      return result;
     }
+    filetable_destroy(child->p_filetable);
+    child->p_filetable = ft;
   }
 
-  // Modify stackptr if it is not valid
-  vaddr_t reminder = stackptr % ptr_size;
-  if (reminder > 0) {
-    stackptr -= reminder;
+  proc_addchild(parent, child);
+  result = thread_fork(child->p_name, child, spawn_child, &si, 0);
+  if (result) {
+    proc_remchild(parent, child);
+    proc_destroy(child);
+    sem_destroy(si.si_loaded);
+    return result;
   }
 
-  for (int i = args_count; i >= 0 ; i--){
-    stackptr -= ptr_size;
-    err_msg = (copyout((vaddr_t *) &stack_args[i], (userptr_t) stackptr, sizeof(vaddr_t)));
-    if (err_msg) {
-      for (int j = 0; j < args_count; j++) {
-        kfree(args_copy[j]);
-      }
-      kfree(name_copy);
-      kfree(args_copy);
-      as_destroy(old_as);
-      kfree(stack_args);
-      return err_msg;
-    } 
+  P(si.si_loaded);
+  sem_destroy(si.si_loaded);
+
+  if (si.si_result) {
+    /* the child is exiting; collect it so it isn't seen by waitpid */
+    proc_wait(parent, pid, 0, &pid, &exitcode);
+    return si.si_result;
   }
 
-  // Delete the old address space (if none of the previous steps failed).
-  for (int j = 0; j < args_count; j++) {
-    kfree(args_copy[j]);
+  *retpid = pid;
+  return 0;
+}
+
+int
+sys_spawn(const_userptr_t uprogname, const_userptr_t uargs, pid_t *retval)
+{
+  struct argbuf ab;
+  char *progname;
+  size_t actual;
+  int result;
+
+  progname = kmalloc(PATH_MAX);
+  if (progname == NULL) {
+    return ENOMEM;
+  }
+  result = copyinstr(uprogname, progname, PATH_MAX, &actual);
+  if (result) {
+    kfree(progname);
+    return result;
   }
-  kfree(name_copy);
-  kfree(args_copy);
-  as_destroy(old_as);
-  kfree(stack_args);
 
-	/* Warp to user mode. */
-  // Call enter_new_process with
-  // – the address to the arguments on the stack,
-  // – the stack pointer (from as_define_stack),
-  // – and the program entry point (from vfs_open).
-  vaddr_t new_stackptr = ROUNDUP(stackptr, 8);
-	enter_new_process(args_count, 
-                    (userptr_t) stackptr,
-                    new_stackptr, 
-                    entrypoint);
-
-  // kprintf("hello~~~\n");
-	
-	/* enter_new_process does not return. */
-	panic("enter_new_process returned\n");
-	return EINVAL;
+  argbuf_init(&ab);
+  result = argbuf_fromuser(&ab, uargs);
+  if (result == 0) {
+    result = proc_spawn(curproc, progname, &ab, retval);
+  }
+  argbuf_cleanup(&ab);
+  kfree(progname);
+  return result;
 }
 
 #endif
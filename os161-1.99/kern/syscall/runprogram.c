@@ -45,7 +45,7 @@
 #include <syscall.h>
 #include <test.h>
 #include "opt-A2.h"
-#include <copyinout.h>
+#include <argbuf.h>
 
 
 /*
@@ -56,32 +56,33 @@
  */
 
 #if OPT_A2
-int runprogram(char *progname, char **args, int nargs) {
-	struct addrspace *as;
+/*
+ * Load program "progname" into a new address space for the current
+ * process, and lay out the arguments in AB on its user stack. On
+ * success hands back the entry point, the initial stack pointer, and
+ * the user address of argv; the caller finishes by calling
+ * enter_new_process.
+ *
+ * If the process already had an address space (execv, or a forked
+ * child), it is destroyed once the new one is fully set up. On error
+ * the old address space is put back and the new one thrown away.
+ *
+ * Calls vfs_open on progname and thus may destroy it.
+ */
+int
+runprogram_load(char *progname, struct argbuf *ab,
+		vaddr_t *entrypoint, vaddr_t *stackptr, userptr_t *argv)
+{
+	struct addrspace *as, *old_as;
 	struct vnode *v;
-	vaddr_t entrypoint, stackptr;
 	int result;
 
-	// make a null terminater for args
-	args[nargs] = NULL; 
-
-	vaddr_t *stack_args = kmalloc(sizeof(vaddr_t) * (nargs + 1));
-	if (stack_args == NULL) {
-      return ENOMEM;
-  	}
-	// kprintf("one\n");
-	stack_args[nargs] = (vaddr_t) NULL;
-
-
 	/* Open the file. */
 	result = vfs_open(progname, O_RDONLY, 0, &v);
 	if (result) {
 		return result;
 	}
 
-	/* We should be a new process. */
-	// KASSERT(curproc_getas() == NULL);
-
 	/* Create a new address space. */
 	as = as_create();
 	if (as ==NULL) {
@@ -90,69 +91,68 @@ int runprogram(char *progname, char **args, int nargs) {
 	}
 
 	/* Switch to it and activate it. */
-	curproc_setas(as);
+	old_as = curproc_setas(as);
 	as_activate();
 
 	/* Load the executable. */
-	result = load_elf(v, &entrypoint);
-	if (result) {
-		/* p_addrspace will go away when curproc is destroyed */
-		vfs_close(v);
-		return result;
-	}
+	result = load_elf(v, entrypoint);
 
 	/* Done with the file now. */
 	vfs_close(v);
 
+	if (result) {
+		goto fail;
+	}
+
 	/* Define the user stack in the address space */
-	result = as_define_stack(as, &stackptr);
+	result = as_define_stack(as, stackptr);
 	if (result) {
-		/* p_addrspace will go away when curproc is destroyed */
-		return result;
+		goto fail;
 	}
 
-	int single_arg_len = 0;
-	vaddr_t ptr_size = 4;
-	for(int i = nargs - 1; i >= 0; i--) {
-		single_arg_len = strlen(args[i]) + 1;
-		stackptr -= single_arg_len;
-		stack_args[i] = stackptr;
-		int err_msg = (copyout((char *)args[i], (userptr_t) stackptr, single_arg_len));
-		if (err_msg) {
-			kfree(stack_args);
-			return err_msg;
-		}
+	/* Strings and argv array go onto the stack in one piece. */
+	result = argbuf_copyout(ab, stackptr, argv);
+	if (result) {
+		goto fail;
 	}
-	// kprintf("two\n");
-	// Modify stackptr if it is not valid
-	vaddr_t reminder = stackptr % ptr_size;
-	if (reminder > 0) {
-		stackptr -= reminder;
+
+	/* The new image is complete; drop the old one. */
+	if (old_as != NULL) {
+		as_destroy(old_as);
 	}
+	return 0;
 
-	for (int i = nargs; i >= 0 ; i--){
-		stackptr -= ptr_size;
-		int err_msg = (copyout((vaddr_t *) &stack_args[i], (userptr_t) stackptr, sizeof(vaddr_t)));
-		if (err_msg) {
-			kfree(stack_args);
-			return err_msg;
-		} 
+ fail:
+	curproc_setas(old_as);
+	as_activate();
+	as_destroy(as);
+	return result;
+}
+
+int runprogram(char *progname, char **args, int nargs) {
+	struct argbuf ab;
+	vaddr_t entrypoint, stackptr;
+	userptr_t argv;
+	int result;
+
+	/* We should be a new process. */
+	// KASSERT(curproc_getas() == NULL);
+
+	argbuf_init(&ab);
+	result = argbuf_fromkernel(&ab, args, nargs);
+	if (result) {
+		argbuf_cleanup(&ab);
+		return result;
 	}
-	// kprintf("three\n");
-	kfree(stack_args);
-	// kprintf("four\n");
-	
+
+	result = runprogram_load(progname, &ab, &entrypoint, &stackptr, &argv);
+	argbuf_cleanup(&ab);
+	if (result) {
+		return result;
+	}
+
 	/* Warp to user mode. */
-	// Call enter_new_process with
-  	// – the address to the arguments on the stack,
-  	// – the stack pointer (from as_define_stack),
-  	// – and the program entry point (from vfs_open).
-	vaddr_t new_stackptr = ROUNDUP(stackptr, 8);
-	enter_new_process(nargs, 
-                    (userptr_t) stackptr,
-                    new_stackptr, 
-                    entrypoint);
-	// kprintf("five\n");
+	enter_new_process(nargs, argv, stackptr, entrypoint);
 
 	/* enter_new_process does not return. */
 	panic("enter_new_process returned\n");
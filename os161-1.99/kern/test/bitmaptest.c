@@ -28,11 +28,88 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
 #include <bitmap.h>
 #include <test.h>
 
 #define TESTSIZE 533
+#define BENCHSIZE 65536		/* bits in the benchmark bitmap */
+#define BENCHOPS 20000		/* operations per benchmark phase */
+#define BENCHRUN 8		/* run length for the range phase */
+
+/*
+ * Print how long NOPS operations took since S1/NS1.
+ */
+static
+void
+bitmaptest_report(const char *what, unsigned nops, time_t s1, uint32_t ns1)
+{
+	time_t s2, secs;
+	uint32_t ns2, nsecs;
+	uint64_t usecs;
+
+	gettime(&s2, &ns2);
+	getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+	usecs = (uint64_t)secs * 1000000 + nsecs / 1000;
+	kprintf("%s: %u ops in %lu.%09lu s (%lu ns/op)\n", what, nops,
+		(unsigned long)secs, (unsigned long)nsecs,
+		(unsigned long)(usecs * 1000 / (nops ? nops : 1)));
+}
+
+/*
+ * Time the allocator on a large bitmap: fill it, then free and
+ * reallocate single bits at random (the map stays almost full, which
+ * is the slow case for a search), then do the same with runs.
+ */
+static
+void
+bitmaptest_bench(void)
+{
+	struct bitmap *b;
+	time_t s1;
+	uint32_t ns1;
+	unsigned i, x, y;
+
+	b = bitmap_create(BENCHSIZE);
+	KASSERT(b != NULL);
+
+	gettime(&s1, &ns1);
+	for (i=0; i<BENCHSIZE; i++) {
+		if (bitmap_alloc(b, &x)) {
+			panic("bitmap bench: fill failed at %u\n", i);
+		}
+	}
+	bitmaptest_report("bitmap fill", BENCHSIZE, s1, ns1);
+	KASSERT(bitmap_nfree(b) == 0);
+
+	gettime(&s1, &ns1);
+	for (i=0; i<BENCHOPS; i++) {
+		x = random() % BENCHSIZE;
+		bitmap_unmark(b, x);
+		if (bitmap_alloc(b, &y)) {
+			panic("bitmap bench: alloc failed\n");
+		}
+		KASSERT(y == x);
+	}
+	bitmaptest_report("bitmap free/alloc", BENCHOPS, s1, ns1);
+
+	gettime(&s1, &ns1);
+	for (i=0; i<BENCHOPS; i++) {
+		x = random() % (BENCHSIZE - BENCHRUN + 1);
+		bitmap_unmark_range(b, x, BENCHRUN);
+		if (bitmap_alloc_range(b, random() % BENCHSIZE, BENCHRUN,
+				       &y)) {
+			panic("bitmap bench: range alloc failed\n");
+		}
+		KASSERT(y == x);
+	}
+	bitmaptest_report("bitmap range free/alloc", BENCHOPS, s1, ns1);
+	KASSERT(bitmap_nfree(b) == 0);
+
+	bitmap_destroy(b);
+}
 
 int
 bitmaptest(int nargs, char **args)
@@ -101,6 +178,37 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	KASSERT(bitmap_nfree(b)==0);
+
+	/* Free a few runs and get them back. */
+	bitmap_unmark_range(b, 3, 20);
+	bitmap_unmark_range(b, 100, 64);
+	bitmap_unmark(b, TESTSIZE-1);
+	KASSERT(bitmap_nfree(b)==85);
+	KASSERT(bitmap_alloc_range(b, 0, 30, &x)==0);
+	KASSERT(x==100);
+	KASSERT(bitmap_alloc_range(b, 200, 20, &x)==0);
+	KASSERT(x==3);
+	KASSERT(bitmap_alloc_range(b, 0, 40, &x)==ENOSPC);
+	KASSERT(bitmap_alloc_near(b, 120, &x)==0);
+	KASSERT(x==130);
+	KASSERT(bitmap_nfree(b)==34);
+
+	/* The free count survives a recount from the raw data. */
+	bitmap_recount(b);
+	KASSERT(bitmap_nfree(b)==34);
+
+	while (bitmap_alloc(b, &x)==0) {
+		/* nothing */
+	}
+	for (i=0; i<TESTSIZE; i++) {
+		KASSERT(bitmap_isset(b, i));
+	}
+	KASSERT(bitmap_nfree(b)==0);
+	bitmap_destroy(b);
+
+	bitmaptest_bench();
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
@@ -43,11 +43,16 @@
 #include <kern/fcntl.h>
 #include <lib.h>
 #include <uio.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
+#include <cpustat.h>
+#include <buf.h>
+#include <dcache.h>
+#include <sfs.h>
 #include <test.h>
 
 #define SLOGAN   "HODIE MIHI - CRAS TIBI\n"
@@ -313,17 +318,26 @@ static
 void
 doreadstress(const char *filesys)
 {
+	time_t s1, s2, secs;
+	uint32_t ns1, ns2, nsecs;
+	uint64_t bytes, usecs, kbps;
 	int i, err;
 
 	init_threadsem();
 
 	kprintf("*** Starting fs read stress test on %s:\n", filesys);
+	cpustat_reset(CPUSTAT_FS_BASE, CPUSTAT_FS_MAX);
 
 	if (fstest_write(filesys, "", 1, 0)) {
 		kprintf("*** Test failed\n");
 		return;
 	}
 
+	/* Read from the disk, not from what the write left cached. */
+	vfs_sync();
+	buffer_drop_clean();
+
+	gettime(&s1, &ns1);
 	for (i=0; i<NTHREADS; i++) {
 		err = thread_fork("readstress", NULL,
 				  readstress_thread, (char *)filesys, i);
@@ -336,12 +350,23 @@ doreadstress(const char *filesys)
 	for (i=0; i<NTHREADS; i++) {
 		P(threadsem);
 	}
+	gettime(&s2, &ns2);
+
+	getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+	bytes = (uint64_t)NTHREADS * NCHUNKS * strlen(SLOGAN);
+	usecs = (uint64_t)secs * 1000000 + nsecs / 1000;
+	kbps = usecs == 0 ? 0 : bytes * 1000000 / 1024 / usecs;
+	kprintf("fs read stress: %lu bytes in %lu.%09lu s (%lu KB/s)\n",
+		(unsigned long)bytes, (unsigned long)secs,
+		(unsigned long)nsecs, (unsigned long)kbps);
 
 	if (fstest_remove(filesys, "")) {
 		kprintf("*** Test failed\n");
 		return;
 	}
 	
+	buffer_printstats();
+	dcache_printstats();
 	kprintf("*** fs read stress test done\n");
 }
 
@@ -385,6 +410,7 @@ dowritestress(const char *filesys)
 	init_threadsem();
 
 	kprintf("*** Starting fs write stress test on %s:\n", filesys);
+	cpustat_reset(CPUSTAT_FS_BASE, CPUSTAT_FS_MAX);
 
 	for (i=0; i<NTHREADS; i++) {
 		err = thread_fork("writestress", NULL,
@@ -398,6 +424,10 @@ dowritestress(const char *filesys)
 		P(threadsem);
 	}
 
+	/* Include the write-back in the disk statistics. */
+	vfs_sync();
+	buffer_printstats();
+	dcache_printstats();
 	kprintf("*** fs write stress test done\n");
 }
 
@@ -429,6 +459,7 @@ dowritestress2(const char *filesys)
 	init_threadsem();
 
 	kprintf("*** Starting fs write stress test 2 on %s:\n", filesys);
+	cpustat_reset(CPUSTAT_FS_BASE, CPUSTAT_FS_MAX);
 
 	/* Create and truncate test file */
 	fstest_makename(name, sizeof(name), filesys, "");
@@ -462,6 +493,9 @@ dowritestress2(const char *filesys)
 		kprintf("*** Test failed\n");
 	}
 
+	vfs_sync();
+	buffer_printstats();
+	dcache_printstats();
 
 	kprintf("*** fs write stress test 2 done\n");
 }
@@ -537,6 +571,217 @@ docreatestress(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Hashed directory test. Puts enough names in the root directory
+ * (SFS has no mkdir) to take it past SFS_DIRHASH_MIN, so SFS switches
+ * it to the hashed layout, and enough names that hash to one bucket
+ * to need overflow blocks; then checks that lookup, remove, and
+ * rename still work. Everything is removed again at the end, but the
+ * directory stays hashed.
+ */
+
+#define DIRHASH_NCHAIN  (3 * SFS_DIRBLK_NENTRIES)
+
+static
+void
+dirhash_path(char *buf, size_t buflen, const char *fs, const char *name)
+{
+	snprintf(buf, buflen, "%s:%s", fs, name);
+	KASSERT(strlen(buf) < buflen);
+}
+
+/*
+ * Empty the name cache for the filesystem, so lookups have to go to
+ * the directory.
+ */
+static
+void
+dirhash_uncache(const char *fs)
+{
+	struct vnode *root;
+
+	if (vfs_getroot(fs, &root) == 0) {
+		dcache_purgefs(root->vn_fs);
+		VOP_DECREF(root);
+	}
+}
+
+static
+int
+dirhash_create(const char *fs, const char *name)
+{
+	struct vnode *vn;
+	char path[64];
+	int err;
+
+	dirhash_path(path, sizeof(path), fs, name);
+	err = vfs_open(path, O_WRONLY|O_CREAT|O_EXCL, 0664, &vn);
+	if (err) {
+		kprintf("Could not create %s: %s\n", name, strerror(err));
+		return -1;
+	}
+	vfs_close(vn);
+	return 0;
+}
+
+/*
+ * Check that NAME can be looked up, or if SHOULDEXIST is false, that
+ * it can't.
+ */
+static
+int
+dirhash_check(const char *fs, const char *name, bool shouldexist)
+{
+	struct vnode *vn;
+	char path[64];
+	int err;
+
+	dirhash_path(path, sizeof(path), fs, name);
+	err = vfs_open(path, O_RDONLY, 0, &vn);
+	if (err == 0) {
+		vfs_close(vn);
+	}
+	if (shouldexist && err) {
+		kprintf("Could not find %s: %s\n", name, strerror(err));
+		return -1;
+	}
+	if (!shouldexist && err != ENOENT) {
+		kprintf("%s: %s after it was removed\n", name,
+			err ? strerror(err) : "found");
+		return -1;
+	}
+	return 0;
+}
+
+static
+int
+dirhash_remove(const char *fs, const char *name)
+{
+	char path[64];
+	int err;
+
+	dirhash_path(path, sizeof(path), fs, name);
+	err = vfs_remove(path);
+	if (err) {
+		kprintf("Could not remove %s: %s\n", name, strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+static
+int
+dirhash_rename(const char *fs, const char *from, const char *to)
+{
+	char frompath[64], topath[64];
+	int err;
+
+	dirhash_path(frompath, sizeof(frompath), fs, from);
+	dirhash_path(topath, sizeof(topath), fs, to);
+	err = vfs_rename(frompath, topath);
+	if (err) {
+		kprintf("Could not rename %s to %s: %s\n", from, to,
+			strerror(err));
+		return -1;
+	}
+	if (dirhash_check(fs, from, false) || dirhash_check(fs, to, true)) {
+		return -1;
+	}
+	return 0;
+}
+
+static
+void
+dodirhashtest(const char *filesys)
+{
+	char chain[DIRHASH_NCHAIN][24];
+	char name[24];
+	uint32_t bucket;
+	unsigned i, n;
+
+	kprintf("*** Starting hashed directory test on %s:\n", filesys);
+
+	/* Pick names that all land in the same bucket. */
+	bucket = sfs_dirhash("dirhash-c0");
+	n = 0;
+	for (i=0; n<DIRHASH_NCHAIN; i++) {
+		snprintf(name, sizeof(name), "dirhash-c%u", i);
+		if (sfs_dirhash(name) == bucket) {
+			strcpy(chain[n++], name);
+		}
+	}
+
+	/* Cross the threshold, then fill the bucket past its first block. */
+	for (i=0; i<SFS_DIRHASH_MIN; i++) {
+		snprintf(name, sizeof(name), "dirhash-f%u", i);
+		if (dirhash_create(filesys, name)) {
+			goto fail;
+		}
+	}
+	for (i=0; i<DIRHASH_NCHAIN; i++) {
+		if (dirhash_create(filesys, chain[i])) {
+			goto fail;
+		}
+	}
+
+	/* Everything can be found. */
+	dirhash_uncache(filesys);
+	for (i=0; i<SFS_DIRHASH_MIN; i++) {
+		snprintf(name, sizeof(name), "dirhash-f%u", i);
+		if (dirhash_check(filesys, name, true)) {
+			goto fail;
+		}
+	}
+	for (i=0; i<DIRHASH_NCHAIN; i++) {
+		if (dirhash_check(filesys, chain[i], true)) {
+			goto fail;
+		}
+	}
+
+	/* Remove every other name in the bucket, overflow blocks too. */
+	for (i=0; i<DIRHASH_NCHAIN; i+=2) {
+		if (dirhash_remove(filesys, chain[i])) {
+			goto fail;
+		}
+	}
+	dirhash_uncache(filesys);
+	for (i=0; i<DIRHASH_NCHAIN; i++) {
+		if (dirhash_check(filesys, chain[i], i % 2 == 1)) {
+			goto fail;
+		}
+	}
+
+	/* Rename within the bucket, and into it from another one. */
+	if (dirhash_rename(filesys, chain[1], chain[0]) ||
+	    dirhash_rename(filesys, "dirhash-f0", chain[2])) {
+		goto fail;
+	}
+
+	/* Clean up. */
+	for (i=1; i<SFS_DIRHASH_MIN; i++) {
+		snprintf(name, sizeof(name), "dirhash-f%u", i);
+		if (dirhash_remove(filesys, name)) {
+			goto fail;
+		}
+	}
+	for (i=0; i<DIRHASH_NCHAIN; i++) {
+		if (i == 1 || (i > 2 && i % 2 == 0)) {
+			/* already gone */
+			continue;
+		}
+		if (dirhash_remove(filesys, chain[i])) {
+			goto fail;
+		}
+	}
+	kprintf("*** Hashed directory test done\n");
+	return;
+
+ fail:
+	kprintf("*** Test failed\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 checkfilesystem(int nargs, char **args)
@@ -544,7 +789,7 @@ checkfilesystem(int nargs, char **args)
 	char *device;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[12345] filesystem:\n");
+		kprintf("Usage: fs[123456] filesystem:\n");
 		return EINVAL;
 	}
 
@@ -576,6 +821,7 @@ DEFTEST(readstress);
 DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(createstress);
+DEFTEST(dirhashtest);
 
 ////////////////////////////////////////////////////////////
 
@@ -0,0 +1,313 @@
+/*
+ * Process launch benchmark.
+ *
+ * Starts the same user program COUNT times in two ways and reports
+ * the time for each:
+ *
+ *   spawn       - proc_spawn, the path behind the spawn() system call;
+ *                 the child's address space is built straight from
+ *                 the executable.
+ *   fork+execv  - what a shell does with fork and execv: the child
+ *                 gets a copy (as_copy) of a parent image, which is
+ *                 then replaced by loading the program.
+ *
+ * The "parent image" for the second case is the program itself,
+ * loaded once up front, so the copy is about the size of a small
+ * user process.
+ *
+ * Each child is waited for (by kproc, which acts as the parent)
+ * before the next one starts, so the numbers are per-launch latency
+ * including the run time of the program. Use something that exits
+ * immediately, like /bin/true, to measure mostly launch cost.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vfs.h>
+#include <argbuf.h>
+#include <syscall.h>
+#include <test.h>
+#include "opt-A2.h"
+
+#if OPT_A2
+
+#define LB_DEFAULT_COUNT 20
+
+struct lbfork {
+	struct addrspace *lf_parent_as;  /* image to "fork" from */
+	const char *lf_progname;
+	struct argbuf *lf_args;
+	struct semaphore *lf_loaded;
+	int lf_result;
+};
+
+/*
+ * Child side of the fork+execv model: copy the parent image, then
+ * exec the program over it.
+ */
+static
+void
+lb_forkexec_child(void *data1, unsigned long data2)
+{
+	struct lbfork *lf = data1;
+	struct proc *p = curproc;
+	struct addrspace *copy;
+	vaddr_t entrypoint, stackptr;
+	userptr_t argv;
+	char *progname;
+	int nargs, result;
+
+	(void)data2;
+
+	nargs = lf->lf_args->ab_nargs;
+
+	/* fork */
+	result = as_copy(lf->lf_parent_as, &copy);
+	if (result) {
+		goto fail;
+	}
+	curproc_setas(copy);
+	as_activate();
+
+	/* execv */
+	progname = kstrdup(lf->lf_progname);
+	if (progname == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	result = runprogram_load(progname, lf->lf_args,
+				 &entrypoint, &stackptr, &argv);
+	kfree(progname);
+
+ fail:
+	lf->lf_result = result;
+	V(lf->lf_loaded);
+
+	if (result) {
+		as_deactivate();
+		copy = curproc_setas(NULL);
+		if (copy != NULL) {
+			as_destroy(copy);
+		}
+		proc_remthread(curthread);
+		proc_exit(p, 0);
+		thread_exit();
+	}
+
+	enter_new_process(nargs, argv, stackptr, entrypoint);
+	panic("enter_new_process returned\n");
+}
+
+/*
+ * Load PROGNAME into a fresh address space to serve as the parent
+ * image for the fork+execv runs. Borrows kproc's (empty) address
+ * space slot while loading, since load_elf works on the current one.
+ */
+static
+int
+lb_load_parent(const char *progname, struct addrspace **ret)
+{
+	struct addrspace *as, *old;
+	struct vnode *v;
+	vaddr_t entrypoint;
+	char *path;
+	int result;
+
+	path = kstrdup(progname);
+	if (path == NULL) {
+		return ENOMEM;
+	}
+	result = vfs_open(path, O_RDONLY, 0, &v);
+	kfree(path);
+	if (result) {
+		return result;
+	}
+
+	as = as_create();
+	if (as == NULL) {
+		vfs_close(v);
+		return ENOMEM;
+	}
+
+	old = curproc_setas(as);
+	KASSERT(old == NULL);
+	as_activate();
+	result = load_elf(v, &entrypoint);
+	as_deactivate();
+	curproc_setas(NULL);
+	vfs_close(v);
+
+	if (result) {
+		as_destroy(as);
+		return result;
+	}
+	*ret = as;
+	return 0;
+}
+
+/*
+ * Reap child PID.
+ */
+static
+void
+lb_reap(pid_t pid)
+{
+	int exitcode;
+
+	proc_wait(kproc, pid, 0, &pid, &exitcode);
+}
+
+static
+int
+lb_spawn_one(const char *progname, struct argbuf *ab)
+{
+	char *path;
+	pid_t pid;
+	int result;
+
+	path = kstrdup(progname);
+	if (path == NULL) {
+		return ENOMEM;
+	}
+	result = proc_spawn(kproc, path, ab, &pid);
+	kfree(path);
+	if (result) {
+		return result;
+	}
+	lb_reap(pid);
+	return 0;
+}
+
+static
+int
+lb_forkexec_one(struct lbfork *lf)
+{
+	struct proc *child;
+	pid_t pid;
+	int result;
+
+	child = proc_create_runprogram(lf->lf_progname);
+	if (child == NULL) {
+		return ENOMEM;
+	}
+	pid = child->pid;
+
+	proc_addchild(kproc, child);
+	result = thread_fork(child->p_name, child, lb_forkexec_child, lf, 0);
+	if (result) {
+		proc_remchild(kproc, child);
+		proc_destroy(child);
+		return result;
+	}
+
+	P(lf->lf_loaded);
+	result = lf->lf_result;
+	lb_reap(pid);
+	return result;
+}
+
+static
+void
+lb_report(const char *what, unsigned count,
+	  time_t s1, uint32_t ns1, time_t s2, uint32_t ns2)
+{
+	time_t secs;
+	uint32_t nsecs;
+	uint64_t total;
+
+	getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+	total = (uint64_t)secs * 1000000000 + nsecs;
+	kprintf("%-10s: %u launches in %lu.%09lu s, %lu us each\n",
+		what, count, (unsigned long)secs, (unsigned long)nsecs,
+		(unsigned long)(total / count / 1000));
+}
+
+int
+launchbench(int nargs, char **args)
+{
+	struct lbfork lf;
+	struct argbuf ab;
+	const char *progname;
+	unsigned count, i;
+	time_t s1, s2;
+	uint32_t ns1, ns2;
+	int result;
+
+	if (nargs < 2 || nargs > 3) {
+		kprintf("Usage: lb program [count]\n");
+		return EINVAL;
+	}
+	progname = args[1];
+	count = LB_DEFAULT_COUNT;
+	if (nargs == 3) {
+		count = atoi(args[2]);
+		if (count == 0) {
+			kprintf("lb: count must be positive\n");
+			return EINVAL;
+		}
+	}
+
+	/* the program gets just its name as argv[0] */
+	argbuf_init(&ab);
+	result = argbuf_fromkernel(&ab, &args[1], 1);
+	if (result) {
+		argbuf_cleanup(&ab);
+		return result;
+	}
+
+	kprintf("Launching %s %u times each way...\n", progname, count);
+
+	gettime(&s1, &ns1);
+	for (i=0; i<count; i++) {
+		result = lb_spawn_one(progname, &ab);
+		if (result) {
+			kprintf("lb: spawn: %s\n", strerror(result));
+			argbuf_cleanup(&ab);
+			return result;
+		}
+	}
+	gettime(&s2, &ns2);
+	lb_report("spawn", count, s1, ns1, s2, ns2);
+
+	result = lb_load_parent(progname, &lf.lf_parent_as);
+	if (result) {
+		kprintf("lb: %s: %s\n", progname, strerror(result));
+		argbuf_cleanup(&ab);
+		return result;
+	}
+	lf.lf_progname = progname;
+	lf.lf_args = &ab;
+	lf.lf_loaded = sem_create("lb", 0);
+	if (lf.lf_loaded == NULL) {
+		as_destroy(lf.lf_parent_as);
+		argbuf_cleanup(&ab);
+		return ENOMEM;
+	}
+
+	gettime(&s1, &ns1);
+	for (i=0; i<count; i++) {
+		result = lb_forkexec_one(&lf);
+		if (result) {
+			kprintf("lb: fork+execv: %s\n", strerror(result));
+			break;
+		}
+	}
+	gettime(&s2, &ns2);
+	if (result == 0) {
+		lb_report("fork+execv", count, s1, ns1, s2, ns2);
+	}
+
+	sem_destroy(lf.lf_loaded);
+	as_destroy(lf.lf_parent_as);
+	argbuf_cleanup(&ab);
+	return result;
+}
+
+#endif /* OPT_A2 */
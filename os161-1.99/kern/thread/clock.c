@@ -120,6 +120,7 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
+	klog_tick();
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
@@ -0,0 +1,99 @@
+/*
+ * Per-cpu event counters. See <cpustat.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <cpustat.h>
+
+/*
+ * Add N to counter SLOT on the current cpu.
+ *
+ * Interrupts are disabled across the update so we can't be preempted
+ * between reading curcpu and writing the slot; otherwise we could be
+ * migrated and scribble on another cpu's counter while it updates it.
+ * This only affects the current cpu; no lock is needed.
+ */
+void
+cpustat_add(unsigned slot, uint32_t n)
+{
+	int spl;
+
+	KASSERT(slot < CPUSTAT_NSLOTS);
+
+	spl = splhigh();
+	curcpu->c_stats[slot] += n;
+	splx(spl);
+}
+
+void
+cpustat_inc(unsigned slot)
+{
+	cpustat_add(slot, 1);
+}
+
+/*
+ * Sum counter SLOT over all cpus.
+ */
+uint32_t
+cpustat_read(unsigned slot)
+{
+	unsigned i, num;
+	uint32_t total;
+
+	KASSERT(slot < CPUSTAT_NSLOTS);
+
+	total = 0;
+	num = cpu_count();
+	for (i=0; i<num; i++) {
+		total += cpu_get(i)->c_stats[slot];
+	}
+	return total;
+}
+
+/*
+ * Zero counters SLOT..SLOT+NUM-1 on all cpus.
+ */
+void
+cpustat_reset(unsigned slot, unsigned num)
+{
+	unsigned i, j, ncpus;
+	struct cpu *c;
+
+	KASSERT(slot + num <= CPUSTAT_NSLOTS);
+
+	ncpus = cpu_count();
+	for (i=0; i<ncpus; i++) {
+		c = cpu_get(i);
+		for (j=slot; j<slot+num; j++) {
+			c->c_stats[j] = 0;
+		}
+	}
+}
+
+/*
+ * Print the scheduler counters, per cpu and in total.
+ */
+void
+cpustat_sched_print(void)
+{
+	unsigned i, num;
+	struct cpu *c;
+
+	num = cpu_count();
+	for (i=0; i<num; i++) {
+		c = cpu_get(i);
+		kprintf("cpu%u: %u switches, %u idles, %u migrations\n",
+			c->c_number,
+			c->c_stats[CPUSTAT_SCHED_SWITCH],
+			c->c_stats[CPUSTAT_SCHED_IDLE],
+			c->c_stats[CPUSTAT_SCHED_MIGRATE]);
+	}
+	kprintf("total: %u switches, %u idles, %u migrations\n",
+		cpustat_read(CPUSTAT_SCHED_SWITCH),
+		cpustat_read(CPUSTAT_SCHED_IDLE),
+		cpustat_read(CPUSTAT_SCHED_MIGRATE));
+}
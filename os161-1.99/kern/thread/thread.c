@@ -38,6 +38,7 @@
 #include <lib.h>
 #include <array.h>
 #include <cpu.h>
+#include <cpustat.h>
 #include <spl.h>
 #include <spinlock.h>
 #include <wchan.h>
@@ -180,6 +181,7 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	bzero(c->c_stats, sizeof(c->c_stats));
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -227,6 +229,24 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Return the number of cpus.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+/*
+ * Return the cpu with software number NUMBER.
+ */
+struct cpu *
+cpu_get(unsigned number)
+{
+	return cpuarray_get(&allcpus, number);
+}
+
 /*
  * Destroy a thread.
  *
@@ -635,11 +655,13 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
+			curcpu->c_stats[CPUSTAT_SCHED_IDLE]++;
 			cpu_idle();
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	curcpu->c_stats[CPUSTAT_SCHED_SWITCH]++;
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -929,6 +951,7 @@ thread_consider_migration(void)
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
 			to_send--;
+			cpustat_inc(CPUSTAT_SCHED_MIGRATE);
 			if (c->c_isidle) {
 				/*
 				 * Other processor is idle; send
@@ -0,0 +1,817 @@
+/*
+ * Buffer cache. See <buf.h>.
+ *
+ * Buffers are allocated on demand up to BUF_MAX and then recycled.
+ * Every buffer holding a block is in a hash chain keyed on (device,
+ * block). A buffer that isn't pinned is also on the LRU list; the
+ * head of that list is the next one to reuse.
+ *
+ * buf_lock protects all of this. It's never held across device I/O:
+ * a buffer being read or written back is marked busy, the same as a
+ * pinned one, and anyone else who wants it waits on buf_cv.
+ *
+ * Read-ahead requests go on a small queue that one kernel thread
+ * works through, reading each block into a buffer and releasing it,
+ * so the requester doesn't wait for the disk. When the queue is full
+ * further requests are dropped; read-ahead is only a hint.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <thread.h>
+#include <cpustat.h>
+#include <device.h>
+#include <buf.h>
+
+#define BUF_MAX        128	/* most buffers we'll allocate */
+#define BUF_HASHSIZE   64	/* hash chains */
+#define BUF_RAQUEUE    32	/* read-ahead requests pending */
+
+struct buf {
+	struct device *b_dev;		/* NULL if not holding a block */
+	uint32_t b_block;
+	void *b_data;
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data newer than the disk */
+	bool b_busy;			/* pinned, or under I/O */
+	struct buf *b_hashnext;
+	struct buf *b_lruprev;		/* LRU links; only if !b_busy */
+	struct buf *b_lrunext;
+};
+
+static struct lock *buf_lock;
+static struct cv *buf_cv;		/* a busy buffer was released */
+
+static struct buf *buf_hash[BUF_HASHSIZE];
+static struct buf *buf_lruhead;		/* least recently used */
+static struct buf *buf_lrutail;		/* most recently used */
+static struct buf *buf_all[BUF_MAX];
+static unsigned buf_count;
+
+/* Read-ahead queue (a ring) */
+static struct {
+	struct device *ra_dev;
+	uint32_t ra_block;
+} buf_raqueue[BUF_RAQUEUE];
+static unsigned buf_rahead, buf_racount;
+static struct cv *buf_racv;		/* read-ahead was queued */
+static struct device *buf_radev;	/* device being read ahead, or NULL */
+
+////////////////////////////////////////////////////////////
+//
+// Hash and LRU lists. Call with buf_lock held.
+
+static
+unsigned
+buf_hashfunc(struct device *dev, uint32_t block)
+{
+	return (block + (uintptr_t)dev / sizeof(*dev)) % BUF_HASHSIZE;
+}
+
+static
+struct buf *
+buf_hash_find(struct device *dev, uint32_t block)
+{
+	struct buf *b;
+
+	for (b = buf_hash[buf_hashfunc(dev, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buf_hash_insert(struct buf *b)
+{
+	unsigned h;
+
+	h = buf_hashfunc(b->b_dev, b->b_block);
+	b->b_hashnext = buf_hash[h];
+	buf_hash[h] = b;
+}
+
+static
+void
+buf_hash_remove(struct buf *b)
+{
+	struct buf **bp;
+
+	for (bp = &buf_hash[buf_hashfunc(b->b_dev, b->b_block)];
+	     *bp != NULL; bp = &(*bp)->b_hashnext) {
+		if (*bp == b) {
+			*bp = b->b_hashnext;
+			b->b_hashnext = NULL;
+			b->b_dev = NULL;
+			return;
+		}
+	}
+	panic("buf: block %u not in hash table\n", b->b_block);
+}
+
+static
+void
+buf_lru_remove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buf_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buf_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+/* Put B at the most recently used end. */
+static
+void
+buf_lru_append(struct buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = buf_lrutail;
+	if (buf_lrutail != NULL) {
+		buf_lrutail->b_lrunext = b;
+	}
+	else {
+		buf_lruhead = b;
+	}
+	buf_lrutail = b;
+}
+
+/* Put B at the reuse-first end (for buffers holding nothing). */
+static
+void
+buf_lru_prepend(struct buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = buf_lruhead;
+	if (buf_lruhead != NULL) {
+		buf_lruhead->b_lruprev = b;
+	}
+	else {
+		buf_lrutail = b;
+	}
+	buf_lruhead = b;
+}
+
+/*
+ * Unpin B: put it back on the LRU list and wake anyone waiting.
+ */
+static
+void
+buf_unbusy(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_busy);
+
+	b->b_busy = false;
+	if (b->b_dev != NULL) {
+		buf_lru_append(b);
+	}
+	else {
+		buf_lru_prepend(b);
+	}
+	cv_broadcast(buf_cv, buf_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Device I/O
+
+/*
+ * Read or write the blocks of the N buffers BS, which must hold
+ * consecutive blocks of one device, as a single device request. The
+ * buffers must be busy; buf_lock must not be held.
+ */
+static
+int
+buf_io(struct buf *const *bs, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[BUF_MAXRUN];
+	struct uio ku;
+	struct device *dev = bs[0]->b_dev;
+	uint32_t block = bs[0]->b_block;
+	unsigned i;
+	int result;
+	int tries=0;
+
+	KASSERT(n > 0 && n <= BUF_MAXRUN);
+	KASSERT(!lock_do_i_hold(buf_lock));
+	for (i=0; i<n; i++) {
+		KASSERT(bs[i]->b_busy);
+		KASSERT(bs[i]->b_dev == dev);
+		KASSERT(bs[i]->b_block == block + i);
+	}
+
+	DEBUG(DB_VFS, "buf: %s %u+%u\n", rw == UIO_READ ? "read" : "write",
+	      block, n);
+
+ retry:
+	/* (the uio is used up by each attempt, so set it up every time) */
+	for (i=0; i<n; i++) {
+		iov[i].iov_kbase = bs[i]->b_data;
+		iov[i].iov_len = BUFFER_SIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)block * BUFFER_SIZE;
+	ku.uio_resid = n * BUFFER_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+	result = dev->d_io(dev, &ku);
+	if (result == EINVAL) {
+		/*
+		 * This means the sector we requested was out of range,
+		 * or the seek address we gave wasn't sector-aligned,
+		 * or a couple of other things that are our fault.
+		 */
+		panic("buf: d_io returned EINVAL\n");
+	}
+	if (result == EIO) {
+		if (tries == 0) {
+			tries++;
+			kprintf("buf: block %u I/O error, retrying\n",
+				block);
+			goto retry;
+		}
+		else if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		else {
+			kprintf("buf: block %u I/O error, giving up after "
+				"%d retries\n", block, tries);
+		}
+	}
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Getting buffers
+
+static
+struct buf *
+buf_create(void)
+{
+	struct buf *b;
+
+	b = kmalloc(sizeof(*b));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->b_data = kmalloc(BUFFER_SIZE);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	b->b_dev = NULL;
+	b->b_block = 0;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_busy = false;
+	b->b_hashnext = NULL;
+	b->b_lruprev = b->b_lrunext = NULL;
+	return b;
+}
+
+/*
+ * Find a buffer to hold a new block: a fresh one if we're under
+ * BUF_MAX, otherwise the least recently used, written back first if
+ * it's dirty. Hands it back busy and holding nothing, or NULL if all
+ * buffers are pinned. May drop buf_lock while writing back.
+ */
+static
+int
+buf_reuse(struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	if (buf_count < BUF_MAX) {
+		b = buf_create();
+		if (b != NULL) {
+			buf_all[buf_count++] = b;
+			b->b_busy = true;
+			*ret = b;
+			return 0;
+		}
+		if (buf_lruhead == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	b = buf_lruhead;
+	if (b == NULL) {
+		*ret = NULL;
+		return 0;
+	}
+	buf_lru_remove(b);
+	b->b_busy = true;
+
+	if (b->b_dev != NULL && b->b_dirty) {
+		lock_release(buf_lock);
+		result = buf_io(&b, 1, UIO_WRITE);
+		lock_acquire(buf_lock);
+		if (result) {
+			buf_unbusy(b);
+			return result;
+		}
+		b->b_dirty = false;
+		cpustat_inc(CPUSTAT_FS_BUFWRITE);
+	}
+	if (b->b_dev != NULL) {
+		buf_hash_remove(b);
+		cpustat_inc(CPUSTAT_FS_BUFEVICT);
+	}
+	b->b_valid = false;
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Common code for buffer_read and buffer_get.
+ */
+static
+int
+buf_acquire(struct device *dev, uint32_t block, bool doread,
+	    struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUFFER_SIZE);
+
+	lock_acquire(buf_lock);
+	while (1) {
+		b = buf_hash_find(dev, block);
+		if (b != NULL) {
+			if (b->b_busy) {
+				cv_wait(buf_cv, buf_lock);
+				continue;
+			}
+			buf_lru_remove(b);
+			b->b_busy = true;
+			cpustat_inc(CPUSTAT_FS_BUFHIT);
+			break;
+		}
+
+		result = buf_reuse(&b);
+		if (result) {
+			lock_release(buf_lock);
+			return result;
+		}
+		if (b == NULL) {
+			/* everything's pinned; wait for something */
+			cv_wait(buf_cv, buf_lock);
+			continue;
+		}
+		if (buf_hash_find(dev, block) != NULL) {
+			/* someone loaded it while buf_reuse slept */
+			buf_unbusy(b);
+			continue;
+		}
+		b->b_dev = dev;
+		b->b_block = block;
+		b->b_dirty = false;
+		buf_hash_insert(b);
+		break;
+	}
+	lock_release(buf_lock);
+
+	if (!b->b_valid) {
+		if (doread) {
+			cpustat_inc(CPUSTAT_FS_BUFMISS);
+			result = buf_io(&b, 1, UIO_READ);
+			if (result) {
+				lock_acquire(buf_lock);
+				buf_hash_remove(b);
+				buf_unbusy(b);
+				lock_release(buf_lock);
+				return result;
+			}
+			b->b_valid = true;
+		}
+		else {
+			/* becomes valid when the caller marks it dirty */
+			bzero(b->b_data, BUFFER_SIZE);
+		}
+	}
+
+	*ret = b;
+	return 0;
+}
+
+int
+buffer_read(struct device *dev, uint32_t block, struct buf **ret)
+{
+	return buf_acquire(dev, block, true, ret);
+}
+
+int
+buffer_get(struct device *dev, uint32_t block, struct buf **ret)
+{
+	return buf_acquire(dev, block, false, ret);
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+bool
+buffer_valid(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_valid;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dev != NULL);
+	b->b_valid = true;
+	b->b_dirty = true;
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	if (!b->b_valid) {
+		/* from buffer_get and never filled in; forget it */
+		buf_hash_remove(b);
+	}
+	buf_unbusy(b);
+	lock_release(buf_lock);
+}
+
+/*
+ * Make sure blocks BLOCK through BLOCK+COUNT-1 of DEV are cached,
+ * reading each stretch of them that isn't with a single device
+ * request (of at most BUF_MAXRUN blocks). This is only a way of
+ * getting blocks in faster, so it gives up rather than wait for
+ * buffers if everything is pinned. Blocks read here count as
+ * prefetched, not as misses; the buffer_read that follows counts
+ * the hit.
+ */
+int
+buffer_readrun(struct device *dev, uint32_t block, unsigned count)
+{
+	struct buf *run[BUF_MAXRUN];
+	struct buf *b;
+	unsigned i, j, n;
+	bool stop;
+	int result, err;
+
+	KASSERT(dev->d_blocksize == BUFFER_SIZE);
+
+	result = 0;
+	stop = false;
+	i = 0;
+
+	lock_acquire(buf_lock);
+	while (i < count && !stop) {
+		/* Collect buffers for the next stretch of uncached blocks. */
+		n = 0;
+		while (i < count && n < BUF_MAXRUN) {
+			if (buf_hash_find(dev, block + i) != NULL) {
+				if (n > 0) {
+					break;
+				}
+				i++;
+				continue;
+			}
+			err = buf_reuse(&b);
+			if (err || b == NULL) {
+				stop = true;
+				break;
+			}
+			if (buf_hash_find(dev, block + i) != NULL) {
+				/* someone loaded it while buf_reuse slept */
+				buf_unbusy(b);
+				continue;
+			}
+			b->b_dev = dev;
+			b->b_block = block + i;
+			b->b_dirty = false;
+			buf_hash_insert(b);
+			run[n++] = b;
+			i++;
+		}
+		if (n == 0) {
+			continue;
+		}
+
+		lock_release(buf_lock);
+		err = buf_io(run, n, UIO_READ);
+		lock_acquire(buf_lock);
+
+		for (j=0; j<n; j++) {
+			if (err) {
+				buf_hash_remove(run[j]);
+			}
+			else {
+				run[j]->b_valid = true;
+				cpustat_inc(CPUSTAT_FS_BUFPREFETCH);
+			}
+			buf_unbusy(run[j]);
+		}
+		if (err) {
+			result = err;
+			break;
+		}
+	}
+	lock_release(buf_lock);
+
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Read-ahead
+
+void
+buffer_readahead(struct device *dev, uint32_t block)
+{
+	unsigned i;
+
+	lock_acquire(buf_lock);
+	if (buf_racount < BUF_RAQUEUE && buf_hash_find(dev, block) == NULL) {
+		i = (buf_rahead + buf_racount) % BUF_RAQUEUE;
+		buf_raqueue[i].ra_dev = dev;
+		buf_raqueue[i].ra_block = block;
+		buf_racount++;
+		cv_signal(buf_racv, buf_lock);
+	}
+	lock_release(buf_lock);
+}
+
+/*
+ * The read-ahead thread.
+ */
+static
+void
+buf_rathread(void *unused1, unsigned long unused2)
+{
+	struct device *dev;
+	uint32_t block;
+	unsigned n;
+
+	(void)unused1;
+	(void)unused2;
+
+	lock_acquire(buf_lock);
+	while (1) {
+		while (buf_racount == 0) {
+			cv_wait(buf_racv, buf_lock);
+		}
+		dev = buf_raqueue[buf_rahead].ra_dev;
+		block = buf_raqueue[buf_rahead].ra_block;
+		buf_rahead = (buf_rahead + 1) % BUF_RAQUEUE;
+		buf_racount--;
+
+		if (dev == NULL) {
+			/* cancelled */
+			continue;
+		}
+
+		/* Take any requests for the blocks that follow as well. */
+		n = 1;
+		while (buf_racount > 0 && n < BUF_MAXRUN &&
+		       buf_raqueue[buf_rahead].ra_dev == dev &&
+		       buf_raqueue[buf_rahead].ra_block == block + n) {
+			buf_rahead = (buf_rahead + 1) % BUF_RAQUEUE;
+			buf_racount--;
+			n++;
+		}
+
+		buf_radev = dev;
+		cpustat_add(CPUSTAT_FS_BUFRA, n);
+		lock_release(buf_lock);
+
+		/* errors will be seen again by whoever reads it for real */
+		buffer_readrun(dev, block, n);
+
+		lock_acquire(buf_lock);
+		buf_radev = NULL;
+		cv_broadcast(buf_cv, buf_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Whole-cache operations
+
+void
+buffer_drop(struct device *dev, uint32_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buf_lock);
+	while ((b = buf_hash_find(dev, block)) != NULL && b->b_busy) {
+		cv_wait(buf_cv, buf_lock);
+	}
+	if (b != NULL) {
+		buf_lru_remove(b);
+		buf_hash_remove(b);
+		b->b_valid = false;
+		b->b_dirty = false;
+		buf_lru_prepend(b);
+	}
+	lock_release(buf_lock);
+}
+
+/*
+ * Write back DEV's dirty buffers in one sweep up the disk, lowest
+ * block first, writing runs of consecutive blocks together. A dirty
+ * buffer that's pinned is waited for rather than skipped, since its
+ * owner may only be reading it; so callers mustn't have any of DEV's
+ * buffers pinned.
+ */
+int
+buffer_sync(struct device *dev)
+{
+	struct buf *run[BUF_MAXRUN];
+	struct buf *b, *c;
+	uint32_t next;
+	unsigned i, n;
+	int result, err;
+
+	result = 0;
+	next = 0;
+
+	lock_acquire(buf_lock);
+	while (1) {
+		b = NULL;
+		for (i=0; i<buf_count; i++) {
+			c = buf_all[i];
+			if (c->b_dev == dev && c->b_dirty &&
+			    c->b_block >= next &&
+			    (b == NULL || c->b_block < b->b_block)) {
+				b = c;
+			}
+		}
+		if (b == NULL) {
+			break;
+		}
+		if (b->b_busy) {
+			/* wait for it, then look again */
+			cv_wait(buf_cv, buf_lock);
+			continue;
+		}
+		/* Write it along with any dirty blocks right after it. */
+		n = 0;
+		do {
+			buf_lru_remove(b);
+			b->b_busy = true;
+			run[n++] = b;
+		} while (n < BUF_MAXRUN &&
+			 (b = buf_hash_find(dev, run[0]->b_block + n)) != NULL &&
+			 b->b_dirty && !b->b_busy);
+		next = run[0]->b_block + n;
+
+		lock_release(buf_lock);
+		err = buf_io(run, n, UIO_WRITE);
+		lock_acquire(buf_lock);
+
+		if (err) {
+			result = err;
+		}
+		for (i=0; i<n; i++) {
+			if (!err) {
+				run[i]->b_dirty = false;
+				cpustat_inc(CPUSTAT_FS_BUFWRITE);
+			}
+			buf_unbusy(run[i]);
+		}
+	}
+	lock_release(buf_lock);
+
+	return result;
+}
+
+void
+buffer_drop_all(struct device *dev)
+{
+	struct buf *b;
+	unsigned i, j;
+
+	lock_acquire(buf_lock);
+
+	/* Cancel read-ahead for DEV and wait out any in progress. */
+	for (i=0; i<buf_racount; i++) {
+		j = (buf_rahead + i) % BUF_RAQUEUE;
+		if (buf_raqueue[j].ra_dev == dev) {
+			buf_raqueue[j].ra_dev = NULL;
+		}
+	}
+	while (buf_radev == dev) {
+		cv_wait(buf_cv, buf_lock);
+	}
+
+	for (i=0; i<buf_count; i++) {
+		b = buf_all[i];
+		if (b->b_dev != dev) {
+			continue;
+		}
+		KASSERT(!b->b_busy);
+		if (b->b_dirty) {
+			kprintf("buf: discarding dirty block %u\n",
+				b->b_block);
+		}
+		buf_lru_remove(b);
+		buf_hash_remove(b);
+		b->b_valid = false;
+		b->b_dirty = false;
+		buf_lru_prepend(b);
+	}
+	lock_release(buf_lock);
+}
+
+/*
+ * Forget every clean buffer nobody has pinned, so that whatever runs
+ * next starts with a cold cache. For benchmarks.
+ */
+void
+buffer_drop_clean(void)
+{
+	struct buf *b;
+	unsigned i;
+
+	lock_acquire(buf_lock);
+	for (i=0; i<buf_count; i++) {
+		b = buf_all[i];
+		if (b->b_dev == NULL || b->b_busy || b->b_dirty) {
+			continue;
+		}
+		buf_lru_remove(b);
+		buf_hash_remove(b);
+		b->b_valid = false;
+		buf_lru_prepend(b);
+	}
+	lock_release(buf_lock);
+}
+
+void
+buffer_printstats(void)
+{
+	uint32_t hits, misses;
+
+	hits = cpustat_read(CPUSTAT_FS_BUFHIT);
+	misses = cpustat_read(CPUSTAT_FS_BUFMISS);
+	kprintf("buffer cache: %u hits, %u misses (%u%% hits), "
+		"%u read ahead, %u prefetched, %u evictions, "
+		"%u blocks written\n",
+		hits, misses,
+		hits + misses == 0 ? 0 : hits * 100 / (hits + misses),
+		cpustat_read(CPUSTAT_FS_BUFRA),
+		cpustat_read(CPUSTAT_FS_BUFPREFETCH),
+		cpustat_read(CPUSTAT_FS_BUFEVICT),
+		cpustat_read(CPUSTAT_FS_BUFWRITE));
+	kprintf("disk: %u requests, %u merged, %u sectors of seeking\n",
+		cpustat_read(CPUSTAT_FS_DEVREQ),
+		cpustat_read(CPUSTAT_FS_DEVMERGE),
+		cpustat_read(CPUSTAT_FS_DEVSEEK));
+}
+
+void
+buffer_bootstrap(void)
+{
+	int result;
+
+	buf_lock = lock_create("buffer cache");
+	if (buf_lock == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	buf_cv = cv_create("buffer cache");
+	if (buf_cv == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	buf_racv = cv_create("read-ahead");
+	if (buf_racv == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	result = thread_fork("readahead", NULL, buf_rathread, NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
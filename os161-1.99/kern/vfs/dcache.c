@@ -0,0 +1,317 @@
+/*
+ * Directory name lookup cache. See <dcache.h>.
+ *
+ * Entries live in a fixed array and are handed out in order until it
+ * fills up; after that the least recently used entry is recycled.
+ * Every entry in use is in a hash chain keyed on (directory, name).
+ * All entries that have ever been handed out are on the LRU list;
+ * free ones are kept at the head so they're reused first.
+ *
+ * Everything here is covered by dcache_lock, a spinlock, so lookups
+ * that hit don't have to lock the directory. References are dropped
+ * only after the entry has been unhooked and the lock released, since
+ * VOP_DECREF may reclaim the vnode and call back into the filesystem.
+ */
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpustat.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <dcache.h>
+
+#define DCACHE_MAX       128	/* entries */
+#define DCACHE_HASHSIZE  64	/* hash chains */
+
+struct dcentry {
+	struct vnode *dc_dir;		/* NULL if the entry is free */
+	struct vnode *dc_vn;		/* NULL if negative */
+	char dc_name[DCACHE_NAMELEN+1];
+	struct dcentry *dc_hashnext;
+	struct dcentry *dc_lruprev;
+	struct dcentry *dc_lrunext;
+};
+
+static struct dcentry dcache_entries[DCACHE_MAX];
+static unsigned dcache_count;		/* entries ever handed out */
+static struct dcentry *dcache_hash[DCACHE_HASHSIZE];
+static struct dcentry *dcache_lruhead;	/* least recently used */
+static struct dcentry *dcache_lrutail;	/* most recently used */
+static struct spinlock dcache_lock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////////////////////////
+//
+// Hash and LRU lists.
+
+static
+unsigned
+dcache_hashfunc(struct vnode *dir, const char *name)
+{
+	unsigned h;
+
+	h = (uintptr_t)dir / sizeof(*dir);
+	while (*name) {
+		h = h * 31 + (unsigned char)*name++;
+	}
+	return h % DCACHE_HASHSIZE;
+}
+
+/* Find the link pointing to the entry for (DIR, NAME), or NULL. */
+static
+struct dcentry **
+dcache_find(struct vnode *dir, const char *name)
+{
+	struct dcentry **ep;
+
+	for (ep = &dcache_hash[dcache_hashfunc(dir, name)]; *ep != NULL;
+	     ep = &(*ep)->dc_hashnext) {
+		if ((*ep)->dc_dir == dir && !strcmp((*ep)->dc_name, name)) {
+			return ep;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+dcache_lru_remove(struct dcentry *e)
+{
+	if (e->dc_lruprev != NULL) {
+		e->dc_lruprev->dc_lrunext = e->dc_lrunext;
+	}
+	else {
+		dcache_lruhead = e->dc_lrunext;
+	}
+	if (e->dc_lrunext != NULL) {
+		e->dc_lrunext->dc_lruprev = e->dc_lruprev;
+	}
+	else {
+		dcache_lrutail = e->dc_lruprev;
+	}
+	e->dc_lruprev = e->dc_lrunext = NULL;
+}
+
+/* Put E at the most recently used end. */
+static
+void
+dcache_lru_append(struct dcentry *e)
+{
+	e->dc_lrunext = NULL;
+	e->dc_lruprev = dcache_lrutail;
+	if (dcache_lrutail != NULL) {
+		dcache_lrutail->dc_lrunext = e;
+	}
+	else {
+		dcache_lruhead = e;
+	}
+	dcache_lrutail = e;
+}
+
+/* Put E at the reuse-first end (for free entries). */
+static
+void
+dcache_lru_prepend(struct dcentry *e)
+{
+	e->dc_lruprev = NULL;
+	e->dc_lrunext = dcache_lruhead;
+	if (dcache_lruhead != NULL) {
+		dcache_lruhead->dc_lruprev = e;
+	}
+	else {
+		dcache_lrutail = e;
+	}
+	dcache_lruhead = e;
+}
+
+/*
+ * Free the entry that *EP points to. Its references are handed back
+ * in *DIR and *VN for the caller to drop once it lets go of the lock.
+ */
+static
+void
+dcache_unhook(struct dcentry **ep, struct vnode **dir, struct vnode **vn)
+{
+	struct dcentry *e = *ep;
+
+	*ep = e->dc_hashnext;
+	e->dc_hashnext = NULL;
+	*dir = e->dc_dir;
+	*vn = e->dc_vn;
+	e->dc_dir = NULL;
+	e->dc_vn = NULL;
+	dcache_lru_remove(e);
+	dcache_lru_prepend(e);
+}
+
+/* Drop the references dcache_unhook handed back. */
+static
+void
+dcache_drop(struct vnode *dir, struct vnode *vn)
+{
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+/*
+ * Get a free entry, recycling the least recently used one if needed;
+ * the references of a recycled entry come back as for dcache_unhook.
+ */
+static
+struct dcentry *
+dcache_alloc(struct vnode **dir, struct vnode **vn)
+{
+	struct dcentry *e;
+
+	*dir = *vn = NULL;
+
+	if (dcache_count < DCACHE_MAX) {
+		e = &dcache_entries[dcache_count++];
+		dcache_lru_prepend(e);
+		return e;
+	}
+
+	e = dcache_lruhead;
+	KASSERT(e != NULL);
+	if (e->dc_dir != NULL) {
+		dcache_unhook(dcache_find(e->dc_dir, e->dc_name), dir, vn);
+	}
+	KASSERT(e->dc_dir == NULL);
+	return e;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+bool
+dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct dcentry **ep, *e;
+
+	if (strlen(name) > DCACHE_NAMELEN) {
+		return false;
+	}
+
+	spinlock_acquire(&dcache_lock);
+	ep = dcache_find(dir, name);
+	if (ep == NULL) {
+		spinlock_release(&dcache_lock);
+		cpustat_inc(CPUSTAT_FS_DCMISS);
+		return false;
+	}
+
+	e = *ep;
+	dcache_lru_remove(e);
+	dcache_lru_append(e);
+
+	if (e->dc_vn != NULL) {
+		VOP_INCREF(e->dc_vn);
+	}
+	*ret = e->dc_vn;
+	spinlock_release(&dcache_lock);
+
+	cpustat_inc(CPUSTAT_FS_DCHIT);
+	return true;
+}
+
+void
+dcache_enter(struct vnode *dir, const char *name, struct vnode *vn)
+{
+	struct dcentry **ep, *e;
+	struct vnode *olddir, *oldvn;
+	unsigned h;
+
+	if (strlen(name) > DCACHE_NAMELEN) {
+		return;
+	}
+
+	/* Take the new references before locking. */
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+
+	spinlock_acquire(&dcache_lock);
+	ep = dcache_find(dir, name);
+	if (ep != NULL) {
+		/* Reuse the entry; it already holds DIR. */
+		e = *ep;
+		olddir = dir;
+		oldvn = e->dc_vn;
+		e->dc_vn = vn;
+	}
+	else {
+		e = dcache_alloc(&olddir, &oldvn);
+		e->dc_dir = dir;
+		e->dc_vn = vn;
+		strcpy(e->dc_name, name);
+
+		h = dcache_hashfunc(dir, name);
+		e->dc_hashnext = dcache_hash[h];
+		dcache_hash[h] = e;
+	}
+	dcache_lru_remove(e);
+	dcache_lru_append(e);
+	spinlock_release(&dcache_lock);
+
+	dcache_drop(olddir, oldvn);
+}
+
+void
+dcache_remove(struct vnode *dir, const char *name)
+{
+	struct dcentry **ep;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	if (strlen(name) > DCACHE_NAMELEN) {
+		return;
+	}
+
+	spinlock_acquire(&dcache_lock);
+	ep = dcache_find(dir, name);
+	if (ep != NULL) {
+		dcache_unhook(ep, &olddir, &oldvn);
+	}
+	spinlock_release(&dcache_lock);
+
+	dcache_drop(olddir, oldvn);
+}
+
+void
+dcache_purgefs(struct fs *fs)
+{
+	struct dcentry *e;
+	struct vnode *olddir, *oldvn;
+	unsigned i;
+
+	for (i=0; i<DCACHE_MAX; i++) {
+		olddir = oldvn = NULL;
+
+		spinlock_acquire(&dcache_lock);
+		e = &dcache_entries[i];
+		if (i < dcache_count && e->dc_dir != NULL &&
+		    e->dc_dir->vn_fs == fs) {
+			dcache_unhook(dcache_find(e->dc_dir, e->dc_name),
+				      &olddir, &oldvn);
+		}
+		spinlock_release(&dcache_lock);
+
+		dcache_drop(olddir, oldvn);
+	}
+}
+
+void
+dcache_printstats(void)
+{
+	uint32_t hits, misses;
+
+	hits = cpustat_read(CPUSTAT_FS_DCHIT);
+	misses = cpustat_read(CPUSTAT_FS_DCMISS);
+	kprintf("name cache: %u hits, %u misses (%u%% hits)\n",
+		hits, misses,
+		hits + misses == 0 ? 0 : hits * 100 / (hits + misses));
+}
@@ -39,10 +39,16 @@
 #include <lib.h>
 #include <array.h>
 #include <synch.h>
+#include <thread.h>
+#include <clock.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <buf.h>
+#include <dcache.h>
+#include <vm.h>
+#include <addrspace.h>
 
 /*
  * Structure for a single named device.
@@ -60,6 +66,10 @@
  * kd_fs      - Filesystem object mounted on, or associated with, this
  *              device. NULL if there is no filesystem. 
  *
+ * kd_busy    - Number of vfs_getroot calls getting the root of kd_fs
+ *              without holding knowndevs_lock. Unmount waits for it
+ *              to drop to 0.
+ *
  * A filesystem can be associated with a device without having been
  * mounted if the device was created that way. In this case,
  * kd_rawname is NULL (prohibiting mount/unmount), and, as there is
@@ -80,6 +90,7 @@ struct knowndev {
 	struct device *kd_device;
 	struct vnode *kd_vnode;
 	struct fs *kd_fs;
+	unsigned kd_busy;
 };
 
 DECLARRAY(knowndev);
@@ -87,10 +98,42 @@ DEFARRAY(knowndev, /*no inline*/);
 
 static struct knowndevarray *knowndevs;
 
-/* The big lock for all FS ops. Remove for filesystem assignment. */
-static struct lock *vfs_biglock;
-static unsigned vfs_biglock_depth;
+/*
+ * knowndevs_lock protects the knowndevs table, including kd_fs and
+ * kd_busy. Getting a filesystem's root can sleep, so vfs_getroot does
+ * it without the lock, with kd_busy raised so the filesystem can't be
+ * unmounted in the middle of that; knowndevs_cv is signalled when
+ * kd_busy goes back to 0.
+ *
+ * vfs_mountlock serializes mount, unmount, and sync, so that a sync
+ * can work on a filesystem without holding knowndevs_lock and getting
+ * in the way of name lookups. Take it before knowndevs_lock.
+ *
+ * Filesystems do their own locking; nothing here is held across
+ * ordinary file operations.
+ */
+static struct lock *knowndevs_lock;
+static struct cv *knowndevs_cv;
+static struct lock *vfs_mountlock;
 
+/*
+ * The syncer thread. Filesystem writes normally only reach the buffer
+ * cache and in-memory inodes and freemaps; this writes everything
+ * back every VFS_SYNCINTERVAL seconds, which bounds how much a crash
+ * can lose without making writers wait for the disk.
+ */
+static
+void
+vfs_syncer(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		clocksleep(VFS_SYNCINTERVAL);
+		vfs_sync();
+	}
+}
 
 /*
  * Setup function
@@ -98,51 +141,37 @@ static unsigned vfs_biglock_depth;
 void
 vfs_bootstrap(void)
 {
+	int result;
+
 	knowndevs = knowndevarray_create();
 	if (knowndevs==NULL) {
 		panic("vfs: Could not create knowndevs array\n");
 	}
 
-	vfs_biglock = lock_create("vfs_biglock");
-	if (vfs_biglock==NULL) {
-		panic("vfs: Could not create vfs big lock\n");
+	knowndevs_lock = lock_create("knowndevs");
+	if (knowndevs_lock==NULL) {
+		panic("vfs: Could not create knowndevs lock\n");
 	}
-	vfs_biglock_depth = 0;
 
-	devnull_create();
-}
-
-/*
- * Operations on vfs_biglock. We make it recursive to avoid having to
- * think about where we do and don't already hold it. This is an
- * undesirable hack that's frequently necessary when a lock covers too
- * much material. Your solution scheme for FS and VFS locking should
- * not require recursive locks.
- */
-void
-vfs_biglock_acquire(void)
-{
-	if (!lock_do_i_hold(vfs_biglock)) {
-		lock_acquire(vfs_biglock);
+	knowndevs_cv = cv_create("knowndevs");
+	if (knowndevs_cv==NULL) {
+		panic("vfs: Could not create knowndevs cv\n");
 	}
-	vfs_biglock_depth++;
-}
 
-void
-vfs_biglock_release(void)
-{
-	KASSERT(lock_do_i_hold(vfs_biglock));
-	KASSERT(vfs_biglock_depth > 0);
-	vfs_biglock_depth--;
-	if (vfs_biglock_depth == 0) {
-		lock_release(vfs_biglock);
+	vfs_mountlock = lock_create("vfs_mount");
+	if (vfs_mountlock==NULL) {
+		panic("vfs: Could not create mount lock\n");
 	}
-}
 
-bool
-vfs_biglock_do_i_hold(void)
-{
-	return lock_do_i_hold(vfs_biglock);
+	buffer_bootstrap();
+
+	devnull_create();
+
+	result = thread_fork("syncer", NULL, vfs_syncer, NULL, 0);
+	if (result) {
+		panic("vfs: Could not start syncer thread: %s\n",
+		      strerror(result));
+	}
 }
 
 /*
@@ -152,19 +181,28 @@ int
 vfs_sync(void)
 {
 	struct knowndev *dev;
+	struct fs *fs;
 	unsigned i, num;
 
-	vfs_biglock_acquire();
+	lock_acquire(vfs_mountlock);
 
+	lock_acquire(knowndevs_lock);
 	num = knowndevarray_num(knowndevs);
+	lock_release(knowndevs_lock);
+
 	for (i=0; i<num; i++) {
+		/* kd_fs can't change while we hold vfs_mountlock */
+		lock_acquire(knowndevs_lock);
 		dev = knowndevarray_get(knowndevs, i);
-		if (dev->kd_fs != NULL) {
-			/*result =*/ FSOP_SYNC(dev->kd_fs);
+		fs = dev->kd_fs;
+		lock_release(knowndevs_lock);
+
+		if (fs != NULL) {
+			/*result =*/ FSOP_SYNC(fs);
 		}
 	}
 
-	vfs_biglock_release();
+	lock_release(vfs_mountlock);
 
 	return 0;
 }
@@ -174,12 +212,16 @@ vfs_sync(void)
  * back an appropriate vnode.
  */
 int
-vfs_getroot(const char *devname, struct vnode **result)
+vfs_getroot(const char *devname, struct vnode **ret)
 {
 	struct knowndev *kd;
+	struct fs *fs;
 	unsigned i, num;
+	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	lock_acquire(knowndevs_lock);
+	result = ENODEV;
+	fs = NULL;
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -200,14 +242,18 @@ vfs_getroot(const char *devname, struct vnode **result)
 
 			if (!strcmp(kd->kd_name, devname) ||
 			    (volname!=NULL && !strcmp(volname, devname))) {
-				*result = FSOP_GETROOT(kd->kd_fs);
-				return 0;
+				/* get the root below, unlocked */
+				fs = kd->kd_fs;
+				kd->kd_busy++;
+				result = 0;
+				break;
 			}
 		}
 		else {
 			if (kd->kd_rawname!=NULL &&
 			    !strcmp(kd->kd_name, devname)) {
-				return ENXIO;
+				result = ENXIO;
+				break;
 			}
 		}
 
@@ -221,8 +267,9 @@ vfs_getroot(const char *devname, struct vnode **result)
 			KASSERT(kd->kd_rawname==NULL);
 			KASSERT(kd->kd_device != NULL);
 			VOP_INCREF(kd->kd_vnode);
-			*result = kd->kd_vnode;
-			return 0;
+			*ret = kd->kd_vnode;
+			result = 0;
+			break;
 		}
 
 		/*
@@ -232,8 +279,9 @@ vfs_getroot(const char *devname, struct vnode **result)
 		if (kd->kd_rawname!=NULL && !strcmp(kd->kd_rawname, devname)) {
 			KASSERT(kd->kd_device != NULL);
 			VOP_INCREF(kd->kd_vnode);
-			*result = kd->kd_vnode;
-			return 0;
+			*ret = kd->kd_vnode;
+			result = 0;
+			break;
 		}
 
 		/*
@@ -244,10 +292,39 @@ vfs_getroot(const char *devname, struct vnode **result)
 	}
 
 	/*
-	 * If we got here, the device specified by devname doesn't exist.
+	 * If we got to the end, the device specified by devname
+	 * doesn't exist, and RESULT is still ENODEV.
 	 */
 
-	return ENODEV;
+	lock_release(knowndevs_lock);
+
+	if (fs != NULL) {
+		*ret = FSOP_GETROOT(fs);
+
+		lock_acquire(knowndevs_lock);
+		KASSERT(kd->kd_busy > 0);
+		kd->kd_busy--;
+		if (kd->kd_busy == 0) {
+			cv_broadcast(knowndevs_cv, knowndevs_lock);
+		}
+		lock_release(knowndevs_lock);
+	}
+	return result;
+}
+
+/*
+ * Wait until nobody is getting the root of KD's filesystem. Called
+ * with knowndevs_lock held, before unmounting; since the lock is held
+ * from here on, nobody new can start.
+ */
+static
+void
+knowndev_waitidle(struct knowndev *kd)
+{
+	KASSERT(lock_do_i_hold(knowndevs_lock));
+	while (kd->kd_busy > 0) {
+		cv_wait(knowndevs_cv, knowndevs_lock);
+	}
 }
 
 /*
@@ -257,11 +334,12 @@ const char *
 vfs_getdevname(struct fs *fs)
 {
 	struct knowndev *kd;
+	const char *name = NULL;
 	unsigned i, num;
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
+	lock_acquire(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -274,11 +352,13 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
-			return kd->kd_name;
+			name = kd->kd_name;
+			break;
 		}
 	}
 
-	return NULL;
+	lock_release(knowndevs_lock);
+	return name;
 }
 
 /*
@@ -338,7 +418,7 @@ badnames(const char *n1, const char *n2, const char *n3)
 	unsigned i, num;
 	struct knowndev *kd;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -378,7 +458,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	unsigned index;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(knowndevs_lock);
 
 	name = kstrdup(dname);
 	if (name==NULL) {
@@ -406,13 +486,14 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	kd->kd_device = dev;
 	kd->kd_vnode = vnode;
 	kd->kd_fs = fs;
+	kd->kd_busy = 0;
 
 	if (fs!=NULL) {
 		volname = FSOP_GETVOLNAME(fs);
 	}
 
 	if (badnames(name, rawname, volname)) {
-		vfs_biglock_release();
+		lock_release(knowndevs_lock);
 		return EEXIST;
 	}
 
@@ -423,7 +504,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		dev->d_devnumber = index+1;
 	}
 
-	vfs_biglock_release();
+	lock_release(knowndevs_lock);
 	return result;
 
  nomem:
@@ -441,7 +522,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		kfree(kd);
 	}
 	
-	vfs_biglock_release();
+	lock_release(knowndevs_lock);
 	return ENOMEM;
 }
 
@@ -480,7 +561,7 @@ findmount(const char *devname, struct knowndev **result)
 	unsigned i, num;
 	bool found = false;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; !found && i<num; i++) {
@@ -514,36 +595,47 @@ vfs_mount(const char *devname, void *data,
 	struct fs *fs;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(vfs_mountlock);
+	lock_acquire(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(knowndevs_lock);
+		lock_release(vfs_mountlock);
 		return result;
 	}
 
 	if (kd->kd_fs != NULL) {
-		vfs_biglock_release();
+		lock_release(knowndevs_lock);
+		lock_release(vfs_mountlock);
 		return EBUSY;
 	}
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/*
+	 * Mounting does I/O; don't keep lookups waiting for it. The
+	 * mount lock keeps anyone else from mounting here meanwhile.
+	 */
+	lock_release(knowndevs_lock);
+
 	result = mountfunc(data, kd->kd_device, &fs);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(vfs_mountlock);
 		return result;
 	}
 
 	KASSERT(fs != NULL);
 
+	lock_acquire(knowndevs_lock);
 	kd->kd_fs = fs;
+	lock_release(knowndevs_lock);
 
 	volname = FSOP_GETVOLNAME(fs);
 	kprintf("vfs: Mounted %s: on %s\n",
 		volname ? volname : kd->kd_name, kd->kd_name);
 
-	vfs_biglock_release();
+	lock_release(vfs_mountlock);
 	return 0;
 }
 
@@ -557,7 +649,8 @@ vfs_unmount(const char *devname)
 	struct knowndev *kd;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(vfs_mountlock);
+	lock_acquire(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -571,6 +664,16 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	knowndev_waitidle(kd);
+
+	/*
+	 * Cached names, code pages and ELF headers hold vnodes; let go
+	 * of them first.
+	 */
+	dcache_purgefs(kd->kd_fs);
+	textcache_purgefs(kd->kd_fs);
+	elfcache_purgefs(kd->kd_fs);
+
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
 		goto fail;
@@ -589,7 +692,8 @@ vfs_unmount(const char *devname)
 	KASSERT(result==0);
 
  fail:
-	vfs_biglock_release();
+	lock_release(knowndevs_lock);
+	lock_release(vfs_mountlock);
 	return result;
 }
 
@@ -603,7 +707,8 @@ vfs_unmountall(void)
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(vfs_mountlock);
+	lock_acquire(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -619,6 +724,11 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		knowndev_waitidle(dev);
+		dcache_purgefs(dev->kd_fs);
+		textcache_purgefs(dev->kd_fs);
+		elfcache_purgefs(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -650,7 +760,8 @@ vfs_unmountall(void)
 		dev->kd_fs = NULL;
 	}
 
-	vfs_biglock_release();
+	lock_release(knowndevs_lock);
+	lock_release(vfs_mountlock);
 
 	return 0;
 }
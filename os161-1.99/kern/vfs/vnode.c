@@ -33,9 +33,12 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <atomic.h>
 #include <synch.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <vm.h>
+#include <addrspace.h>
 
 /*
  * Initialize an abstract vnode.
@@ -51,6 +54,7 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	vn->vn_ops = ops;
 	vn->vn_refcount = 1;
 	vn->vn_opencount = 0;
+	vn->vn_modgen = 0;
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
 	return 0;
@@ -83,17 +87,15 @@ vnode_incref(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
-	vn->vn_refcount++;
-
-	vfs_biglock_release();
+	atomic_add(&vn->vn_refcount, 1);
 }
 
 /*
  * Decrement refcount.
  * Called by VOP_DECREF.
- * Calls VOP_RECLAIM if the refcount hits zero.
+ * Calls VOP_RECLAIM if the refcount hits zero. The last reference is
+ * left in place for VOP_RECLAIM to check with vnode_lastref, since
+ * the vnode can be picked up again before the filesystem locks it.
  */
 void
 vnode_decref(struct vnode *vn)
@@ -102,13 +104,7 @@ vnode_decref(struct vnode *vn)
 
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
-	KASSERT(vn->vn_refcount>0);
-	if (vn->vn_refcount>1) {
-		vn->vn_refcount--;
-	}
-	else {
+	if (vnode_lastref(vn)) {
 		result = VOP_RECLAIM(vn);
 		if (result != 0 && result != EBUSY) {
 			// XXX: lame.
@@ -116,8 +112,31 @@ vnode_decref(struct vnode *vn)
 				strerror(result));
 		}
 	}
+}
+
+/*
+ * Check, from VOP_RECLAIM, that the last reference is still the last.
+ * See vnode.h.
+ */
+bool
+vnode_lastref(struct vnode *vn)
+{
+	int refs;
+
+	/*
+	 * Drop our reference unless it's the only one. Once it is,
+	 * nobody else can add one (apart from the filesystem, which
+	 * is held off by its lock), so the count can't change under us.
+	 */
+	do {
+		refs = vn->vn_refcount;
+		KASSERT(refs > 0);
+		if (refs == 1) {
+			return true;
+		}
+	} while (atomic_cas(&vn->vn_refcount, refs, refs - 1) != refs);
 
-	vfs_biglock_release();
+	return false;
 }
 
 /*
@@ -129,9 +148,7 @@ vnode_incopen(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-	vn->vn_opencount++;
-	vfs_biglock_release();
+	atomic_add(&vn->vn_opencount, 1);
 }
 
 /*
@@ -141,17 +158,15 @@ vnode_incopen(struct vnode *vn)
 void
 vnode_decopen(struct vnode *vn)
 {
+	int opens;
 	int result;
 
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
+	opens = atomic_add(&vn->vn_opencount, -1);
+	KASSERT(opens >= 0);
 
-	KASSERT(vn->vn_opencount>0);
-	vn->vn_opencount--;
-
-	if (vn->vn_opencount > 0) {
-		vfs_biglock_release();
+	if (opens > 0) {
 		return;
 	}
 
@@ -162,19 +177,18 @@ vnode_decopen(struct vnode *vn)
 		// doesn't get reached...
 		kprintf("vfs: Warning: VOP_CLOSE: %s\n", strerror(result));
 	}
-
-	vfs_biglock_release();
 }
 
 /*
  * Check for various things being valid.
  * Called before all VOP_* calls.
+ *
+ * The counts may be changing underneath us; this is only a sanity
+ * check.
  */
 void
 vnode_check(struct vnode *v, const char *opstr)
 {
-	vfs_biglock_acquire();
-
 	if (v == NULL) {
 		panic("vnode_check: vop_%s: null vnode\n", opstr);
 	}
@@ -222,6 +236,17 @@ vnode_check(struct vnode *v, const char *opstr)
 		kprintf("vnode_check: vop_%s: warning: large opencount %d\n", 
 			opstr, v->vn_opencount);
 	}
+}
+
+/*
+ * Drop anything cached about the contents of VN. See vnode.h.
+ */
+void
+vnode_modified(struct vnode *vn)
+{
+	vnode_check(vn, "modified");
 
-	vfs_biglock_release();
+	atomic_add(&vn->vn_modgen, 1);
+	textcache_invalidate(vn);
+	elfcache_invalidate(vn);
 }
@@ -0,0 +1,385 @@
+/*
+ * Text page cache.
+ *
+ * Keeps the read-only code pages of executables in memory, keyed by
+ * vnode and file offset, so that every process running a given
+ * program maps the same physical frames instead of reading its own
+ * copy. See as_load_text in the VM system.
+ *
+ * The cache holds one reference on each page (see coremap_incref)
+ * and one vnode reference per cached file, so cached pages survive
+ * between runs of a program. Pages nobody maps are given back when
+ * the VM system runs short (textcache_reclaim); a file's pages are
+ * dropped when the file is written (textcache_invalidate).
+ *
+ * textcache_reclaim can be called from deep inside kmalloc, where we
+ * must not sleep; VOP_DECREF can sleep (dropping the last reference
+ * reclaims the vnode, which takes filesystem locks), so it's never
+ * called with the cache lock held. So reclaim only unhooks files it
+ * has emptied and leaves them on a list; the vnode references are
+ * dropped later, by the next call that can sleep (textcache_drain).
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+#include "opt-A3.h"
+
+#if OPT_A3
+
+#define TEXTCACHE_BUCKETS 32
+
+/* One cached page. */
+struct textpage {
+	off_t tp_offset;		/* file offset of the page's start */
+	off_t tp_lo, tp_hi;		/* file range it was filled from */
+	paddr_t tp_paddr;
+	struct textpage *tp_next;
+};
+
+/* The cached pages of one executable. */
+struct textfile {
+	struct vnode *tf_vn;		/* referenced */
+	struct textpage *tf_pages;
+	struct textfile *tf_next;
+};
+
+static struct spinlock textcache_lock = SPINLOCK_INITIALIZER;
+static struct textfile *textcache[TEXTCACHE_BUCKETS];
+static struct textfile *textcache_dead;	/* emptied; vnode to release */
+
+static
+unsigned
+textcache_hash(struct vnode *v)
+{
+	return ((uintptr_t)v / sizeof(struct vnode)) % TEXTCACHE_BUCKETS;
+}
+
+/* Find V's entry and the link pointing to it. Call with the lock held. */
+static
+struct textfile **
+textcache_findfile(struct vnode *v)
+{
+	struct textfile **tfp;
+
+	KASSERT(spinlock_do_i_hold(&textcache_lock));
+	for (tfp = &textcache[textcache_hash(v)]; *tfp != NULL;
+	     tfp = &(*tfp)->tf_next) {
+		if ((*tfp)->tf_vn == v) {
+			return tfp;
+		}
+	}
+	return NULL;
+}
+
+static
+struct textpage *
+textcache_findpage(struct textfile *tf, off_t offset, off_t lo, off_t hi)
+{
+	struct textpage *tp;
+
+	for (tp = tf->tf_pages; tp != NULL; tp = tp->tp_next) {
+		if (tp->tp_offset == offset &&
+		    tp->tp_lo == lo && tp->tp_hi == hi) {
+			return tp;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Release the vnodes of files emptied by textcache_reclaim.
+ */
+static
+void
+textcache_drain(void)
+{
+	struct textfile *tf;
+
+	while (1) {
+		spinlock_acquire(&textcache_lock);
+		tf = textcache_dead;
+		if (tf != NULL) {
+			textcache_dead = tf->tf_next;
+		}
+		spinlock_release(&textcache_lock);
+
+		if (tf == NULL) {
+			break;
+		}
+		KASSERT(tf->tf_pages == NULL);
+		VOP_DECREF(tf->tf_vn);
+		kfree(tf);
+	}
+}
+
+/*
+ * Read the page at file offset OFFSET, restricted to [LO, HI), into
+ * a fresh physical page.
+ */
+static
+int
+textcache_readpage(struct vnode *v, off_t offset, off_t lo, off_t hi,
+		   paddr_t *ret)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t kva;
+	off_t start, end;
+	int result;
+
+	kva = alloc_kpages(1);
+	if (kva == 0) {
+		return ENOMEM;
+	}
+	bzero((void *)kva, PAGE_SIZE);
+
+	start = offset > lo ? offset : lo;
+	end = offset + PAGE_SIZE < hi ? offset + PAGE_SIZE : hi;
+	if (start < end) {
+		uio_kinit(&iov, &ku, (void *)(kva + (vaddr_t)(start - offset)),
+			  end - start, start, UIO_READ);
+		result = VOP_READ(v, &ku);
+		if (result == 0 && ku.uio_resid != 0) {
+			/* short read; problem with executable? */
+			kprintf("ELF: short read on segment - "
+				"file truncated?\n");
+			result = ENOEXEC;
+		}
+		if (result) {
+			free_kpages(kva);
+			return result;
+		}
+	}
+
+	*ret = KVADDR_TO_PADDR(kva);
+	return 0;
+}
+
+int
+textcache_getpage(struct vnode *v, off_t offset, off_t lo, off_t hi,
+		  paddr_t *ret)
+{
+	struct textfile **tfp, *tf, *newtf;
+	struct textpage *tp, *newtp;
+	paddr_t paddr;
+	int modgen;
+	int result;
+
+	textcache_drain();
+
+	spinlock_acquire(&textcache_lock);
+	tfp = textcache_findfile(v);
+	if (tfp != NULL) {
+		tp = textcache_findpage(*tfp, offset, lo, hi);
+		if (tp != NULL) {
+			coremap_incref(tp->tp_paddr);
+			*ret = tp->tp_paddr;
+			spinlock_release(&textcache_lock);
+			return 0;
+		}
+	}
+	spinlock_release(&textcache_lock);
+
+	/*
+	 * Miss: read the page, then add it (unless someone beat us, or
+	 * the file changed meanwhile; see vnode_modified).
+	 */
+	modgen = v->vn_modgen;
+	result = textcache_readpage(v, offset, lo, hi, &paddr);
+	if (result) {
+		return result;
+	}
+
+	newtp = kmalloc(sizeof(*newtp));
+	newtf = kmalloc(sizeof(*newtf));
+	if (newtp == NULL || newtf == NULL) {
+		/* Can't cache it; hand out a private page instead. */
+		kfree(newtp);
+		kfree(newtf);
+		*ret = paddr;
+		return 0;
+	}
+	newtp->tp_offset = offset;
+	newtp->tp_lo = lo;
+	newtp->tp_hi = hi;
+	newtp->tp_paddr = paddr;
+
+	spinlock_acquire(&textcache_lock);
+	if (v->vn_modgen != modgen) {
+		/* What we read may be stale; don't cache it. */
+		spinlock_release(&textcache_lock);
+		kfree(newtp);
+		kfree(newtf);
+		*ret = paddr;
+		return 0;
+	}
+	tfp = textcache_findfile(v);
+	if (tfp == NULL) {
+		/* the new file entry holds a reference to V */
+		VOP_INCREF(v);
+		newtf->tf_vn = v;
+		newtf->tf_pages = NULL;
+		newtf->tf_next = textcache[textcache_hash(v)];
+		textcache[textcache_hash(v)] = newtf;
+		tf = newtf;
+		newtf = NULL;
+	}
+	else {
+		tf = *tfp;
+	}
+
+	tp = textcache_findpage(tf, offset, lo, hi);
+	if (tp != NULL) {
+		coremap_incref(tp->tp_paddr);
+		*ret = tp->tp_paddr;
+		spinlock_release(&textcache_lock);
+		free_kpages(PADDR_TO_KVADDR(paddr));
+		kfree(newtp);
+	}
+	else {
+		/* one reference for the cache, one for the caller */
+		coremap_incref(paddr);
+		newtp->tp_next = tf->tf_pages;
+		tf->tf_pages = newtp;
+		*ret = paddr;
+		spinlock_release(&textcache_lock);
+	}
+
+	kfree(newtf);
+	return 0;
+}
+
+void
+textcache_invalidate(struct vnode *v)
+{
+	struct textfile **tfp, *tf;
+	struct textpage *tp;
+
+	spinlock_acquire(&textcache_lock);
+	tfp = textcache_findfile(v);
+	if (tfp == NULL) {
+		spinlock_release(&textcache_lock);
+		return;
+	}
+	tf = *tfp;
+	*tfp = tf->tf_next;
+	spinlock_release(&textcache_lock);
+
+	while ((tp = tf->tf_pages) != NULL) {
+		tf->tf_pages = tp->tp_next;
+		free_kpages(PADDR_TO_KVADDR(tp->tp_paddr));
+		kfree(tp);
+	}
+	/* Our caller is using V, so this is never the last reference. */
+	VOP_DECREF(tf->tf_vn);
+	kfree(tf);
+
+	textcache_drain();
+}
+
+void
+textcache_purgefs(struct fs *fs)
+{
+	struct textfile **tfp, *tf, *victims;
+	struct textpage *tp;
+	unsigned i;
+
+	/* Files already emptied by textcache_reclaim go first */
+	textcache_drain();
+
+	victims = NULL;
+
+	spinlock_acquire(&textcache_lock);
+	for (i=0; i<TEXTCACHE_BUCKETS; i++) {
+		tfp = &textcache[i];
+		while ((tf = *tfp) != NULL) {
+			if (tf->tf_vn->vn_fs == fs) {
+				*tfp = tf->tf_next;
+				tf->tf_next = victims;
+				victims = tf;
+			}
+			else {
+				tfp = &tf->tf_next;
+			}
+		}
+	}
+	spinlock_release(&textcache_lock);
+
+	while ((tf = victims) != NULL) {
+		victims = tf->tf_next;
+		while ((tp = tf->tf_pages) != NULL) {
+			tf->tf_pages = tp->tp_next;
+			free_kpages(PADDR_TO_KVADDR(tp->tp_paddr));
+			kfree(tp);
+		}
+		VOP_DECREF(tf->tf_vn);
+		kfree(tf);
+	}
+}
+
+unsigned
+textcache_reclaim(void)
+{
+	struct textfile **tfp, *tf;
+	struct textpage **tpp, *tp, *victims;
+	unsigned i, count;
+
+	victims = NULL;
+
+	spinlock_acquire(&textcache_lock);
+	for (i=0; i<TEXTCACHE_BUCKETS; i++) {
+		tfp = &textcache[i];
+		while ((tf = *tfp) != NULL) {
+			tpp = &tf->tf_pages;
+			while ((tp = *tpp) != NULL) {
+				if (coremap_refcount(tp->tp_paddr) == 1) {
+					/* only the cache has it */
+					*tpp = tp->tp_next;
+					tp->tp_next = victims;
+					victims = tp;
+				}
+				else {
+					tpp = &tp->tp_next;
+				}
+			}
+			if (tf->tf_pages == NULL) {
+				*tfp = tf->tf_next;
+				tf->tf_next = textcache_dead;
+				textcache_dead = tf;
+			}
+			else {
+				tfp = &tf->tf_next;
+			}
+		}
+	}
+	spinlock_release(&textcache_lock);
+
+	count = 0;
+	while ((tp = victims) != NULL) {
+		victims = tp->tp_next;
+		free_kpages(PADDR_TO_KVADDR(tp->tp_paddr));
+		kfree(tp);
+		count++;
+	}
+	return count;
+}
+
+#else /* !OPT_A3 */
+
+void
+textcache_invalidate(struct vnode *v)
+{
+	(void)v;
+}
+
+void
+textcache_purgefs(struct fs *fs)
+{
+	(void)fs;
+}
+
+#endif /* OPT_A3 */
@@ -2,24 +2,17 @@
 
 /* belongs in kern/vm/uw-vmstats.c */
 
-/* NOTE !!!!!! WARNING !!!!!
- * All of the functions whose names begin with '_'
- * assume that atomicity is ensured elsewhere
- * (i.e., outside of these routines) by acquiring stats_lock.
- * All of the functions whose names do not begin
- * with '_' ensure atomicity locally.
+/* The counts are kept in the per-cpu counter slots CPUSTAT_VM_BASE ..
+ * CPUSTAT_VM_BASE+VMSTAT_COUNT-1 (see cpustat.h). Incrementing only touches
+ * the current cpu's slot, so no lock is needed; printing sums over all cpus.
  */
 
 #include <types.h>
 #include <lib.h>
-#include <synch.h>
-#include <spl.h>
+#include <cpustat.h>
 #include <uw-vmstats.h>
 
-/* Counters for tracking statistics */
-static unsigned int stats_counts[VMSTAT_COUNT];
-
-struct spinlock stats_lock = SPINLOCK_INITIALIZER;
+#define VMSTAT_SLOT(index) (CPUSTAT_VM_BASE + (index))
 
 /* Strings used in printing out the statistics */
 static const char *stats_names[] = {
@@ -41,55 +34,45 @@ static const char *stats_names[] = {
 void
 vmstats_inc(unsigned int index)
 {
-    spinlock_acquire(&stats_lock);
-      _vmstats_inc(index);
-    spinlock_release(&stats_lock);
+  KASSERT(index < VMSTAT_COUNT);
+  cpustat_inc(VMSTAT_SLOT(index));
 }
 
 /* ---------------------------------------------------------------------- */
 void
 vmstats_init(void)
 {
-  /* Although the spinlock is initialized at declaration time we do it here
-   * again in case we want use/reset these stats repeatedly without shutting down the kernel.
+  /* Counters are zeroed when each cpu is created; we reset them here
+   * in case we want use/reset these stats repeatedly without shutting down the kernel.
    */
-  spinlock_init(&stats_lock);
-
-  spinlock_acquire(&stats_lock);
-    _vmstats_init();
-  spinlock_release(&stats_lock);
+  _vmstats_init();
 }
 
 /* ---------------------------------------------------------------------- */
 void
 _vmstats_inc(unsigned int index)
 {
-  KASSERT(index < VMSTAT_COUNT);
-  stats_counts[index]++;
+  vmstats_inc(index);
 }
 
 /* ---------------------------------------------------------------------- */
 void
 _vmstats_init(void)
 {
-  int i = 0;
-
   if (sizeof(stats_names) / sizeof(char *) != VMSTAT_COUNT) {
     kprintf("vmstats_init: number of stats_names = %d != VMSTAT_COUNT = %d\n",
       (sizeof(stats_names) / sizeof(char *)), VMSTAT_COUNT);
     panic("Should really fix this before proceeding\n");
   }
+  KASSERT(VMSTAT_COUNT <= CPUSTAT_VM_MAX);
 
-  for (i=0; i<VMSTAT_COUNT; i++) {
-    stats_counts[i] = 0;
-  }
-
+  cpustat_reset(VMSTAT_SLOT(0), VMSTAT_COUNT);
 }
 
 /* ---------------------------------------------------------------------- */
 /* Assumes vmstat_init has already been called */
-/* NOTE: We do not grab the spinlock here because kprintf may block
- * and we can't block while holding a spinlock.
+/* NOTE: The totals are summed without stopping other cpus, so counts
+ * that happen while printing may or may not be included.
  * Just use this when there is only one thread remaining.
  */
 
@@ -102,6 +85,11 @@ vmstats_print(void)
   int tlb_faults = 0;
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
+  unsigned int stats_counts[VMSTAT_COUNT];
+
+  for (i=0; i<VMSTAT_COUNT; i++) {
+    stats_counts[i] = cpustat_read(VMSTAT_SLOT(i));
+  }
 
   kprintf("VMSTATS:\n");
   for (i=0; i<VMSTAT_COUNT; i++) {